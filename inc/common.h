@@ -15,16 +15,37 @@
 #define DEBUG_LOADER 0x80
 #define DEBUG_PARSEINST 0x100
 
+// the categories compiled in, e.g. cmake -DDEBUG_VERBOSE_SET=0x21
+// debug_printf of the other categories compiles to nothing
+#ifndef DEBUG_VERBOSE_SET
 #define DEBUG_VERBOSE_SET 0x1
+#endif
 
 // do page walk
-#define DEBUG_ENABLE_PAGE_WALK 0
+#define DEBUG_ENABLE_PAGE_WALK 1
 
 // use sram cache for memory access
 #define DEBUG_ENABLE_SRAM_CACHE 0
 
-// printf wrapper
-uint64_t debug_printf(uint64_t open_set, const char *format, ...);
+// the categories printed at run time, DEBUG_VERBOSE_SET at startup
+// only the categories compiled in can be turned on
+extern uint64_t debug_verbose_set;
+void set_debug_verbose(uint64_t open_set);
+
+// the category is compiled in and turned on
+// the arguments of a category off are not evaluated
+#define debug_enabled(open_set) \
+    (((open_set) & DEBUG_VERBOSE_SET) != 0x0 && __builtin_expect((__atomic_load_n(&debug_verbose_set, __ATOMIC_RELAXED) & (open_set)) != 0x0, 0))
+
+// printf wrapper to stderr
+#define debug_printf(open_set, ...)      \
+    do {                                 \
+        if (debug_enabled(open_set)) {   \
+            debug_output(__VA_ARGS__);   \
+        }                                \
+    } while (0)
+
+void debug_output(const char *format, ...);
 
 // type converter
 // uint32 to its equivalent float with rounding
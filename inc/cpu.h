@@ -179,6 +179,59 @@ typedef union CPU_FLAGS_STRUCT {
         uint16_t OF;
     };
 } cpu_flag_t;
+
+// the operation whose condition flags are not computed yet
+typedef enum FLAGS_OPERATION {
+    FLAGS_OP_NONE,  // 0: cpu_flag_t holds the flags
+    FLAGS_OP_RESET, // 1: all flags are 0
+    FLAGS_OP_ADD,   // 2: val = dst + src
+    FLAGS_OP_SUB,   // 3: val = dst - src
+} flags_op_t;
+
+// the last flag-setting operation with its operands and result
+// the flags are computed from it only when an instruction reads them
+typedef struct LAZY_FLAGS_STRUCT {
+    uint64_t op; // flags_op_t
+    uint64_t src;
+    uint64_t dst;
+    uint64_t val;
+} lazy_flags_t;
+/*======================================*/
+/*      translation lookaside buffer    */
+/*======================================*/
+
+// set associative: the low bits of the virtual page number select the set
+#define TLB_SET_INDEX_LENGTH 4
+#define NUM_TLB_SET (1 << TLB_SET_INDEX_LENGTH)
+#define NUM_TLB_WAY 4
+
+typedef struct TLB_ENTRY_STRUCT {
+    uint64_t valid;
+    uint64_t vpn;  // tag: virtual page number
+    uint64_t ppn;  // physical page number
+    uint64_t time; // last access, for LRU replacement
+} tlb_entry_t;
+
+typedef struct TLB_STRUCT {
+    tlb_entry_t set[NUM_TLB_SET][NUM_TLB_WAY];
+    uint64_t time;
+    uint64_t hit;
+    uint64_t miss;
+} tlb_t;
+
+// the pages mapped by the page faults of a core, in the order of the clock algorithm
+typedef struct RESIDENT_PAGE_STRUCT {
+    uint64_t pte_paddr; // the leaf pte mapping the page
+    uint64_t vpn;
+} resident_page_t;
+
+typedef struct RESIDENT_SET_STRUCT {
+    resident_page_t *page;
+    uint64_t num_page;
+    uint64_t max_page;
+    uint64_t hand; // the clock hand
+} resident_set_t;
+
 /*======================================*/
 /*      cpu core                        */
 /*======================================*/
@@ -190,6 +243,9 @@ typedef struct CORE_STRUCT {
         uint32_t eip;
     };
 
+    // encoding of the instructions fetched by the core
+    uint64_t encoding;
+
     // condition code flags of most recent (latest) operation
     // condition codes will only be set by the following integer arithmetic instructions
 
@@ -216,23 +272,135 @@ typedef struct CORE_STRUCT {
         cmp     compare
         test    test
     */
+    // flags is up to date only when lazy_flags.op is FLAGS_OP_NONE
+    // read them by read_ZF() or evaluate_cflags()
     cpu_flag_t flags;
+    lazy_flags_t lazy_flags;
     // register files
     reg_t reg;
+
+    // physical address of the PML4 table, 0 before the first translation
+    uint64_t cr3;
+    // translations of the core
+    tlb_t tlb;
 } core_t;
 
 // define cpu core array to support core level parallelism
+// e.g. cmake -DNUM_CORES=4
+#ifndef NUM_CORES
 #define NUM_CORES 1
+#endif
 extern core_t cores[NUM_CORES];
 // active core for current task
 extern uint64_t ACTIVE_CORE;
 
+// instruction encodings
+// text: the assembly string padded to MAX_INSTRUCTION_CHAR bytes
+// binary: the variable length x86-64 machine code, at most MAX_INSTRUCTION_BYTE bytes
+#define INST_ENCODING_TEXT 0
+#define INST_ENCODING_BINARY 1
+
 #define MAX_INSTRUCTION_CHAR 64
+#define MAX_INSTRUCTION_BYTE 15
 #define NUM_INSTRTYPE 14
 
 // CPU's instruction cycle: execution of instructions
 void instruction_cycle(core_t *cr);
 
+// run each core of cores[] by instruction_cycle on its own host thread
+// for at most max_num_inst instructions, sharing the physical memory
+// the cores wait for each other every CORE_QUANTUM instructions
+#define CORE_QUANTUM 1024
+void run_cores(uint64_t max_num_inst);
+
+// execute at most max_num_inst instructions as translated basic blocks
+// return the number of instructions executed
+uint64_t block_cycle(core_t *cr, uint64_t max_num_inst);
+
+// execute at most max_num_inst instructions as threaded code (computed goto)
+// return the number of instructions executed
+uint64_t threaded_cycle(core_t *cr, uint64_t max_num_inst);
+
+// execute at most max_num_inst instructions, compiling the hot basic blocks to host code
+// on x86-64 hosts with NUM_CORES == 1, as threaded_cycle otherwise
+// return the number of instructions executed
+uint64_t jit_cycle(core_t *cr, uint64_t max_num_inst);
+
+// why run() returned
+typedef enum RUN_STATUS {
+    RUN_BUDGET,     // max_steps instructions executed
+    RUN_BREAKPOINT, // rip is at a breakpoint, not executed yet
+    RUN_SENTINEL,   // rip is at the sentinel, e.g. the entry returned to it
+    RUN_FAULT,      // rip is at an instruction the core cannot decode
+} run_status_t;
+
+#define MAX_BREAKPOINT 16
+
+typedef struct STOP_CONDITION_STRUCT {
+    uint64_t sentinel; // e.g. 0, the return address pushed by the loader
+    uint64_t num_breakpoint;
+    uint64_t breakpoint[MAX_BREAKPOINT];
+} stop_condition_t;
+
+typedef struct RUN_RESULT_STRUCT {
+    uint64_t status; // run_status_t
+    uint64_t num_inst;
+} run_result_t;
+
+// execute at most max_steps instructions as translated basic blocks
+// or until a stop condition holds, stop may be NULL
+// the breakpoint at rip when run() is called does not stop it, so run() resumes from a breakpoint
+// the conditions are checked once per block, instruction by instruction only
+// in the blocks holding a breakpoint or the end of the budget
+run_result_t run(core_t *cr, uint64_t max_steps, const stop_condition_t *stop);
+
+// the generation of the physical pages of [paddr, paddr + len), read before the code in them
+// the decoded instructions and the blocks are tagged with it, on all the host threads
+uint64_t code_generation(uint64_t paddr, uint64_t len);
+// drop the decoded instructions overlapping physical memory [paddr, paddr + len)
+void invalidate_inst_cache(uint64_t paddr, uint64_t len);
+// drop all the decoded instructions, e.g. the physical memory is restored
+void flush_inst_cache();
+
+/*======================================*/
+/*      timing model                    */
+/*======================================*/
+
+// simulated cycles = the latencies of the executed operators + the memory stall
+// an L1 hit is hidden in the pipeline, the stall is the latency beyond it:
+// the latency of the cache hierarchy when DEBUG_ENABLE_SRAM_CACHE is 1, as core_cache stall,
+// or else a flat stall per access
+typedef struct TIMING_STRUCT {
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t mem_access; // data accesses, including the page walks
+    uint64_t mem_stall;  // cycles waiting for the fetches and the data accesses
+} timing_t;
+
+#define TIMING_READ 0
+#define TIMING_WRITE 1
+
+// configurable, e.g. op_latency[INST_CALL] = 3
+extern uint64_t op_latency[NUM_INSTRTYPE];
+// stall of a read or a write without the cache model
+extern uint64_t flat_memory_stall[2];
+
+// 1 while timing, read by the engines before each instruction
+extern int timing_enabled;
+extern timing_t core_timing[NUM_CORES];
+
+// reset the counters of all the cores and start counting
+// called when the cores are not running, as timing_stop
+void timing_start();
+void timing_stop();
+// hooks of the engines and the memory accesses
+void time_instruction(uint64_t op, core_t *cr);
+void time_fetch(core_t *cr, uint64_t stall);
+void time_memory(core_t *cr, uint64_t stall);
+// instructions per cycle of the core
+double timing_ipc(core_t *cr);
+void print_timing(core_t *cr);
+
 /*--------------------------------------*/
 // place the functions here because they requires the core_t type
 
@@ -242,6 +410,22 @@ void instruction_cycle(core_t *cr);
 // translate the virtual address to physical address in MMU
 // each MMU is owned by each core
 uint64_t va2pa(uint64_t vaddr, core_t *cr);
+// the same translation for the instrumentation, not counted by the TLB
+uint64_t va2pa_uncounted(uint64_t vaddr, core_t *cr);
+
+// drop all the translations of the TLB, e.g. when cr3 is changed
+void flush_tlb(core_t *cr);
+// release the page tables, the pages and the swap slots of the core, cr3 becomes 0
+// the next access starts a new address space
+void free_address_space(core_t *cr);
+
+// the pages of [vaddr, vaddr + len) are filled from the host bytes on their page faults
+// as the pages of a file mmap'd by the loader, the other pages stay demand-zero
+// the bytes must outlive the area
+// without the page walk (flat mapping) the bytes are copied at once
+void map_vm_area(uint64_t vaddr, const uint8_t *bytes, uint64_t len, core_t *cr);
+// drop the areas of the core, the pages already faulted in are kept
+void unmap_vm_areas(core_t *cr);
 
 // end of include guard
 #endif
\ No newline at end of file
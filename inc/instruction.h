@@ -0,0 +1,258 @@
+// include guards to prevent double declaration of any identifiers
+// such as types, enums and static variables
+#ifndef INSTRUCTION_GUARD
+#define INSTRUCTION_GUARD
+
+#include <stdint.h>
+#include "cpu.h"
+
+/*======================================*/
+/*      instruction set architecture    */
+/*======================================*/
+
+// data structures
+typedef enum INST_OPERATOR {
+    INST_MOV,     // 0
+    INST_PUSH,    // 1
+    INST_POP,     // 2
+    INST_LEAVE,   // 3
+    INST_CALL,    // 4
+    INST_RET,     // 5
+    INST_ADD,     // 6
+    INST_SUB,     // 7
+    INST_CMP,     // 8
+    INST_JNE,     // 9
+    INST_JMP,     // 10
+    INST_UNKNOWN, // 11: mnemonic not in the instruction set
+} op_t;
+
+typedef enum OPERAND_TYPE {
+    EMPTY,                 // 0
+    IMM,                   // 1
+    REG,                   // 2
+    MEM_IMM,               // 3
+    MEM_REG1,              // 4
+    MEM_IMM_REG1,          // 5
+    MEM_REG1_REG2,         // 6
+    MEM_IMM_REG1_REG2,     // 7
+    MEM_REG2_SCAL,         // 8
+    MEM_IMM_REG2_SCAL,     // 9
+    MEM_REG1_REG2_SCAL,    // 10
+    MEM_IMM_REG1_REG2_SCAL // 11
+} od_type_t;
+
+typedef enum REGISTER_WIDTH {
+    REG_64,     // 0: rax
+    REG_32,     // 1: eax
+    REG_16,     // 2: ax
+    REG_8_HIGH, // 3: ah
+    REG_8_LOW,  // 4: al
+} reg_width_t;
+
+// register operand: the slot in reg_t and the bits accessed
+// resolved against the core executing the instruction
+// so a decoded instruction can be shared by all cores
+typedef struct REGISTER_OPERAND_STRUCT {
+    uint8_t index; // 0: rax, 1: rbx, ... 15: r15, in the order of reg_t
+    uint8_t width; // reg_width_t
+} reg_od_t;
+
+typedef struct OPERAND_STRUCT {
+    od_type_t type; // IMM, REG, MEM
+    uint64_t imm;   // immediate number
+    uint64_t scal;  // scale number to register 2
+    reg_od_t reg1;  // main register
+    reg_od_t reg2;  // register 2
+} od_t;
+
+// reg_t is accessed as an array of 16 uint64_t slots
+_Static_assert(sizeof(reg_t) == 16 * sizeof(uint64_t), "reg_t must be 16 uint64_t slots");
+
+// local variables are allocated in stack in run-time
+// we don't consider local STATIC variables
+// ref: Computer Systems: A Programmer's Perspective 3rd
+// Chapter 7 Linking: 7.5 Symbols and Symbol Tables
+typedef struct INST_STRUCT {
+    op_t op;      // enum of operators. e.g. mov, call, etc.
+    od_t src;     // operand src of instruction
+    od_t dst;     // operand dst of instruction
+    uint64_t len; // bytes of the instruction in memory, 0 if unknown
+} inst_t;
+
+/*======================================*/
+/*      registers of the operands       */
+/*======================================*/
+
+// read the register of the core with the width of the operand
+static inline uint64_t read_register(reg_od_t r, core_t *cr) {
+    uint64_t val = ((uint64_t *)&(cr->reg))[r.index];
+    switch (r.width) {
+    case REG_64: return val;
+    case REG_32: return val & 0xffffffff;
+    case REG_16: return val & 0xffff;
+    case REG_8_HIGH: return (val >> 8) & 0xff;
+    case REG_8_LOW: return val & 0xff;
+    default: return val;
+    }
+}
+
+// write the register of the core with the width of the operand
+// 32-bit writes zero the upper half, 16-bit and 8-bit writes keep the other bits
+static inline void write_register(reg_od_t r, uint64_t data, core_t *cr) {
+    uint64_t *slot = &((uint64_t *)&(cr->reg))[r.index];
+    switch (r.width) {
+    case REG_64: *slot = data; return;
+    case REG_32: *slot = data & 0xffffffff; return;
+    case REG_16: *slot = (*slot & ~0xffffULL) | (data & 0xffff); return;
+    case REG_8_HIGH: *slot = (*slot & ~0xff00ULL) | ((data & 0xff) << 8); return;
+    case REG_8_LOW: *slot = (*slot & ~0xffULL) | (data & 0xff); return;
+    default: *slot = data; return;
+    }
+}
+
+/*======================================*/
+/*      instruction handlers            */
+/*======================================*/
+
+// handler table storing the handlers to different instruction types
+typedef void (*handler_t)(od_t *, od_t *, core_t *);
+extern handler_t handler_table[NUM_INSTRTYPE];
+
+// fetch and decode the instruction at virtual address vaddr (physical address paddr)
+// in the encoding of the core
+void decode_instruction(uint64_t vaddr, uint64_t paddr, inst_t *inst, core_t *cr);
+
+// interpret the operand with the registers of the core
+// IMM: the immediate number; REG: the register value; MEM: the virtual address
+uint64_t decode_operand(od_t *od, core_t *cr);
+
+// decode the x86-64 machine code at virtual address vaddr
+// code holds at least MAX_INSTRUCTION_BYTE bytes
+// return the bytes read by the decoder, also of an unknown instruction
+uint64_t decode_machine_code(const uint8_t *code, uint64_t vaddr, inst_t *inst);
+
+// the condition flags are lazy: the handlers only record the last operation
+// most flags are overwritten before any instruction reads them
+// inline to reduce cost
+
+// reset the condition flags
+static inline void reset_cflags(core_t *cr) {
+    cr->lazy_flags.op = FLAGS_OP_RESET;
+}
+
+// condition flags of val = dst + src
+static inline void add_cflags(uint64_t src, uint64_t dst, uint64_t val, core_t *cr) {
+    cr->lazy_flags.op = FLAGS_OP_ADD;
+    cr->lazy_flags.src = src;
+    cr->lazy_flags.dst = dst;
+    cr->lazy_flags.val = val;
+}
+
+// condition flags of val = dst - src
+static inline void sub_cflags(uint64_t src, uint64_t dst, uint64_t val, core_t *cr) {
+    cr->lazy_flags.op = FLAGS_OP_SUB;
+    cr->lazy_flags.src = src;
+    cr->lazy_flags.dst = dst;
+    cr->lazy_flags.val = val;
+}
+
+// zero flag, the only one needed by jne and jmp
+static inline uint16_t read_ZF(core_t *cr) {
+    switch (cr->lazy_flags.op) {
+    case FLAGS_OP_NONE: return cr->flags.ZF;
+    case FLAGS_OP_RESET: return 0;
+    default: return (cr->lazy_flags.val == 0);
+    }
+}
+
+// compute all the condition flags of the last operation to cr->flags
+static inline void evaluate_cflags(core_t *cr) {
+    lazy_flags_t *lazy = &(cr->lazy_flags);
+    int val_sign = ((lazy->val >> 63) & 0x1);
+    int src_sign = ((lazy->src >> 63) & 0x1);
+    int dst_sign = ((lazy->dst >> 63) & 0x1);
+
+    switch (lazy->op) {
+    case FLAGS_OP_NONE:
+        return;
+    case FLAGS_OP_RESET:
+        cr->flags._flag_values = 0;
+        break;
+    case FLAGS_OP_ADD:
+        cr->flags.CF = (lazy->val < lazy->src); // unsigned
+        cr->flags.ZF = (lazy->val == 0);
+        cr->flags.SF = val_sign;
+        cr->flags.OF = ((src_sign == 0 && dst_sign == 0 && val_sign == 1) || (src_sign == 1 && dst_sign == 1 && val_sign == 0));
+        break;
+    case FLAGS_OP_SUB:
+        cr->flags.CF = (lazy->val > lazy->dst);
+        cr->flags.ZF = (lazy->val == 0);
+        cr->flags.SF = val_sign;
+        // 实际上这里是用高位 1 表示是否是负数，即实际表示范围是 int64_t;
+        cr->flags.OF = ((src_sign == 1 && dst_sign == 0 && val_sign == 1) || (src_sign == 0 && dst_sign == 1 && val_sign == 0));
+        break;
+    }
+    lazy->op = FLAGS_OP_NONE;
+}
+
+/*======================================*/
+/*      basic block                     */
+/*======================================*/
+
+#define MAX_BLOCK_INST 32
+
+// micro operation of the threaded code
+// the micro-handler is specialized for the operand types of the instruction
+typedef struct MICRO_OP_STRUCT {
+    const void *label; // address of the micro-handler in threaded_cycle
+    inst_t *inst;      // the decoded instruction, for the generic micro-handler
+    uint64_t imm;      // immediate number or the target address
+    uint64_t disp;     // displacement of the memory operand
+    uint8_t r1;        // index of the src (or base) register in reg_t
+    uint8_t r2;        // index of the dst register in reg_t
+    uint8_t len;       // bytes of the instruction
+} uop_t;
+
+// a basic block is the straight-line run of instructions from its first rip
+// up to and including the next call, ret, jmp or jne
+typedef struct BLOCK_STRUCT {
+    uint64_t valid;
+    uint64_t vaddr;    // rip of the first instruction
+    uint64_t paddr;    // tag: physical address of the first instruction
+    uint64_t gen;      // tag: code_generation() of its page when translated
+    uint64_t len;      // bytes of the instructions
+    uint64_t num_inst; // number of decoded instructions
+    inst_t inst[MAX_BLOCK_INST];
+
+    // chained successor blocks: the taken and the fall-through targets
+    // linked once the target is known, so the next block is found without lookup
+    struct BLOCK_STRUCT *next[2];
+
+    // threaded code of the block, built by threaded_cycle on first execution
+    uint64_t threaded;
+    uop_t uop[MAX_BLOCK_INST + 1];
+
+    // host code of the block, compiled by jit_cycle once the block is hot
+    uint64_t num_exec;
+    uint64_t jit_gen;         // generation of the code buffer, 0: not compiled
+    uint64_t jit_unsupported; // 1: the compiler cannot handle the block
+    uint64_t (*jit_code)(core_t *); // return the number of instructions executed
+} block_t;
+
+// find the block starting from the rip of the core, translate it if not found
+block_t *find_block(core_t *cr);
+// the successor of the block prev which has just been executed
+block_t *next_block(block_t *prev, core_t *cr);
+
+// the code of the block has been written since its translation, by any core
+// the blocks are made stale by invalidate_inst_cache() and flush_inst_cache()
+int is_stale_block(block_t *block, core_t *cr);
+
+// the instruction of the block, just executed, wrote the code of the block by mov, push or call
+// the engines leave the block at rip, so the rest of it is decoded again as instruction_cycle does
+static inline int wrote_block(inst_t *inst, block_t *block, core_t *cr) {
+    int store = inst->op == INST_PUSH || inst->op == INST_CALL || (inst->op == INST_MOV && inst->dst.type >= MEM_IMM);
+    return store && is_stale_block(block, cr);
+}
+
+#endif
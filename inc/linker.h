@@ -0,0 +1,111 @@
+// include guards to prevent double declaration of any identifiers
+// such as types, enums and static variables
+#ifndef LINKER_GUARD
+#define LINKER_GUARD
+
+#include <stdint.h>
+#include "cpu.h"
+
+/*======================================*/
+/*      ELF file                        */
+/*======================================*/
+
+// the stack of the loaded program grows down from STACK_TOP
+// the entry is called with the return address 0 on the stack
+#define STACK_TOP 0x7ffffffff000
+// the linked image: the text segment is at LINK_TEXT_BASE
+// and the data segment follows it from the next page
+#define LINK_TEXT_BASE 0x400000
+
+// the ELF64 file mmap'd read-only
+// the loaded segments are mapped to the core by map_vm_area, so the file stays mapped
+typedef struct ELF_STRUCT {
+    const uint8_t *buf;
+    uint64_t size;
+    const char *filename;
+    uint64_t entry;
+    struct IMAGE_STRUCT *image; // the image linked from a relocatable file
+} elf_t;
+
+// mmap and check the x86-64 ELF64 file, exit the simulator if it is not supported
+elf_t *open_elf(const char *filename);
+void close_elf(elf_t *elf);
+
+/*======================================*/
+/*      static linker                   */
+/*======================================*/
+
+// the resolution of a global symbol name
+// a strong symbol overrides the weak and common ones, two strong ones are an error
+// of the common symbols, the largest is allocated in .bss
+// a symbol referred to only by weak undefined symbols may stay undefined, at address 0
+typedef enum SYMBOL_TYPE {
+    SYMBOL_UNDEFINED,
+    SYMBOL_WEAK,
+    SYMBOL_COMMON,
+    SYMBOL_STRONG,
+} symbol_type_t;
+
+typedef struct SYMBOL_STRUCT {
+    const char *name; // copied from the object, NULL if the slot is empty
+    uint64_t hash;
+    uint64_t type;   // symbol_type_t
+    uint64_t strong_ref; // 1: referred to by a global undefined symbol
+    uint64_t object; // index of the defining object
+    uint64_t shndx;  // st_shndx of the definition
+    uint64_t value;  // st_value of the definition
+    uint64_t size;
+    uint64_t addr; // the address in the image
+} symbol_t;
+
+// open addressing with linear probing, doubled when half full
+// so looking up tens of thousands of names stays linear in total
+typedef struct SYMBOL_TABLE_STRUCT {
+    symbol_t *slot;
+    uint64_t num_slot; // power of 2
+    uint64_t num_symbol;
+} symbol_table_t;
+
+// a segment of the image: [vaddr, vaddr + filesz) from bytes, zero up to memsz
+typedef struct IMAGE_SEGMENT_STRUCT {
+    uint64_t vaddr;
+    uint8_t *bytes;
+    uint64_t filesz;
+    uint64_t memsz;
+} image_segment_t;
+
+#define IMAGE_TEXT 0 // .text, .rodata
+#define IMAGE_DATA 1 // .data, .bss, common symbols
+#define NUM_IMAGE_SEGMENT 2
+
+// the relocated program, loaded by load_image without an executable file
+typedef struct IMAGE_STRUCT {
+    image_segment_t segment[NUM_IMAGE_SEGMENT];
+    symbol_table_t symtab;
+    uint64_t entry; // _start, or main without _start
+} image_t;
+
+// link the relocatable objects to an image
+// exit the simulator on the undefined or multiply defined symbols
+// the image keeps no pointer to the objects, they may be closed after linking
+image_t *link_elf(elf_t **objects, uint64_t num_object);
+// the address of the global symbol in the image, 0 if it is not defined
+uint64_t find_image_symbol(image_t *image, const char *name);
+void free_image(image_t *image);
+
+/*======================================*/
+/*      loader                          */
+/*======================================*/
+
+// load the image to a new address space of the core
+// rip is the entry, rsp is below STACK_TOP and the encoding is binary
+// the pages are filled from the image on their first page fault
+void load_image(image_t *image, core_t *cr);
+
+// load the executable file, or the relocatable file linked alone, as load_image
+// the pages are read from the mmap'd file on their first page fault, not copied upfront
+elf_t *load_elf(const char *filename, core_t *cr);
+// unmap the file and drop the areas of the core
+void free_elf(elf_t *elf, core_t *cr);
+
+#endif
@@ -11,26 +11,308 @@
 /*      physical memory on dram chips   */
 /*======================================*/
 
-// physical memory space is decided by the physical address
-// in this simulator, there are 4 + 6 + 6 = 16 bit physical adderss
-// then the physical space is (1 << 16) = 65536
-// total 16 physical memory
-#define PHYSICAL_MEMORY_SPACE 65536
-#define MAX_INDEX_PHYSICAL_PAGE 15
+// physical memory space is decided at startup by pm_init
+// the default is the 32-bit physical address space, 4 GiB
+// a frame is allocated on the host when it is first written,
+// so the host memory is proportional to the touched frames
+#define PHYSICAL_MEMORY_SPACE (1ULL << 32)
+// the largest space of pm_init: 40-bit physical address
+#define MAX_PHYSICAL_MEMORY_SPACE (1ULL << 40)
 
-// physical memory
-// 16 physical memory pages
-extern uint8_t pm[PHYSICAL_MEMORY_SPACE];
+// 4 KiB pages: the low 12 bits of an address are the page offset
+#define PHYSICAL_PAGE_OFFSET_LENGTH 12
+#define PAGE_SIZE (1 << PHYSICAL_PAGE_OFFSET_LENGTH)
+
+// bytes of physical memory, PHYSICAL_MEMORY_SPACE until pm_init
+extern uint64_t physical_memory_space;
+
+// set the size of physical memory, rounded up to pages
+// called before the simulation, the touched frames are kept
+void pm_init(uint64_t size);
+// number of frames backed by the host memory
+uint64_t pm_touched_frames();
+
+// host pointer to the byte of paddr, valid to the end of its frame
+// a frame never written reads as zeros without being allocated
+const uint8_t *pm_read_pointer(uint64_t paddr);
+uint8_t *pm_write_pointer(uint64_t paddr);
+// release the host memory of the frame, it reads as zeros again
+void pm_discard_frame(uint64_t paddr);
+
+/*======================================*/
+/*      page table                      */
+/*======================================*/
+
+// 4-level page table as x86-64: 48-bit virtual address
+// | PML4 (9) | PDPT (9) | PD (9) | PT (9) | page offset (12) |
+// each table is a physical frame of 512 entries
+#define PAGE_TABLE_INDEX_LENGTH 9
+#define NUM_PAGE_TABLE_ENTRY (1 << PAGE_TABLE_INDEX_LENGTH)
+#define PAGE_TABLE_LEVEL 4
+
+// page table entry of all the levels
+typedef union PAGE_TABLE_ENTRY {
+    uint64_t pte_value;
+    struct {
+        uint64_t present : 1;
+        uint64_t writable : 1;
+        uint64_t usermode : 1;
+        uint64_t writethrough : 1;
+        uint64_t cachedisabled : 1;
+        uint64_t accessed : 1;
+        uint64_t dirty : 1;
+        uint64_t pagesize : 1;
+        uint64_t global : 1;
+        uint64_t unused9_11 : 3;
+        uint64_t ppn : 40; // physical page number of the next level table or the page
+        uint64_t unused52_62 : 11;
+        uint64_t xdisabled : 1;
+    };
+} pte_t;
+
+/*======================================*/
+/*      physical frames                 */
+/*======================================*/
+
+// frame 0 is reserved: physical address 0 is never a page table or a page
+// return the physical address of a zeroed frame
+uint64_t allocate_frame();
+// as allocate_frame, but return 0 when the physical memory is exhausted
+uint64_t try_allocate_frame();
+void free_frame(uint64_t paddr);
+// the frames below the watermark have been allocated, in use or freed
+// pm_init must keep them inside the physical memory
+uint64_t frame_watermark();
+
+/*======================================*/
+/*      swap                            */
+/*======================================*/
+
+// a page swapped out has a non-present pte whose ppn is its swap slot
+// slot 0 is never used, so a zero pte is still a page never mapped
+// the page tables are not swapped
+
+typedef struct SWAP_STAT_STRUCT {
+    uint64_t page_in;  // pages read back from the swap file
+    uint64_t page_out; // pages written to the swap file
+} swap_stat_t;
+
+// open the swap file at path, a temporary file if path is NULL
+// the first page-out opens the temporary file if swap_init is not called
+void swap_init(const char *path);
+// write the frame to a free slot and return the slot
+uint64_t swap_out(uint64_t paddr);
+// read the slot to the frame and free the slot
+void swap_in(uint64_t slot, uint64_t paddr);
+// free the slot without reading it, e.g. the address space is torn down
+void swap_free(uint64_t slot);
+swap_stat_t swap_stat();
+void reset_swap_stat();
+// slots holding pages
+uint64_t swap_used_slots();
+// all the slots are free again, e.g. the machine is restored
+void free_swap_slots();
+
+/*======================================*/
+/*      snapshot                        */
+/*======================================*/
+
+// the state of the machine: the cores, the physical memory, the frame allocator
+// and the resident pages of the clock algorithm
+// the host frames are shared copy-on-write by the machine and the snapshots
+// so a snapshot costs the touched frames, not the physical memory
+// take and restore only while no core is running, with no page in the swap file
+// the sram caches model the timing only and are left as they are
+
+typedef struct HOST_FRAME_STRUCT host_frame_t;
+
+typedef struct MACHINE_SNAPSHOT_STRUCT {
+    core_t cores[NUM_CORES];
+    // the touched frames: host frame[i] is the physical page frame_ppn[i]
+    uint64_t physical_memory_space;
+    uint64_t num_frame;
+    uint64_t *frame_ppn;
+    host_frame_t **frame;
+    // the frame allocator
+    uint64_t next_frame;
+    uint64_t num_free_frames;
+    uint64_t *free_frames;
+    resident_set_t resident_set[NUM_CORES];
+} machine_snapshot_t;
+
+machine_snapshot_t *take_snapshot();
+void restore_snapshot(machine_snapshot_t *snapshot);
+void free_snapshot(machine_snapshot_t *snapshot);
+
+// the parts of the snapshot saved by pm, the frame allocator and the mmu
+void pm_snapshot(machine_snapshot_t *snapshot);
+void pm_restore(machine_snapshot_t *snapshot);
+void pm_free_snapshot(machine_snapshot_t *snapshot);
+void frame_snapshot(machine_snapshot_t *snapshot);
+void frame_restore(machine_snapshot_t *snapshot);
+void resident_snapshot(machine_snapshot_t *snapshot);
+void resident_restore(machine_snapshot_t *snapshot);
+void resident_free_snapshot(machine_snapshot_t *snapshot);
+
+/*======================================*/
+/*      sram cache                      */
+/*======================================*/
+
+// the cache model keeps the tags and the dirty bits only
+// the data stays in pm, so the model decides hits, misses and write-backs
+// write-back and write-allocate
+
+// default geometry: 64 sets, 8 ways, 64-byte lines
+#ifndef SRAM_CACHE_SET_INDEX_LENGTH
+#define SRAM_CACHE_SET_INDEX_LENGTH 6
+#endif
+#ifndef SRAM_CACHE_NUM_WAY
+#define SRAM_CACHE_NUM_WAY 8
+#endif
+#ifndef SRAM_CACHE_OFFSET_LENGTH
+#define SRAM_CACHE_OFFSET_LENGTH 6
+#endif
+
+typedef enum CACHE_REPLACEMENT {
+    CACHE_LRU,    // 0: least recently used
+    CACHE_FIFO,   // 1: first in first out
+    CACHE_RANDOM, // 2: pseudo random, deterministic
+} cache_replacement_t;
+
+// MESI state of the lines of the coherent L1d caches
+typedef enum MESI_STATE {
+    MESI_INVALID,   // 0
+    MESI_SHARED,    // 1: clean, maybe in the other L1d caches
+    MESI_EXCLUSIVE, // 2: clean, only in this L1d
+    MESI_MODIFIED,  // 3: dirty, only in this L1d
+} mesi_state_t;
+
+typedef struct CACHE_LINE_STRUCT {
+    uint64_t valid;
+    uint64_t dirty;
+    uint64_t tag;
+    uint64_t time;        // last access (LRU) or fill (FIFO)
+    uint64_t state;       // mesi_state_t, L1d only
+    uint64_t invalidated; // 1: invalid because another core wrote the line
+} cache_line_t;
+
+typedef struct CACHE_STAT_STRUCT {
+    uint64_t hit;
+    uint64_t miss;
+    uint64_t eviction;  // valid lines replaced
+    uint64_t writeback; // dirty lines replaced
+} cache_stat_t;
+
+typedef struct SRAM_CACHE_STRUCT {
+    uint64_t set_index_length;
+    uint64_t offset_length;
+    uint64_t num_way;
+    uint64_t replacement; // cache_replacement_t
+    cache_line_t *line;   // [set][way]
+    cache_stat_t *stat;   // per set
+    uint64_t time;
+    uint64_t random;
+} sram_cache_t;
+
+void sram_cache_init(sram_cache_t *cache, uint64_t set_index_length, uint64_t num_way,
+                     uint64_t offset_length, cache_replacement_t replacement);
+void sram_cache_free(sram_cache_t *cache);
+// drop all the lines and the statistics
+void sram_cache_reset(sram_cache_t *cache);
+// access the lines of physical memory [paddr, paddr + len)
+// return 1 if all the lines hit
+int sram_cache_access(sram_cache_t *cache, uint64_t paddr, uint64_t len, int write);
+// access the line of paddr, return 1 on hit
+// writeback (if not NULL) is the address of the dirty line replaced, or NO_WRITEBACK
+#define NO_WRITEBACK (~0ULL)
+int sram_cache_access_line(sram_cache_t *cache, uint64_t paddr, int write, uint64_t *writeback);
+// sum of the statistics of all the sets
+cache_stat_t sram_cache_stat(sram_cache_t *cache);
+void print_cache(sram_cache_t *cache);
+
+/*======================================*/
+/*      cache hierarchy                 */
+/*======================================*/
+
+// private L1i, L1d and L2 of each core, the shared LLC in front of pm
+// used by the instruction fetch and the dram functions when DEBUG_ENABLE_SRAM_CACHE is 1
+// a miss fills all the levels, a dirty line replaced is written to the next level
+typedef enum CACHE_LEVEL {
+    CACHE_L1I,  // 0
+    CACHE_L1D,  // 1
+    CACHE_L2,   // 2
+    CACHE_LLC,  // 3
+    CACHE_DRAM, // 4: latency only
+    NUM_CACHE_LEVEL,
+} cache_level_t;
+
+typedef struct CORE_CACHE_STRUCT {
+    sram_cache_t l1i;
+    sram_cache_t l1d;
+    sram_cache_t l2;
+    uint64_t num_inst; // instructions fetched
+    uint64_t stall;    // cycles of the accesses beyond the L1 hit latency
+} core_cache_t;
+
+// geometries of the caches not configured by sram_cache_init before the first access
+// L1 32 KiB 8-way, L2 256 KiB 8-way, LLC 2 MiB 16-way, 64-byte lines
+extern core_cache_t core_cache[NUM_CORES];
+extern sram_cache_t llc;
+
+// cycles to reach each level, configurable
+extern uint64_t cache_latency[NUM_CACHE_LEVEL];
+
+// return the latency of fetching or accessing [paddr, paddr + len)
+// the fetch counts num_inst instructions: instruction_cycle fetches one at a time,
+// the block engines fetch the instructions of a block at once
+uint64_t cache_fetch(core_t *cr, uint64_t paddr, uint64_t len, uint64_t num_inst);
+uint64_t cache_access(core_t *cr, uint64_t paddr, uint64_t len, int write);
+// drop the lines and the statistics of all the levels
+void reset_cache_hierarchy();
+// per-level miss rates and the estimated CPI = (instructions + stall) / instructions
+void print_cache_hierarchy(core_t *cr);
+
+/*======================================*/
+/*      cache coherence                 */
+/*======================================*/
+
+// the L1d caches of the cores snoop each other by MESI
+// a write to a line in another L1d invalidates it there (and in that L2)
+// a modified line snooped is written back, counted as the writeback of its cache
+typedef struct COHERENCE_STAT_STRUCT {
+    uint64_t paddr;          // line address
+    uint64_t invalidation;   // copies invalidated by the writes to the line
+    uint64_t upgrade;        // writes to a shared line: S -> M
+    uint64_t coherence_miss; // misses on a line invalidated by another core
+} coherence_stat_t;
+
+// MESI state of the line of paddr in the L1d of the core
+mesi_state_t cache_line_state(core_t *cr, uint64_t paddr);
+// coherence counters of the line of paddr
+coherence_stat_t coherence_line_stat(uint64_t paddr);
+// the lines with the most coherence traffic: the candidates of false sharing
+void print_coherence(int max_num_line);
 
 /*======================================*/
 /*      memory R/W                      */
 /*======================================*/
 
-// used by instructions: read or write uint64_t to DRAM
+// used by instructions: read or write little-endian integers to DRAM
+// the access exits the simulator if it runs past physical_memory_space
+uint8_t read8bits_dram(uint64_t paddr, core_t *cr);
+uint16_t read16bits_dram(uint64_t paddr, core_t *cr);
+uint32_t read32bits_dram(uint64_t paddr, core_t *cr);
 uint64_t read64bits_dram(uint64_t paddr, core_t *cr);
+void write8bits_dram(uint64_t paddr, uint8_t data, core_t *cr);
+void write16bits_dram(uint64_t paddr, uint16_t data, core_t *cr);
+void write32bits_dram(uint64_t paddr, uint32_t data, core_t *cr);
 void write64bits_dram(uint64_t paddr, uint64_t data, core_t *cr);
 
 void readinst_dram(uint64_t paddr, char *str, core_t *cr);
 void writeinst_dram(uint64_t paddr, const char *str, core_t *cr);
 
+// used by loaders and the machine code decoder: raw bytes
+void readbytes_dram(uint64_t paddr, uint8_t *buf, uint64_t len, core_t *cr);
+void writebytes_dram(uint64_t paddr, const uint8_t *buf, uint64_t len, core_t *cr);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,200 @@
+// include guards to prevent double declaration of any identifiers
+// such as types, enums and static variables
+#ifndef TRACE_GUARD
+#define TRACE_GUARD
+
+#include <stdint.h>
+#include <stdio.h>
+#include "cpu.h"
+#include "memory.h"
+#include "common.h"
+#include "instruction.h"
+
+/*======================================*/
+/*      trace file                      */
+/*======================================*/
+
+// the trace file is a header, the state of each core when the trace starts
+// and then the fixed-size records of the executed instructions
+// the records of a core are in the order of execution,
+// the records of different cores are interleaved in chunks
+#define TRACE_MAGIC 0x3130454341525441 // "ATRACE01"
+
+typedef struct TRACE_HEADER_STRUCT {
+    uint64_t magic;
+    uint64_t num_core;
+    uint64_t record_size; // sizeof(trace_record_t)
+} trace_header_t;
+
+// condition flags, as bits of the records
+#define TRACE_CF 0x1
+#define TRACE_ZF 0x2
+#define TRACE_SF 0x4
+#define TRACE_OF 0x8
+
+typedef struct TRACE_CORE_STATE_STRUCT {
+    uint64_t rip;
+    uint64_t flags; // TRACE_CF | TRACE_ZF | TRACE_SF | TRACE_OF
+    reg_t reg;
+} trace_core_state_t;
+
+// memory access of the instruction
+#define TRACE_READ 0x1
+#define TRACE_WRITE 0x2
+
+// at most 2 registers are written by an instruction, e.g. pop writes the register and rsp
+#define TRACE_MAX_REG 2
+#define TRACE_NO_REG 0xff
+
+// one executed instruction, 64 bytes
+typedef struct TRACE_RECORD_STRUCT {
+    uint64_t step;     // instructions executed by the core since the trace started
+    uint64_t rip;      // the address of the instruction
+    uint64_t next_rip; // rip after the instruction
+    uint64_t addr;     // virtual address of the memory operand
+    uint64_t value;    // the bytes at addr after the instruction, if it writes them
+    uint64_t reg_value[TRACE_MAX_REG];
+    uint8_t op;
+    uint8_t core;
+    uint8_t access; // TRACE_READ | TRACE_WRITE, 0 without memory operand
+    uint8_t size;   // bytes accessed at addr
+    uint8_t reg_index[TRACE_MAX_REG]; // slot in reg_t of the written registers, or TRACE_NO_REG
+    uint8_t flags;  // condition flags after the instruction
+    uint8_t reserved;
+} trace_record_t;
+
+_Static_assert(sizeof(trace_record_t) == 64, "trace_record_t must be 64 bytes");
+
+/*======================================*/
+/*      trace recorder                  */
+/*======================================*/
+
+// each core appends the records to its own lock-free ring buffer
+// a background thread writes the rings to the file
+// the core waits for the thread only when its ring is full
+#define TRACE_RING_INDEX_LENGTH 14
+#define NUM_TRACE_RECORD (1 << TRACE_RING_INDEX_LENGTH)
+
+// 1 while recording, read by the engines before each instruction
+extern int trace_enabled;
+
+// start recording the instructions of all the cores to filename
+// called when the cores are not running, as trace_stop
+void trace_start(const char *filename);
+// write the remaining records and close the file
+void trace_stop();
+
+// execute the decoded instruction, record it to the trace,
+// count it in the profile and in the timing model, as enabled
+void instrument_instruction(inst_t *inst, core_t *cr);
+
+/*======================================*/
+/*      profiler                        */
+/*======================================*/
+
+// counters of the instructions executed while profiling
+// each core counts its own, the report sums them
+typedef struct PROFILE_OP_STRUCT {
+    uint64_t count;
+    uint64_t mem_read;  // instructions reading memory
+    uint64_t mem_write; // instructions writing memory
+} profile_op_t;
+
+typedef struct PROFILE_SUMMARY_STRUCT {
+    uint64_t num_inst;
+    profile_op_t op[NUM_INSTRTYPE];
+    uint64_t jne_taken;
+    uint64_t jne_not_taken;
+} profile_summary_t;
+
+// the hot spots printed by the report
+#define PROFILE_REPORT_RIPS 32
+
+// 1 while profiling, read by the engines before each instruction
+extern int profile_enabled;
+
+// reset the counters and start counting the instructions of all the cores
+// profile_stop() and the exit of the simulator write the sorted report to report_filename
+// and the folded call stacks to folded_filename (for flamegraph.pl), either may be NULL
+// called when the cores are not running, as profile_stop
+void profile_start(const char *report_filename, const char *folded_filename);
+void profile_stop();
+// count the executed instruction of the record
+void profile_instruction(trace_record_t *record, inst_t *inst, core_t *cr);
+
+void profile_summary(profile_summary_t *summary);
+uint64_t profile_rip_count(uint64_t rip);
+void profile_report(FILE *out);
+// one line per call stack: the function entries from the root, then the instructions executed in it
+// the stacks are rebuilt from the call and ret instructions
+void profile_folded(FILE *out);
+
+// execute the decoded instruction, the way of all the interpreting engines
+// the compiled engines run block_cycle() while tracing, profiling or timing
+static inline int instrumentation_enabled() {
+    return (trace_enabled | profile_enabled | timing_enabled) != 0;
+}
+
+static inline void execute_instruction(inst_t *inst, core_t *cr) {
+    if (instrumentation_enabled()) {
+        instrument_instruction(inst, cr);
+        return;
+    }
+    // rip points to the next instruction during the execution
+    cr->rip = cr->rip + inst->len;
+    handler_table[inst->op](&(inst->src), &(inst->dst), cr);
+}
+
+// fetch the instructions [first, first + n) of the block through L1i when the cache model is on
+// the block engines fetch once per block, or per instruction when they step a block
+static inline void fetch_block(block_t *block, uint64_t first, uint64_t n, core_t *cr) {
+    if (DEBUG_ENABLE_SRAM_CACHE == 0 || n == 0) {
+        return;
+    }
+    uint64_t offset = 0;
+    uint64_t len = 0;
+    for (uint64_t i = 0; i < first + n; ++i) {
+        if (i < first) {
+            offset += block->inst[i].len;
+        } else {
+            len += block->inst[i].len;
+        }
+    }
+    uint64_t latency = cache_fetch(cr, block->paddr + offset, len > 0 ? len : 1, n);
+    if (timing_enabled != 0) {
+        time_fetch(cr, latency - cache_latency[CACHE_L1I]);
+    }
+}
+
+/*======================================*/
+/*      trace replay                    */
+/*======================================*/
+
+// the memory written by the replayed instructions, by virtual page
+typedef struct REPLAY_PAGE_STRUCT {
+    uint64_t vpn;
+    uint8_t data[PAGE_SIZE];
+    uint8_t known[PAGE_SIZE / 8]; // bitmap of the bytes written
+} replay_page_t;
+
+typedef struct REPLAY_STATE_STRUCT {
+    uint64_t core;
+    uint64_t step; // instructions replayed
+    uint64_t rip;
+    uint64_t flags;
+    reg_t reg;
+    // open addressing by vpn
+    replay_page_t **page;
+    uint64_t num_slot;
+    uint64_t num_page;
+} replay_state_t;
+
+// reconstruct the registers and the written memory of the core
+// after the first max_step instructions of the trace, or all of them
+// exit the simulator if the file is not a trace
+void replay_trace(const char *filename, uint64_t core, uint64_t max_step, replay_state_t *state);
+// read len bytes at vaddr, return 0 if any of them is not written by the replayed instructions
+int replay_read(replay_state_t *state, uint64_t vaddr, uint8_t *buf, uint64_t len);
+void free_replay(replay_state_t *state);
+
+#endif
@@ -1,24 +1,78 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <elf.h>
 #include "cpu.h"
 #include "memory.h"
 #include "common.h"
+#include "instruction.h"
+#include "linker.h"
+#include "trace.h"
 
 #define MAX_NUM_INSTRUCTION_CYCLE 100
 core_t cores[NUM_CORES];
 uint64_t ACTIVE_CORE;
-uint8_t pm[PHYSICAL_MEMORY_SPACE];
 static void TestAddFunctionCallAndComputation();
+static void TestAddFunctionCallAndComputationEngines();
+static void TestAddFunctionCallAndComputationBinary();
+static void TestMachineCode();
 static void TestString2Uint();
+static void TestConditionFlags();
+static void TestSizeSuffix();
+static void TestDramAccess();
+static void TestSparseMemory();
+static void TestPageWalk();
+static void TestSnapshot();
+static void TestSwap();
+static void TestSramCache();
+static void TestCacheHierarchy();
+static void TestMultiCore();
+static void TestCacheCoherence();
+static void TestCrossModifyingCode();
+static void TestLoadElf();
+static void TestStaticLink();
+static void TestRun();
+static void TestTrace();
+static void TestDebugMask();
+static void TestProfile();
+static void TestTiming();
+
+static core_t *LoadAddFunctionCallAndComputation();
+static core_t *LoadAddFunctionCallAndComputationBinary();
+static void CheckAddFunctionCallAndComputation(core_t *ac);
 
 // symbols from isa and sram
 void print_register(core_t *cr);
 void print_stack(core_t *cr);
 
 int main() {
-    // TestAddFunctionCallAndComputation();
+    TestAddFunctionCallAndComputation();
+    TestAddFunctionCallAndComputationEngines();
+    TestAddFunctionCallAndComputationBinary();
+    TestMachineCode();
     TestString2Uint();
+    TestConditionFlags();
+    TestSizeSuffix();
+    TestDramAccess();
+    TestSparseMemory();
+    TestPageWalk();
+    TestSnapshot();
+    TestSwap();
+    TestSramCache();
+    TestCacheHierarchy();
+    TestMultiCore();
+    TestCacheCoherence();
+    TestCrossModifyingCode();
+    TestLoadElf();
+    TestStaticLink();
+    TestRun();
+    TestTrace();
+    TestDebugMask();
+    TestProfile();
+    TestTiming();
     return 0;
 }
 
@@ -28,7 +82,571 @@ static void TestString2Uint() {
         printf("%s -> %lx\n", nums[i], string2uint(nums[i]));
     }
 }
+static void TestSizeSuffix() {
+    core_t *ac = (core_t *)&cores[0];
+    ac->encoding = INST_ENCODING_TEXT;
+    uint64_t frame = allocate_frame();
+
+    // the suffix must be the width the handler moves, and add, sub and cmp set 64-bit flags
+    const char *assembly[12] = {
+        "movq   %rax,%rbx", "movw   %ax,%bx", "movl   $0x1,%eax", "addq   %rax,%rbx", "cmpq   $0x1,(%rax)", "pushq  %rbp",
+        "movl   $0x1,(%rax)", "movq   %eax,%ebx", "pushl  %ebp", "callw  $0x400000", "movb   %ax,%bl", "addw   %ax,%bx"};
+    int match = 1;
+    for (int i = 0; i < 12; ++i) {
+        inst_t inst;
+        writeinst_dram(frame, assembly[i], ac);
+        decode_instruction(0x00400000, frame, &inst, ac);
+        match = match && (inst.op == INST_UNKNOWN) == (i >= 6);
+    }
+    free_frame(frame);
+
+    if (match) {
+        printf("size suffix match\n");
+    } else {
+        printf("size suffix mismatch\n");
+    }
+}
+
+static void TestDramAccess() {
+    core_t *ac = (core_t *)&cores[0];
+    int match = 1;
+
+    // inside one page and straddling the page boundary
+    uint64_t frame0 = allocate_frame();
+    uint64_t frame1 = allocate_frame();
+    match = match && frame1 == frame0 + PAGE_SIZE;
+    uint64_t paddrs[2] = {frame0 + 0x8, frame1 - 0x4};
+    for (int i = 0; i < 2; ++i) {
+        uint64_t p = paddrs[i];
+        write64bits_dram(p, 0x00007fd357a02ae0, ac);
+        match = match && *pm_read_pointer(p) == 0xe0 && *pm_read_pointer(p + 1) == 0x2a && *pm_read_pointer(p + 7) == 0x00;
+        match = match && read64bits_dram(p, ac) == 0x00007fd357a02ae0;
+        match = match && read32bits_dram(p + 4, ac) == 0x00007fd3;
+        match = match && read16bits_dram(p + 2, ac) == 0x57a0;
+        match = match && read8bits_dram(p + 1, ac) == 0x2a;
+
+        write32bits_dram(p + 2, 0x12345678, ac);
+        write16bits_dram(p, 0xabcd, ac);
+        write8bits_dram(p + 7, 0xff, ac);
+        match = match && read64bits_dram(p, ac) == 0xff0012345678abcd;
+    }
+    free_frame(frame0);
+    free_frame(frame1);
+
+    if (match) {
+        printf("dram access match\n");
+    } else {
+        printf("dram access mismatch\n");
+    }
+}
+
+static void TestSparseMemory() {
+    core_t *ac = (core_t *)&cores[0];
+    int match = 1;
+
+    // the last frame of the 4 GiB physical memory
+    uint64_t p = physical_memory_space - PAGE_SIZE;
+    uint64_t touched = pm_touched_frames();
+    match = match && read64bits_dram(p + 0x10, ac) == 0x0;
+    match = match && pm_touched_frames() == touched;
+
+    write64bits_dram(p + 0x10, 0x1122334455667788, ac);
+    match = match && pm_touched_frames() == touched + 1;
+    match = match && read64bits_dram(p + 0x10, ac) == 0x1122334455667788;
+
+    // straddling two untouched frames
+    write32bits_dram(p - 2, 0xdeadbeef, ac);
+    match = match && pm_touched_frames() == touched + 2;
+    match = match && read32bits_dram(p - 2, ac) == 0xdeadbeef;
+
+    pm_discard_frame(p - PAGE_SIZE);
+    pm_discard_frame(p);
+    match = match && pm_touched_frames() == touched;
+    match = match && read64bits_dram(p + 0x10, ac) == 0x0;
+
+    if (match) {
+        printf("sparse memory match\n");
+    } else {
+        printf("sparse memory mismatch\n");
+    }
+}
+
+static void TestCacheCoherence() {
+    if (NUM_CORES < 2) {
+        printf("cache coherence skipped: NUM_CORES < 2\n");
+        return;
+    }
+    core_t *a = (core_t *)&cores[0];
+    core_t *b = (core_t *)&cores[NUM_CORES - 1];
+    reset_cache_hierarchy();
+
+    // a and b write different words of the same line: false sharing
+    int match = 1;
+    cache_access(a, 0x2000, 8, 0);
+    match = match && cache_line_state(a, 0x2000) == MESI_EXCLUSIVE;
+    cache_access(b, 0x2000, 8, 0);
+    match = match && cache_line_state(a, 0x2000) == MESI_SHARED && cache_line_state(b, 0x2000) == MESI_SHARED;
+    cache_access(a, 0x2000, 8, 1); // upgrade, invalidate b
+    match = match && cache_line_state(a, 0x2000) == MESI_MODIFIED && cache_line_state(b, 0x2000) == MESI_INVALID;
+    cache_access(b, 0x2008, 8, 0); // coherence miss, a M -> S, written back to the L2 of a
+    match = match && cache_line_state(a, 0x2000) == MESI_SHARED;
+    match = match && sram_cache_stat(&(core_cache[0].l1d)).writeback == 1;
+    cache_access(b, 0x2008, 8, 1); // upgrade, invalidate a, the L2 of a written back to the LLC
+    match = match && sram_cache_stat(&(core_cache[0].l2)).writeback == 1;
+    cache_access(a, 0x2000, 8, 0); // coherence miss
+    match = match && cache_line_state(a, 0x2000) == MESI_SHARED && cache_line_state(b, 0x2000) == MESI_SHARED;
+
+    coherence_stat_t stat = coherence_line_stat(0x2010);
+    match = match && stat.paddr == 0x2000 && stat.invalidation == 2 && stat.upgrade == 2 && stat.coherence_miss == 2;
+
+    // b's L1d drops the line, its L2 keeps it: a reads it shared, not exclusive
+    cache_access(b, 0x40000, 8, 0);
+    for (uint64_t i = 1; i <= 8; ++i) {
+        cache_access(b, 0x40000 + i * 0x1000, 8, 0);
+    }
+    match = match && cache_line_state(b, 0x40000) == MESI_INVALID;
+    cache_access(a, 0x40000, 8, 0);
+    match = match && cache_line_state(a, 0x40000) == MESI_SHARED;
+    cache_access(a, 0x40000, 8, 1); // upgrade, invalidate the L2 of b
+    uint64_t l2_hit = sram_cache_stat(&(core_cache[NUM_CORES - 1].l2)).hit;
+    cache_access(b, 0x40000, 8, 0); // coherence miss, not an L2 hit
+    match = match && sram_cache_stat(&(core_cache[NUM_CORES - 1].l2)).hit == l2_hit;
+    stat = coherence_line_stat(0x40000);
+    match = match && stat.invalidation == 1 && stat.upgrade == 1 && stat.coherence_miss == 1;
+    print_coherence(4);
+
+    if (match) {
+        printf("cache coherence match\n");
+    } else {
+        printf("cache coherence mismatch\n");
+    }
+}
+
+static void TestMultiCore() {
+    // each core counts rax down in its own address space, then spins
+    for (int i = 0; i < NUM_CORES; ++i) {
+        core_t *cr = (core_t *)&cores[i];
+        writeinst_dram(va2pa(0x00400800, cr), "sub    $0x1,%rax", cr);
+        writeinst_dram(va2pa(0x00400840, cr), "jne    $0x400800", cr);
+        writeinst_dram(va2pa(0x00400880, cr), "jmp    $0x400880", cr);
+        cr->encoding = INST_ENCODING_TEXT;
+        cr->rip = 0x00400800;
+        cr->reg.rax = 0x100 * (i + 1);
+    }
+
+    run_cores(2 * 0x100 * NUM_CORES + 16);
+
+    int match = 1;
+    for (int i = 0; i < NUM_CORES; ++i) {
+        match = match && cores[i].reg.rax == 0 && cores[i].rip == 0x00400880;
+    }
+    if (match) {
+        printf("multi-core match\n");
+    } else {
+        printf("multi-core mismatch\n");
+    }
+}
+
+static void *RewriteCode(void *paddr) {
+    // core 1 on its own host thread, as run_cores runs it
+    writeinst_dram(*(uint64_t *)paddr, "mov    $0x2,%rax", (core_t *)&cores[1]);
+    return NULL;
+}
+
+static void TestCrossModifyingCode() {
+    if (NUM_CORES < 2) {
+        printf("cross-modifying code skipped: NUM_CORES < 2\n");
+        return;
+    }
+    core_t *ac = (core_t *)&cores[0];
+    uint64_t paddr = va2pa(0x00400c00, ac);
+    writeinst_dram(paddr, "mov    $0x1,%rax", ac);
+    writeinst_dram(va2pa(0x00400c40, ac), "jmp    $0x400c00", ac);
+    ac->encoding = INST_ENCODING_TEXT;
+    ac->rip = 0x00400c00;
+
+    // core 0 runs the loop: decoded and translated to a block
+    instruction_cycle(ac);
+    instruction_cycle(ac);
+    block_cycle(ac, 2);
+    int match = ac->reg.rax == 1 && ac->rip == 0x00400c00;
+
+    // core 1 rewrites the first instruction on another thread
+    pthread_t thread;
+    pthread_create(&thread, NULL, &RewriteCode, &paddr);
+    pthread_join(thread, NULL);
+
+    // core 0 runs the new instruction in both engines
+    ac->reg.rax = 0;
+    instruction_cycle(ac);
+    instruction_cycle(ac);
+    match = match && ac->reg.rax == 2 && ac->rip == 0x00400c00;
+    ac->reg.rax = 0;
+    block_cycle(ac, 2);
+    match = match && ac->reg.rax == 2 && ac->rip == 0x00400c00;
+
+    if (match) {
+        printf("cross-modifying code match\n");
+    } else {
+        printf("cross-modifying code mismatch\n");
+    }
+}
+
+static void TestCacheHierarchy() {
+    core_t *ac = (core_t *)&cores[0];
+    reset_cache_hierarchy();
+
+    int match = 1;
+    // cold: L1d, L2, LLC miss and DRAM
+    match = match && cache_access(ac, 0x1000, 8, 1) == 4 + 12 + 40 + 200;
+    match = match && cache_access(ac, 0x1008, 8, 0) == 4;
+    // L1i miss, L2 hit
+    match = match && cache_fetch(ac, 0x1000, 4, 1) == 4 + 12;
+    // straddle two lines: one hit, one cold miss
+    match = match && cache_access(ac, 0x103c, 8, 0) == 4 + 4 + 12 + 40 + 200;
+    match = match && core_cache[0].stall == (12 + 40 + 200) + 12 + (4 + 12 + 40 + 200);
+    print_cache_hierarchy(ac);
+
+    // the block engine fetches a block at once, counting its instructions, if the model is compiled in
+    ac = LoadAddFunctionCallAndComputation();
+    reset_cache_hierarchy();
+    block_cycle(ac, 15);
+    match = match && core_cache[0].num_inst == ((DEBUG_ENABLE_SRAM_CACHE == 1) ? 15 : 0);
+
+    if (match) {
+        printf("cache hierarchy match\n");
+    } else {
+        printf("cache hierarchy mismatch\n");
+    }
+}
+
+static void TestSramCache() {
+    // 2 sets, 2 ways, 16-byte lines: 0x000, 0x020 and 0x040 share set 0
+    sram_cache_t cache;
+    sram_cache_init(&cache, 1, 2, 4, CACHE_LRU);
+
+    int match = 1;
+    match = match && sram_cache_access(&cache, 0x000, 8, 0) == 0;
+    match = match && sram_cache_access(&cache, 0x020, 8, 0) == 0;
+    match = match && sram_cache_access(&cache, 0x000, 8, 0) == 1;
+    match = match && sram_cache_access(&cache, 0x040, 8, 1) == 0; // evict 0x020
+    match = match && sram_cache_access(&cache, 0x040, 8, 1) == 1;
+    match = match && sram_cache_access(&cache, 0x020, 8, 0) == 0; // evict 0x000
+    match = match && sram_cache_access(&cache, 0x000, 8, 0) == 0; // evict dirty 0x040
+    // straddle 0x010 (miss) and 0x020 (hit)
+    match = match && sram_cache_access(&cache, 0x01c, 8, 0) == 0;
+
+    cache_stat_t stat = sram_cache_stat(&cache);
+    match = match && stat.hit == 3 && stat.miss == 6 && stat.eviction == 3 && stat.writeback == 1;
+    print_cache(&cache);
+    sram_cache_free(&cache);
+
+    if (match) {
+        printf("sram cache match\n");
+    } else {
+        printf("sram cache mismatch\n");
+    }
+}
+
+static void TestPageWalk() {
+    core_t *ac = (core_t *)&cores[0];
+    int match = 1;
+
+    // the flat mapping aliased these modulo the physical memory
+    uint64_t a = va2pa(0x00400008, ac);
+    uint64_t b = va2pa(0x00410008, ac);
+    match = match && a != b && (a & 0xfff) == 0x8 && (b & 0xfff) == 0x8;
+
+    // the same page hits the TLB
+    uint64_t hit = ac->tlb.hit;
+    match = match && va2pa(0x00400ff0, ac) == a - 0x8 + 0xff0;
+    match = match && ac->tlb.hit == hit + 1;
+
+    // flushed: walk again to the same frame
+    uint64_t miss = ac->tlb.miss;
+    flush_tlb(ac);
+    match = match && va2pa(0x00400008, ac) == a;
+    match = match && ac->tlb.miss == miss + 1;
+
+    if (match) {
+        printf("page walk match\n");
+    } else {
+        printf("page walk mismatch\n");
+    }
+}
+
+static void TestSnapshot() {
+    int match = 1;
+
+    // run the loaded program twice from the same snapshot
+    core_t *ac = LoadAddFunctionCallAndComputation();
+    uint64_t rip = ac->rip;
+    uint64_t stack = read64bits_dram(va2pa(ac->reg.rsp - 8, ac), ac);
+    machine_snapshot_t *snapshot = take_snapshot();
+    uint64_t touched = pm_touched_frames();
+
+    for (int i = 0; i < 2; ++i) {
+        printf("begin snapshot %d\n", i);
+        block_cycle(ac, 15);
+        CheckAddFunctionCallAndComputation(ac);
+        match = match && read64bits_dram(va2pa(ac->reg.rsp - 8, ac), ac) != stack;
+
+        restore_snapshot(snapshot);
+        match = match && ac->rip == rip && pm_touched_frames() == touched;
+        match = match && read64bits_dram(va2pa(ac->reg.rsp - 8, ac), ac) == stack;
+    }
+    free_snapshot(snapshot);
+
+    if (match) {
+        printf("snapshot match\n");
+    } else {
+        printf("snapshot mismatch\n");
+    }
+}
+
+static void TestSwap() {
+    core_t *ac = (core_t *)&cores[0];
+    int match = 1;
+
+    // a new address space in the frames of the old one and 8 more
+    uint64_t space = physical_memory_space;
+    free_address_space(ac);
+    pm_init((frame_watermark() + 8) << PHYSICAL_PAGE_OFFSET_LENGTH);
+    reset_swap_stat();
+    uint64_t slots = swap_used_slots();
+
+    // the working set of 32 pages is larger than the physical memory
+    for (int round = 0; round < 2; ++round) {
+        for (uint64_t i = 0; i < 32; ++i) {
+            uint64_t vaddr = 0x10000000 + i * PAGE_SIZE + i * 8;
+            if (round == 0) {
+                write64bits_dram(va2pa(vaddr, ac), 0xabcd0000 + i, ac);
+            } else {
+                match = match && read64bits_dram(va2pa(vaddr, ac), ac) == 0xabcd0000 + i;
+            }
+        }
+    }
+    swap_stat_t stat = swap_stat();
+    match = match && stat.page_out >= 24 && stat.page_in >= 24;
+
+    // the teardown releases the 8 frames and the swap slots of the pages swapped out
+    match = match && swap_used_slots() > slots;
+    free_address_space(ac);
+    match = match && swap_used_slots() == slots;
+    uint64_t frames[8];
+    for (int i = 0; i < 8; ++i) {
+        frames[i] = try_allocate_frame();
+        match = match && frames[i] != 0;
+    }
+    for (int i = 0; i < 8; ++i) {
+        free_frame(frames[i]);
+    }
+
+    pm_init(space);
+
+    if (match) {
+        printf("swap match\n");
+    } else {
+        printf("swap mismatch\n");
+    }
+}
+
+static void TestConditionFlags() {
+    core_t *ac = (core_t *)&cores[0];
+    int match = 1;
+
+    // signed overflow: 0x7fffffffffffffff + 1
+    add_cflags(1, 0x7fffffffffffffff, 0x8000000000000000, ac);
+    match = match && read_ZF(ac) == 0;
+    evaluate_cflags(ac);
+    match = match && ac->flags.CF == 0 && ac->flags.ZF == 0 && ac->flags.SF == 1 && ac->flags.OF == 1;
+
+    // unsigned carry: 0xffffffffffffffff + 1
+    add_cflags(1, 0xffffffffffffffff, 0, ac);
+    match = match && read_ZF(ac) == 1;
+    evaluate_cflags(ac);
+    match = match && ac->flags.CF == 1 && ac->flags.ZF == 1 && ac->flags.SF == 0 && ac->flags.OF == 0;
+
+    // borrow: 0 - 1
+    sub_cflags(1, 0, 0xffffffffffffffff, ac);
+    evaluate_cflags(ac);
+    match = match && ac->flags.CF == 1 && ac->flags.ZF == 0 && ac->flags.SF == 1 && ac->flags.OF == 0;
+
+    reset_cflags(ac);
+    match = match && read_ZF(ac) == 0;
+    evaluate_cflags(ac);
+    match = match && ac->flags._flag_values == 0;
+
+    // jne after add: 0xffffffffffffffff + 1 is 0, not taken
+    // the 32-bit add would need 32-bit flags, it is not decoded
+    ac->encoding = INST_ENCODING_TEXT;
+    uint64_t frame = allocate_frame();
+    inst_t inst;
+    writeinst_dram(frame, "addl   %eax,%ebx", ac);
+    decode_instruction(0x00400000, frame, &inst, ac);
+    match = match && inst.op == INST_UNKNOWN;
+    writeinst_dram(frame, "add    %rax,%rbx", ac);
+    writeinst_dram(frame + 0x40, "jne    $0x400800", ac);
+    ac->reg.rax = 0xffffffffffffffff;
+    ac->reg.rbx = 1;
+    ac->rip = 0x00400000;
+    for (int i = 0; i < 2; ++i) {
+        decode_instruction(0x00400000 + 0x40 * i, frame + 0x40 * i, &inst, ac);
+        execute_instruction(&inst, ac);
+    }
+    free_frame(frame);
+    match = match && ac->reg.rbx == 0 && ac->rip == 0x00400080;
+
+    if (match) {
+        printf("condition flags match\n");
+    } else {
+        printf("condition flags mismatch\n");
+    }
+}
+
 static void TestAddFunctionCallAndComputation() {
+    core_t *ac = LoadAddFunctionCallAndComputation();
+
+    printf("begin\n");
+    int time = 0;
+    while (time < 15) {
+        instruction_cycle(ac);
+        print_register(ac);
+        print_stack(ac);
+        time++;
+    }
+
+    CheckAddFunctionCallAndComputation(ac);
+}
+
+static void TestAddFunctionCallAndComputationEngines() {
+    // run the same program by the other execution engines
+    const char *names[3] = {"block", "threaded", "jit"};
+    uint64_t (*engines[3])(core_t *, uint64_t) = {&block_cycle, &threaded_cycle, &jit_cycle};
+
+    for (int i = 0; i < 3; ++i) {
+        core_t *ac = LoadAddFunctionCallAndComputation();
+
+        printf("begin %s\n", names[i]);
+        uint64_t count = engines[i](ac, 15);
+        print_register(ac);
+        print_stack(ac);
+        printf("%lu instructions executed\n", count);
+
+        CheckAddFunctionCallAndComputation(ac);
+    }
+
+    // a block storing into its next instruction: mov $0x1,%rax becomes mov $0x2,%rax
+    // the engines leave the block after the store and run the new instruction, as instruction_cycle
+    uint64_t imm;
+    memcpy(&imm, "0x2,%rax", sizeof(imm));
+    int match = 1;
+    for (int i = 0; i < 3; ++i) {
+        core_t *ac = (core_t *)&cores[0];
+        writeinst_dram(va2pa(0x00403000, ac), "mov    %rcx,0x8(%rdx)", ac);
+        writeinst_dram(va2pa(0x00403040, ac), "mov    $0x1,%rax", ac);
+        writeinst_dram(va2pa(0x00403080, ac), "jmp    $0x403000", ac);
+        ac->encoding = INST_ENCODING_TEXT;
+        ac->rip = 0x00403000;
+        ac->reg.rcx = imm;
+
+        // hot enough to be compiled, storing to a data page
+        ac->reg.rdx = 0x00404000;
+        engines[i](ac, 3 * 32);
+        match = match && ac->reg.rax == 1;
+        // then to the block itself
+        ac->reg.rdx = 0x00403040;
+        uint64_t count = engines[i](ac, 3);
+        match = match && count == 3 && ac->reg.rax == 2 && ac->rip == 0x00403000;
+    }
+    if (match) {
+        printf("self-modifying block match\n");
+    } else {
+        printf("self-modifying block mismatch\n");
+    }
+}
+
+static void TestAddFunctionCallAndComputationBinary() {
+    // run the machine code of the same program
+    core_t *ac = LoadAddFunctionCallAndComputationBinary();
+
+    printf("begin binary\n");
+    for (int i = 0; i < 15; ++i) {
+        instruction_cycle(ac);
+    }
+    CheckAddFunctionCallAndComputation(ac);
+
+    ac = LoadAddFunctionCallAndComputationBinary();
+    printf("begin binary block\n");
+    block_cycle(ac, 15);
+    CheckAddFunctionCallAndComputation(ac);
+}
+
+static void TestMachineCode() {
+    core_t *ac = LoadAddFunctionCallAndComputation();
+    int match = 1;
+
+    // the forms of add, sub and cmp run by the handlers
+    uint8_t code[] = {
+        0x48, 0x83, 0xec, 0x10,             // sub    $0x10,%rsp
+        0x48, 0x01, 0xd8,                   // add    %rbx,%rax
+        0x48, 0x83, 0x7c, 0x24, 0x08, 0x05, // cmpq   $0x5,0x8(%rsp)
+    };
+    writebytes_dram(va2pa(0x00402000, ac), code, sizeof(code), ac);
+    ac->encoding = INST_ENCODING_BINARY;
+    ac->rip = 0x00402000;
+    uint64_t rsp = ac->reg.rsp - 0x10;
+    write64bits_dram(va2pa(rsp + 8, ac), 5, ac);
+    for (int i = 0; i < 3; ++i) {
+        instruction_cycle(ac);
+    }
+    match = match && ac->reg.rsp == rsp && ac->reg.rax == 0xabcd + 0x8000670 && read_ZF(ac) == 1;
+    match = match && ac->rip == 0x00402000 + sizeof(code);
+
+    // the other forms are unknown instead of running as no-ops
+    uint8_t unknown[][8] = {
+        {0x48, 0x83, 0xc4, 0x08}, // add    $0x8,%rsp
+        {0x48, 0x29, 0xc8},       // sub    %rcx,%rax
+        {0x48, 0x39, 0xc8},       // cmp    %rcx,%rax
+        {0x29, 0xc8},             // sub    %ecx,%eax
+        {0x39, 0xc8},             // cmp    %ecx,%eax
+        {0x48, 0x3b, 0x45, 0xf8}, // cmp    -0x8(%rbp),%rax
+        {0x48, 0x83, 0xe8, 0x01}, // sub    $0x1,%rax is run, unlike
+        {0x83, 0xe8, 0x01},       // sub    $0x1,%eax
+    };
+    for (int i = 0; i < 8; ++i) {
+        inst_t inst;
+        writebytes_dram(va2pa(0x00402000, ac), unknown[i], 8, ac);
+        decode_instruction(0x00402000, va2pa(0x00402000, ac), &inst, ac);
+        match = match && (inst.op == INST_UNKNOWN) == (i != 6);
+    }
+
+    // the fetch of ret at the end of the page does not walk the next page
+    // mov %rsp,%rbp across the page does
+    uint8_t ret = 0xc3;
+    uint8_t mov[3] = {0x48, 0x89, 0xe5};
+    writebytes_dram(va2pa(0x00402fff, ac), &ret, 1, ac);
+    writebytes_dram(va2pa(0x00404ffe, ac), mov, 2, ac);
+    writebytes_dram(va2pa(0x00405000, ac), &mov[2], 1, ac);
+    flush_tlb(ac);
+    inst_t inst;
+    uint64_t paddr = va2pa(0x00402fff, ac);
+    uint64_t miss = ac->tlb.miss;
+    decode_instruction(0x00402fff, paddr, &inst, ac);
+    match = match && inst.op == INST_RET && inst.len == 1 && ac->tlb.miss == miss;
+    paddr = va2pa(0x00404ffe, ac);
+    miss = ac->tlb.miss;
+    decode_instruction(0x00404ffe, paddr, &inst, ac);
+    match = match && inst.op == INST_MOV && inst.len == 3 && ac->tlb.miss == miss + 1;
+
+    if (match) {
+        printf("machine code match\n");
+    } else {
+        printf("machine code mismatch\n");
+    }
+}
+
+static core_t *LoadAddFunctionCallAndComputation() {
     ACTIVE_CORE = 0x0;
 
     core_t *ac = (core_t *)&cores[ACTIVE_CORE];
@@ -47,6 +665,9 @@ static void TestAddFunctionCallAndComputation() {
     ac->flags.OF = 0;
     ac->flags.SF = 0;
     ac->flags.ZF = 0;
+    ac->lazy_flags.op = FLAGS_OP_NONE;
+
+    ac->encoding = INST_ENCODING_TEXT;
 
     write64bits_dram(va2pa(0x7ffffffee110, ac), 0x0000000000000000, ac); // rbp
     write64bits_dram(va2pa(0x7ffffffee108, ac), 0x0000000000000000, ac);
@@ -77,18 +698,47 @@ static void TestAddFunctionCallAndComputation() {
         "callq  0",                // 13
         "mov    %rax,-0x8(%rbp)",  // 14
     };
-    ac->rip = (uint64_t)&assembly[11];
-    sprintf(assembly[13], "callq  $%p", &assembly[0]);
+    sprintf(assembly[13], "callq  $0x%lx", (uint64_t)0x00400000);
 
-    printf("begin\n");
-    int time = 0;
-    while (time < 15) {
-        instruction_cycle(ac);
-        print_register(ac);
-        print_stack(ac);
-        time++;
+    // load the program text into the memory
+    for (int i = 0; i < 15; ++i) {
+        writeinst_dram(va2pa(i * 0x40 + 0x00400000, ac), assembly[i], ac);
     }
+    ac->rip = MAX_INSTRUCTION_CHAR * sizeof(char) * 11 + 0x00400000;
 
+    return ac;
+}
+
+static core_t *LoadAddFunctionCallAndComputationBinary() {
+    core_t *ac = LoadAddFunctionCallAndComputation();
+
+    // objdump of add.txt, add() at 0x400000
+    uint8_t code[] = {
+        0x55,                         // 0x00 push   %rbp
+        0x48, 0x89, 0xe5,             // 0x01 mov    %rsp,%rbp
+        0x48, 0x89, 0x7d, 0xe8,       // 0x04 mov    %rdi,-0x18(%rbp)
+        0x48, 0x89, 0x75, 0xe0,       // 0x08 mov    %rsi,-0x20(%rbp)
+        0x48, 0x8b, 0x55, 0xe8,       // 0x0c mov    -0x18(%rbp),%rdx
+        0x48, 0x8b, 0x45, 0xe0,       // 0x10 mov    -0x20(%rbp),%rax
+        0x48, 0x01, 0xd0,             // 0x14 add    %rdx,%rax
+        0x48, 0x89, 0x45, 0xf8,       // 0x17 mov    %rax,-0x8(%rbp)
+        0x48, 0x8b, 0x45, 0xf8,       // 0x1b mov    -0x8(%rbp),%rax
+        0x5d,                         // 0x1f pop    %rbp
+        0xc3,                         // 0x20 retq
+        0x48, 0x89, 0xd6,             // 0x21 mov    %rdx,%rsi
+        0x48, 0x89, 0xc7,             // 0x24 mov    %rax,%rdi
+        0xe8, 0xd4, 0xff, 0xff, 0xff, // 0x27 callq  0x400000
+        0x48, 0x89, 0x45, 0xf8,       // 0x2c mov    %rax,-0x8(%rbp)
+    };
+    writebytes_dram(va2pa(0x00400000, ac), code, sizeof(code), ac);
+
+    ac->encoding = INST_ENCODING_BINARY;
+    ac->rip = 0x00400021;
+
+    return ac;
+}
+
+static void CheckAddFunctionCallAndComputation(core_t *ac) {
     // gdb state ret from func
     int match = 1;
     match = match && ac->reg.rax == 0x1234abcd;
@@ -118,3 +768,485 @@ static void TestAddFunctionCallAndComputation() {
         printf("memory mismatch\n");
     }
 }
+
+static void TestLoadElf() {
+    int match = 1;
+
+    // an executable of two segments:
+    // .text at 0x401000 and .data at 0x402000 followed by 64 MiB of .bss
+    uint8_t code[] = {
+        0x48, 0xc7, 0xc0, 0x34, 0x12, 0x00, 0x00, // mov    $0x1234,%rax
+        0x48, 0x8b, 0x15, 0xf2, 0x0f, 0x00, 0x00, // mov    0x402000(%rip),%rdx
+        0x48, 0x01, 0xd0,                         // add    %rdx,%rax
+        0x48, 0x89, 0x05, 0xf8, 0x0f, 0x00, 0x00, // mov    %rax,0x402010(%rip)
+        0xc3,                                     // retq
+    };
+    uint64_t data[2] = {0xabcd0000, 0x5a5a5a5a};
+    uint8_t file[0x2000 + sizeof(data)];
+    memset(file, 0, sizeof(file));
+
+    Elf64_Ehdr *ehdr = (Elf64_Ehdr *)file;
+    memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+    ehdr->e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr->e_type = ET_EXEC;
+    ehdr->e_machine = EM_X86_64;
+    ehdr->e_version = EV_CURRENT;
+    ehdr->e_entry = 0x401000;
+    ehdr->e_phoff = sizeof(Elf64_Ehdr);
+    ehdr->e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr->e_phentsize = sizeof(Elf64_Phdr);
+    ehdr->e_phnum = 2;
+
+    Elf64_Phdr *phdr = (Elf64_Phdr *)(file + sizeof(Elf64_Ehdr));
+    phdr[0].p_type = PT_LOAD;
+    phdr[0].p_flags = PF_R | PF_X;
+    phdr[0].p_offset = 0x1000;
+    phdr[0].p_vaddr = 0x401000;
+    phdr[0].p_filesz = sizeof(code);
+    phdr[0].p_memsz = sizeof(code);
+    phdr[1].p_type = PT_LOAD;
+    phdr[1].p_flags = PF_R | PF_W;
+    phdr[1].p_offset = 0x2000;
+    phdr[1].p_vaddr = 0x402000;
+    phdr[1].p_filesz = sizeof(data);
+    phdr[1].p_memsz = 64 << 20;
+    memcpy(file + 0x1000, code, sizeof(code));
+    memcpy(file + 0x2000, data, sizeof(data));
+
+    char filename[] = "/tmp/asms-elf-XXXXXX";
+    int fd = mkstemp(filename);
+    match = match && fd >= 0 && write(fd, file, sizeof(file)) == sizeof(file);
+    close(fd);
+
+    core_t *ac = (core_t *)&cores[0];
+    uint64_t touched = pm_touched_frames();
+    elf_t *elf = load_elf(filename, ac);
+    unlink(filename);
+    match = match && ac->rip == 0x401000 && ac->reg.rsp == STACK_TOP - 8;
+
+    stop_condition_t stop = {0};
+    run_result_t result = run(ac, 100, &stop);
+    match = match && result.status == RUN_SENTINEL && result.num_inst == 5;
+    match = match && ac->rip == 0 && ac->reg.rax == 0xabcd1234;
+    match = match && read64bits_dram(va2pa(0x402010, ac), ac) == 0xabcd1234;
+    match = match && read64bits_dram(va2pa(0x402008, ac), ac) == 0x5a5a5a5a;
+    match = match && read64bits_dram(va2pa(0x402000 + (32 << 20), ac), ac) == 0;
+    // the page tables and the touched pages, not the 64 MiB of the segment
+    match = match && pm_touched_frames() - touched < 16;
+    free_elf(elf, ac);
+
+    if (match) {
+        printf("load elf match\n");
+    } else {
+        printf("load elf mismatch\n");
+    }
+}
+
+typedef struct {
+    const char *name;
+    uint8_t bind;
+    uint16_t shndx;
+    uint64_t value;
+    uint64_t size;
+} TestSymbol;
+
+typedef struct {
+    uint64_t offset;
+    uint32_t sym;
+    uint32_t type;
+    int64_t addend;
+} TestRela;
+
+static uint64_t AppendBytes(uint8_t *file, uint64_t offset, const void *bytes, uint64_t size, uint64_t align) {
+    offset = (offset + align - 1) & ~(align - 1);
+    memcpy(file + offset, bytes, size);
+    return offset;
+}
+
+// a relocatable object of .text and .data written to a temporary file
+// sections: 1 .text, 2 .data, 3 .rela.text, 4 .rela.data, 5 .symtab, 6 .strtab, 7 .shstrtab
+static void WriteObject(char *filename, const uint8_t *text, uint64_t text_size, const uint8_t *data, uint64_t data_size,
+                        const TestSymbol *syms, int num_sym, const TestRela *relas, int num_text_rela, int num_data_rela) {
+    uint8_t file[4096];
+    memset(file, 0, sizeof(file));
+    Elf64_Shdr shdr[8];
+    memset(shdr, 0, sizeof(shdr));
+    uint64_t end = sizeof(Elf64_Ehdr);
+
+    shdr[1].sh_offset = AppendBytes(file, end, text, text_size, 16);
+    shdr[1].sh_size = text_size;
+    shdr[1].sh_type = SHT_PROGBITS;
+    shdr[1].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+    shdr[1].sh_addralign = 16;
+    end = shdr[1].sh_offset + text_size;
+    shdr[2].sh_offset = AppendBytes(file, end, data, data_size, 8);
+    shdr[2].sh_size = data_size;
+    shdr[2].sh_type = SHT_PROGBITS;
+    shdr[2].sh_flags = SHF_ALLOC | SHF_WRITE;
+    shdr[2].sh_addralign = 8;
+    end = shdr[2].sh_offset + data_size;
+
+    for (int k = 0; k < 2; ++k) {
+        Elf64_Shdr *rela_shdr = &shdr[3 + k];
+        rela_shdr->sh_type = SHT_RELA;
+        rela_shdr->sh_offset = (end + 7) & ~7;
+        rela_shdr->sh_size = (k == 0 ? num_text_rela : num_data_rela) * sizeof(Elf64_Rela);
+        rela_shdr->sh_entsize = sizeof(Elf64_Rela);
+        rela_shdr->sh_link = 5;
+        rela_shdr->sh_info = 1 + k;
+        for (int i = 0; i < (k == 0 ? num_text_rela : num_data_rela); ++i) {
+            const TestRela *r = &relas[k == 0 ? i : num_text_rela + i];
+            Elf64_Rela rela = {r->offset, ELF64_R_INFO(r->sym, r->type), r->addend};
+            end = AppendBytes(file, rela_shdr->sh_offset + i * sizeof(Elf64_Rela), &rela, sizeof(rela), 1) + sizeof(rela);
+        }
+        end = rela_shdr->sh_offset + rela_shdr->sh_size;
+    }
+
+    // the string table after the symbol table
+    char strtab[256] = {0};
+    uint64_t strtab_size = 1;
+    shdr[5].sh_type = SHT_SYMTAB;
+    shdr[5].sh_offset = (end + 7) & ~7;
+    shdr[5].sh_size = (num_sym + 1) * sizeof(Elf64_Sym);
+    shdr[5].sh_entsize = sizeof(Elf64_Sym);
+    shdr[5].sh_link = 6;
+    shdr[5].sh_info = 1;
+    for (int i = 0; i < num_sym; ++i) {
+        Elf64_Sym sym;
+        memset(&sym, 0, sizeof(sym));
+        sym.st_name = strtab_size;
+        sym.st_info = ELF64_ST_INFO(syms[i].bind, STT_NOTYPE);
+        sym.st_shndx = syms[i].shndx;
+        sym.st_value = syms[i].value;
+        sym.st_size = syms[i].size;
+        memcpy(file + shdr[5].sh_offset + (i + 1) * sizeof(Elf64_Sym), &sym, sizeof(sym));
+        strcpy(strtab + strtab_size, syms[i].name);
+        strtab_size += strlen(syms[i].name) + 1;
+    }
+    end = shdr[5].sh_offset + shdr[5].sh_size;
+    shdr[6].sh_type = SHT_STRTAB;
+    shdr[6].sh_offset = AppendBytes(file, end, strtab, strtab_size, 1);
+    shdr[6].sh_size = strtab_size;
+    end = shdr[6].sh_offset + strtab_size;
+
+    const char shstrtab[] = "\0.text\0.data\0.rela.text\0.rela.data\0.symtab\0.strtab\0.shstrtab";
+    uint32_t names[8] = {0, 1, 7, 13, 24, 35, 43, 51};
+    shdr[7].sh_type = SHT_STRTAB;
+    shdr[7].sh_offset = AppendBytes(file, end, shstrtab, sizeof(shstrtab), 1);
+    shdr[7].sh_size = sizeof(shstrtab);
+    end = shdr[7].sh_offset + sizeof(shstrtab);
+    for (int i = 0; i < 8; ++i) {
+        shdr[i].sh_name = names[i];
+    }
+    uint64_t shoff = AppendBytes(file, end, shdr, sizeof(shdr), 8);
+
+    Elf64_Ehdr *ehdr = (Elf64_Ehdr *)file;
+    memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+    ehdr->e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr->e_type = ET_REL;
+    ehdr->e_machine = EM_X86_64;
+    ehdr->e_version = EV_CURRENT;
+    ehdr->e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr->e_shoff = shoff;
+    ehdr->e_shentsize = sizeof(Elf64_Shdr);
+    ehdr->e_shnum = 8;
+    ehdr->e_shstrndx = 7;
+
+    int fd = mkstemp(filename);
+    uint64_t size = shoff + sizeof(shdr);
+    if (fd < 0 || write(fd, file, size) != (ssize_t)size) {
+        printf("cannot write %s\n", filename);
+    }
+    close(fd);
+}
+
+static void TestStaticLink() {
+    int match = 1;
+
+    // main.o: _start calls add() and stores its return value to the common symbol result
+    // ptr points to value, whose weak definition here is overridden by add.o
+    // hook is weak undefined, so its address is 0
+    uint8_t main_text[] = {
+        0xe8, 0x00, 0x00, 0x00, 0x00,             // callq  add
+        0x48, 0x89, 0x05, 0x00, 0x00, 0x00, 0x00, // mov    %rax,result(%rip)
+        0xc3,                                     // retq
+    };
+    uint64_t main_data[3] = {0, 1, 1}; // ptr, value (weak), &hook
+    TestSymbol main_syms[] = {
+        {"_start", STB_GLOBAL, 1, 0, sizeof(main_text)},
+        {"add", STB_GLOBAL, SHN_UNDEF, 0, 0},
+        {"result", STB_GLOBAL, SHN_UNDEF, 0, 0},
+        {"ptr", STB_GLOBAL, 2, 0, 8},
+        {"value", STB_WEAK, 2, 8, 8},
+        {"hook", STB_WEAK, SHN_UNDEF, 0, 0},
+    };
+    TestRela main_relas[] = {
+        {1, 2, R_X86_64_PLT32, -4},
+        {8, 3, R_X86_64_PC32, -4},
+        {0, 5, R_X86_64_64, 0},
+        {16, 6, R_X86_64_64, 0},
+    };
+
+    // add.o: add() returns value
+    uint8_t add_text[] = {
+        0x48, 0x8b, 0x05, 0x00, 0x00, 0x00, 0x00, // mov    value(%rip),%rax
+        0xc3,                                     // retq
+    };
+    uint64_t add_data[1] = {0x1234}; // value (strong)
+    TestSymbol add_syms[] = {
+        {"add", STB_GLOBAL, 1, 0, sizeof(add_text)},
+        {"value", STB_GLOBAL, 2, 0, 8},
+        {"result", STB_GLOBAL, SHN_COMMON, 8, 8},
+    };
+    TestRela add_relas[] = {
+        {3, 2, R_X86_64_PC32, -4},
+    };
+
+    char main_file[] = "/tmp/asms-main-XXXXXX";
+    char add_file[] = "/tmp/asms-add-XXXXXX";
+    WriteObject(main_file, main_text, sizeof(main_text), (uint8_t *)main_data, sizeof(main_data), main_syms, 6, main_relas, 2, 2);
+    WriteObject(add_file, add_text, sizeof(add_text), (uint8_t *)add_data, sizeof(add_data), add_syms, 3, add_relas, 1, 0);
+
+    elf_t *objects[2] = {open_elf(main_file), open_elf(add_file)};
+    image_t *image = link_elf(objects, 2);
+    unlink(main_file);
+    unlink(add_file);
+    // the image does not refer to the objects
+    close_elf(objects[0]);
+    close_elf(objects[1]);
+
+    core_t *ac = (core_t *)&cores[0];
+    load_image(image, ac);
+    match = match && ac->rip == find_image_symbol(image, "_start");
+    stop_condition_t stop = {0};
+    run_result_t status = run(ac, 100, &stop);
+    match = match && status.status == RUN_SENTINEL && status.num_inst == 5;
+    uint64_t value = find_image_symbol(image, "value");
+    uint64_t result = find_image_symbol(image, "result");
+    match = match && ac->rip == 0 && ac->reg.rax == 0x1234;
+    match = match && read64bits_dram(va2pa(result, ac), ac) == 0x1234;
+    match = match && read64bits_dram(va2pa(find_image_symbol(image, "ptr"), ac), ac) == value;
+    match = match && read64bits_dram(va2pa(value, ac), ac) == 0x1234;
+    match = match && read64bits_dram(va2pa(find_image_symbol(image, "ptr") + 16, ac), ac) == 0;
+    // .bss after .data of both objects
+    match = match && result > value && result < image->segment[IMAGE_DATA].vaddr + image->segment[IMAGE_DATA].memsz;
+
+    unmap_vm_areas(ac);
+    free_image(image);
+
+    if (match) {
+        printf("static link match\n");
+    } else {
+        printf("static link mismatch\n");
+    }
+}
+
+static void TestRun() {
+    int match = 1;
+
+    // break at the entry of add() and inside its block, then run to the end of the text
+    core_t *ac = LoadAddFunctionCallAndComputation();
+    stop_condition_t stop = {0};
+    stop.sentinel = 0xffffffffffffffff;
+    stop.num_breakpoint = 2;
+    stop.breakpoint[0] = 0x00400000;
+    stop.breakpoint[1] = 0x00400000 + 6 * MAX_INSTRUCTION_CHAR; // add %rdx,%rax
+
+    run_result_t result = run(ac, 100, &stop);
+    match = match && result.status == RUN_BREAKPOINT && result.num_inst == 3 && ac->rip == stop.breakpoint[0];
+    result = run(ac, 100, &stop);
+    match = match && result.status == RUN_BREAKPOINT && result.num_inst == 6 && ac->rip == stop.breakpoint[1];
+    // no instruction after the program
+    result = run(ac, 100, &stop);
+    match = match && result.status == RUN_FAULT && result.num_inst == 6 && ac->rip == 0x00400000 + 15 * MAX_INSTRUCTION_CHAR;
+    CheckAddFunctionCallAndComputation(ac);
+
+    // the budget ends inside the block of add()
+    ac = LoadAddFunctionCallAndComputation();
+    result = run(ac, 4, NULL);
+    match = match && result.status == RUN_BUDGET && result.num_inst == 4 && ac->rip == 0x00400000 + MAX_INSTRUCTION_CHAR;
+
+    if (match) {
+        printf("run match\n");
+    } else {
+        printf("run mismatch\n");
+    }
+}
+
+static void TestTrace() {
+    int match = 1;
+    char filename[] = "/tmp/asms-trace-XXXXXX";
+    close(mkstemp(filename));
+
+    // the TLB counts the same with and without the trace
+    core_t *ac = LoadAddFunctionCallAndComputation();
+    tlb_t tlb = ac->tlb;
+    run(ac, 15, NULL);
+    uint64_t hit = ac->tlb.hit - tlb.hit;
+    uint64_t miss = ac->tlb.miss - tlb.miss;
+
+    ac = LoadAddFunctionCallAndComputation();
+    tlb = ac->tlb;
+    trace_start(filename);
+    run(ac, 15, NULL);
+    trace_stop();
+    match = match && ac->tlb.hit - tlb.hit == hit && ac->tlb.miss - tlb.miss == miss;
+
+    // the state at the end of the trace
+    replay_state_t state;
+    replay_trace(filename, 0, UINT64_MAX, &state);
+    match = match && state.step == 15 && state.rip == ac->rip;
+    match = match && memcmp(&(state.reg), &(ac->reg), sizeof(reg_t)) == 0;
+    // the return address pushed by callq
+    uint64_t value = 0;
+    match = match && replay_read(&state, 0x7ffffffee0e8, (uint8_t *)&value, 8) && value == 0x00400380;
+    match = match && replay_read(&state, 0x7ffffffee108, (uint8_t *)&value, 8) && value == 0x1234abcd;
+    // not written by the program
+    match = match && replay_read(&state, 0x7ffffffee100, (uint8_t *)&value, 8) == 0;
+    free_replay(&state);
+
+    // the state in the middle of the trace, as the core executing as many instructions
+    ac = LoadAddFunctionCallAndComputation();
+    for (int i = 0; i < 11; ++i) {
+        instruction_cycle(ac);
+    }
+    replay_trace(filename, 0, 11, &state);
+    match = match && state.step == 11 && state.rip == ac->rip;
+    match = match && memcmp(&(state.reg), &(ac->reg), sizeof(reg_t)) == 0;
+    free_replay(&state);
+    unlink(filename);
+
+    if (match) {
+        printf("trace match\n");
+    } else {
+        printf("trace mismatch\n");
+    }
+}
+
+static void TestDebugMask() {
+    int match = 1;
+    uint64_t verbose = debug_verbose_set;
+
+    set_debug_verbose(0);
+    match = match && !debug_enabled(DEBUG_INSTRUCTIONCYCLE) && !debug_enabled(DEBUG_MMU);
+    // only the categories compiled in are turned on
+    set_debug_verbose(DEBUG_INSTRUCTIONCYCLE | DEBUG_MMU);
+    match = match && debug_enabled(DEBUG_INSTRUCTIONCYCLE) == ((DEBUG_VERBOSE_SET & DEBUG_INSTRUCTIONCYCLE) != 0);
+    match = match && debug_enabled(DEBUG_MMU) == ((DEBUG_VERBOSE_SET & DEBUG_MMU) != 0);
+    set_debug_verbose(verbose);
+
+    if (match) {
+        printf("debug mask match\n");
+    } else {
+        printf("debug mask mismatch\n");
+    }
+}
+
+static void TestProfile() {
+    int match = 1;
+    char folded_file[] = "/tmp/asms-folded-XXXXXX";
+    close(mkstemp(folded_file));
+
+    core_t *ac = LoadAddFunctionCallAndComputation();
+    profile_start(NULL, folded_file);
+    run(ac, 15, NULL);
+    profile_stop();
+
+    profile_summary_t summary;
+    profile_summary(&summary);
+    match = match && summary.num_inst == 15;
+    match = match && summary.op[INST_MOV].count == 10 && summary.op[INST_MOV].mem_read == 3 && summary.op[INST_MOV].mem_write == 4;
+    match = match && summary.op[INST_PUSH].count == 1 && summary.op[INST_PUSH].mem_write == 1;
+    match = match && summary.op[INST_CALL].count == 1 && summary.op[INST_RET].count == 1 && summary.op[INST_ADD].count == 1;
+    match = match && profile_rip_count(0x00400000) == 1 && profile_rip_count(0x00400500) == 0;
+
+    // the stacks of the caller and add()
+    char line[128];
+    uint64_t total = 0;
+    FILE *folded = fopen(folded_file, "r");
+    while (folded != NULL && fgets(line, sizeof(line), folded) != NULL) {
+        char stack[96];
+        uint64_t count = 0;
+        if (sscanf(line, "%95s %lu", stack, &count) == 2) {
+            match = match && (strcmp(stack, "0x4002c0") == 0 || strcmp(stack, "0x4002c0;0x400000") == 0);
+            match = match && (strcmp(stack, "0x4002c0;0x400000") != 0 || count == 11);
+            total += count;
+        }
+    }
+    match = match && folded != NULL && total == 15;
+    if (folded != NULL) {
+        fclose(folded);
+    }
+    unlink(folded_file);
+
+    // the cores grow their tables to different sizes, the report merges them
+    profile_start(NULL, NULL);
+    inst_t inst;
+    memset(&inst, 0, sizeof(inst_t));
+    trace_record_t record;
+    memset(&record, 0, sizeof(trace_record_t));
+    for (uint64_t i = 0; i < 2100; ++i) {
+        record.rip = 0x00500000 + 4 * i;
+        profile_instruction(&record, &inst, (core_t *)&cores[0]);
+    }
+    record.rip = 0x00600000;
+    profile_instruction(&record, &inst, (core_t *)&cores[NUM_CORES - 1]);
+    profile_instruction(&record, &inst, (core_t *)&cores[NUM_CORES - 1]);
+    FILE *report = tmpfile();
+    profile_report(report);
+    profile_stop();
+    rewind(report);
+    uint64_t rip = 0, count = 0;
+    double share = 0;
+    while (fgets(line, sizeof(line), report) != NULL && sscanf(line, "%lx %lu %lf%%", &rip, &count, &share) != 3) {
+    }
+    match = match && rip == 0x00600000 && count == 2;
+    fclose(report);
+
+    if (match) {
+        printf("profile match\n");
+    } else {
+        printf("profile mismatch\n");
+    }
+}
+
+static void TestTiming() {
+    int match = 1;
+
+    // 10 mov, push, pop, add: 1 cycle, call, ret: 2 cycles
+    // the stall is the one of the cache model if it is compiled in, or else the flat stall, 0 by default
+    core_t *ac = LoadAddFunctionCallAndComputation();
+    reset_cache_hierarchy();
+    timing_start();
+    run(ac, 15, NULL);
+    timing_stop();
+    timing_t t = core_timing[0];
+    uint64_t stall = (DEBUG_ENABLE_SRAM_CACHE == 1) ? core_cache[0].stall : 0;
+    match = match && t.instructions == 15 && t.cycles == 17 + stall && t.mem_stall == stall && t.mem_access >= 11;
+
+    // 5 reads by mov, pop, ret and 6 writes by mov, push, call
+    // the threaded engine runs the blocks while timing
+    ac = LoadAddFunctionCallAndComputation();
+    reset_cache_hierarchy();
+    flat_memory_stall[TIMING_READ] = 100;
+    flat_memory_stall[TIMING_WRITE] = 10;
+    timing_start();
+    threaded_cycle(ac, 15);
+    timing_stop();
+    flat_memory_stall[TIMING_READ] = 0;
+    flat_memory_stall[TIMING_WRITE] = 0;
+    t = core_timing[0];
+    stall = (DEBUG_ENABLE_SRAM_CACHE == 1) ? core_cache[0].stall : 5 * 100 + 6 * 10;
+    match = match && t.instructions == 15 && t.mem_access == 11 && t.mem_stall == stall;
+    match = match && t.cycles == 17 + t.mem_stall && timing_ipc(ac) == 15.0 / t.cycles;
+
+    if (match) {
+        printf("timing match\n");
+    } else {
+        printf("timing mismatch\n");
+    }
+}
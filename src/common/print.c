@@ -3,18 +3,19 @@
 #include <assert.h>
 #include "common.h"
 
-// wrapper of stdio printf
-// controlled by the debug verbose bit set
-uint64_t debug_printf(uint64_t open_set, const char *format, ...) {
-    if ((open_set & DEBUG_VERBOSE_SET) == 0x0) {
-        return 0x1;
-    }
+uint64_t debug_verbose_set = DEBUG_VERBOSE_SET;
+
+void set_debug_verbose(uint64_t open_set) {
+    // relaxed, as the cores only check the bits
+    __atomic_store_n(&debug_verbose_set, open_set & DEBUG_VERBOSE_SET, __ATOMIC_RELAXED);
+}
 
+// wrapper of stdio printf
+// called by debug_printf() when the category is on
+void debug_output(const char *format, ...) {
     // implementation of std printf()
     va_list argptr;
     va_start(argptr, format);
     vfprintf(stderr, format, argptr);
     va_end(argptr);
-
-    return 0x0;
-}
\ No newline at end of file
+}
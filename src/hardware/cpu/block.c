@@ -0,0 +1,160 @@
+// Basic block translation
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "memory.h"
+#include "common.h"
+#include "instruction.h"
+#include "trace.h"
+
+/*======================================*/
+/*      translated basic blocks         */
+/*======================================*/
+
+// the instructions of a block are decoded once into a contiguous array
+// and executed in a tight loop without fetching or decoding
+// a block never crosses a page, so the code of a block is in one physical page
+#define NUM_BLOCK 256
+
+// one cache for the physical memory, as the decoded instruction cache
+// the block engines run on one host thread at a time (run_cores drives instruction_cycle)
+// and the writes of all the cores make the blocks stale through the generations of the code pages
+static block_t block_cache[NUM_BLOCK];
+
+static inline uint64_t block_index(uint64_t paddr) {
+    // fibonacci hashing of the physical address
+    return (paddr * 0x9e3779b97f4a7c15) >> 56;
+}
+
+// the bytes the block at paddr may span: the rest of the page,
+// and the last machine code instruction may cross to the next one
+static inline uint64_t block_code_len(uint64_t paddr, core_t *cr) {
+    uint64_t len = PAGE_SIZE - (paddr & (PAGE_SIZE - 1));
+    return (cr->encoding == INST_ENCODING_BINARY) ? len + MAX_INSTRUCTION_BYTE - 1 : len;
+}
+
+// the code of the block has been written since its translation, by any core
+// chained pointers to a stale block fail this check
+int is_stale_block(block_t *block, core_t *cr) {
+    return block->valid == 0 || block->gen != code_generation(block->paddr, block_code_len(block->paddr, cr));
+}
+
+// the block ends after the control transfer instructions
+static inline int is_block_end(op_t op) {
+    return op == INST_CALL || op == INST_RET || op == INST_JNE || op == INST_JMP || op == INST_UNKNOWN;
+}
+
+// decode the block starting from the rip of the core, at physical address paddr
+static block_t *translate_block(uint64_t paddr, core_t *cr) {
+    block_t *block = &block_cache[block_index(paddr)];
+
+    block->valid = 1;
+    block->vaddr = cr->rip;
+    block->paddr = paddr;
+    // before the code is read: a write from now on makes the block stale
+    block->gen = code_generation(paddr, block_code_len(paddr, cr));
+    block->num_inst = 0;
+    block->next[0] = NULL;
+    block->next[1] = NULL;
+    block->threaded = 0;
+    block->num_exec = 0;
+    block->jit_gen = 0;
+    block->jit_unsupported = 0;
+    block->jit_code = NULL;
+
+    block->len = 0;
+    while (block->num_inst < MAX_BLOCK_INST) {
+        inst_t *inst = &block->inst[block->num_inst];
+        decode_instruction(block->vaddr + block->len, paddr + block->len, inst, cr);
+        block->num_inst += 1;
+        block->len += inst->len;
+
+        if (is_block_end(inst->op)) {
+            break;
+        }
+
+        // stop at the page boundary: the next instruction may be in another frame
+        if (((paddr + block->len) >> PHYSICAL_PAGE_OFFSET_LENGTH) != (paddr >> PHYSICAL_PAGE_OFFSET_LENGTH)) {
+            break;
+        }
+    }
+    debug_printf(DEBUG_INSTRUCTIONCYCLE, "block %lx    %lu instructions\n", block->vaddr, block->num_inst);
+    return block;
+}
+
+// the block is the translation of rip, mapped to paddr
+// the same rip may be mapped to another frame, e.g. in a new address space
+static inline int is_block_of(block_t *block, uint64_t rip, uint64_t paddr, core_t *cr) {
+    return block->paddr == paddr && block->vaddr == rip && is_stale_block(block, cr) == 0;
+}
+
+static block_t *lookup_block(uint64_t paddr, core_t *cr) {
+    block_t *block = &block_cache[block_index(paddr)];
+    if (is_block_of(block, cr->rip, paddr, cr)) {
+        return block;
+    }
+    return translate_block(paddr, cr);
+}
+
+// find the block starting from the rip of the core, translate it if not found
+block_t *find_block(core_t *cr) {
+    return lookup_block(va2pa(cr->rip, cr), cr);
+}
+
+// the successor of the block prev which has just been executed
+block_t *next_block(block_t *prev, core_t *cr) {
+    // the chain saves the lookup, not the translation of rip
+    uint64_t paddr = va2pa(cr->rip, cr);
+    for (int i = 0; i < 2; ++i) {
+        block_t *next = prev->next[i];
+        if (next != NULL && is_block_of(next, cr->rip, paddr, cr)) {
+            return next;
+        }
+    }
+
+    block_t *next = lookup_block(paddr, cr);
+    // link the successor: fill the empty slot first, then replace the second one
+    // the translation may have evicted prev itself
+    if (prev->valid == 1) {
+        if (prev->next[0] == NULL || is_stale_block(prev->next[0], cr)) {
+            prev->next[0] = next;
+        } else {
+            prev->next[1] = next;
+        }
+    }
+    return next;
+}
+
+// execute at most max_num_inst instructions as translated basic blocks
+// return the number of instructions executed
+uint64_t block_cycle(core_t *cr, uint64_t max_num_inst) {
+    uint64_t count = 0;
+    block_t *block = NULL;
+
+    while (count < max_num_inst) {
+        block = (block == NULL) ? find_block(cr) : next_block(block, cr);
+
+        uint64_t n = block->num_inst;
+        if (n > max_num_inst - count) {
+            n = max_num_inst - count;
+        }
+        inst_t *inst = block->inst;
+        fetch_block(block, 0, n, cr);
+        for (uint64_t i = 0; i < n; ++i) {
+            execute_instruction(&inst[i], cr);
+            if (wrote_block(&inst[i], block, cr)) {
+                // the last one executed
+                n = i + 1;
+            }
+        }
+        count += n;
+
+        if (n < block->num_inst || is_stale_block(block, cr)) {
+            // stopped inside the block, or its page was written, e.g. by the block itself
+            block = NULL;
+        }
+    }
+    return count;
+}
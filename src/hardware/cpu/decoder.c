@@ -0,0 +1,289 @@
+// x86-64 machine code decoder
+#include <stdint.h>
+#include <string.h>
+#include "cpu.h"
+#include "instruction.h"
+
+/*======================================*/
+/*      machine code                    */
+/*======================================*/
+
+// the subset of x86-64 emitted for the programs of the simulator:
+//   [REX] 50+r       push %r64
+//   [REX] 58+r       pop %r64
+//   REX.W 89 /r      mov %r64,r/m64
+//   REX.W 8b /r      mov r/m64,%r64
+//   REX.W c7 /0 id   mov $imm32,r/m64
+//   [REX] b8+r io    mov $imm64,%r64 (REX.W), mov $imm32,%r32
+//   REX.W 01/03 /r   add %r64,%r64
+//   REX.W 81/83 /5   sub $imm32,%r64 or $imm8
+//   REX.W 81/83 /7   cmp $imm32,m64 or $imm8
+//   e8 cd            call rel32
+//   c3               ret
+//   c9               leave
+//   e9 cd, eb cb     jmp rel32, rel8
+//   75 cb, 0f 85 cd  jne rel8, rel32
+// without REX.W the register operands are 32 bits
+// and the memory operands are not supported, as the handlers access 64 bits
+// the other forms of add, sub and cmp are decoded as unknown, as the handlers do not run them
+
+#define REX_W 0x8
+#define REX_R 0x4
+#define REX_X 0x2
+#define REX_B 0x1
+
+// register number in the machine code -> slot in reg_t
+static const uint8_t machine_register_index[16] = {
+    0, // rax
+    2, // rcx
+    3, // rdx
+    1, // rbx
+    7, // rsp
+    6, // rbp
+    4, // rsi
+    5, // rdi
+    8, 9, 10, 11, 12, 13, 14, 15, // r8 - r15
+};
+
+typedef struct DECODER_STRUCT {
+    const uint8_t *code;
+    uint64_t pos;         // bytes consumed
+    uint8_t rex;          // low 4 bits of the REX prefix
+    uint8_t rip_relative; // 1: the memory operand is relative to the next rip
+} decoder_t;
+
+static inline uint8_t fetch8(decoder_t *d) {
+    return d->code[d->pos++];
+}
+
+// sign extended
+static inline uint64_t fetch_imm8(decoder_t *d) {
+    return (uint64_t)(int64_t)(int8_t)fetch8(d);
+}
+
+// sign extended
+static inline uint64_t fetch_imm32(decoder_t *d) {
+    int32_t v;
+    memcpy(&v, &d->code[d->pos], 4);
+    d->pos += 4;
+    return (uint64_t)(int64_t)v;
+}
+
+static inline uint64_t fetch_imm64(decoder_t *d) {
+    uint64_t v;
+    memcpy(&v, &d->code[d->pos], 8);
+    d->pos += 8;
+    return v;
+}
+
+static inline void set_register(od_t *od, uint8_t number, reg_width_t width) {
+    od->type = REG;
+    od->reg1.index = machine_register_index[number & 0xf];
+    od->reg1.width = width;
+}
+
+// decode ModRM (with SIB and displacement) to the r/m operand
+// return the reg field, extended by REX.R
+static uint8_t decode_modrm(decoder_t *d, od_t *rm, reg_width_t width) {
+    uint8_t modrm = fetch8(d);
+    uint8_t mod = modrm >> 6;
+    uint8_t reg = ((modrm >> 3) & 0x7) | ((d->rex & REX_R) ? 0x8 : 0);
+    uint8_t base = modrm & 0x7;
+
+    if (mod == 3) {
+        set_register(rm, base | ((d->rex & REX_B) ? 0x8 : 0), width);
+        return reg;
+    }
+
+    int has_base = 1;
+    int has_index = 0;
+    uint8_t index = 0;
+    uint64_t scale = 1;
+
+    if (base == 4) {
+        // SIB
+        uint8_t sib = fetch8(d);
+        scale = 1 << (sib >> 6);
+        index = ((sib >> 3) & 0x7) | ((d->rex & REX_X) ? 0x8 : 0);
+        has_index = (index != 4);
+        base = sib & 0x7;
+        if (mod == 0 && base == 5) {
+            // no base register, disp32
+            has_base = 0;
+        }
+    } else if (mod == 0 && base == 5) {
+        // rip relative, disp32
+        has_base = 0;
+        d->rip_relative = 1;
+    }
+    base = base | ((d->rex & REX_B) ? 0x8 : 0);
+
+    int has_disp = 1;
+    if (mod == 1) {
+        rm->imm = fetch_imm8(d);
+    } else if (mod == 2 || has_base == 0) {
+        rm->imm = fetch_imm32(d);
+    } else {
+        rm->imm = 0;
+        has_disp = 0;
+    }
+
+    if (has_base) {
+        rm->reg1.index = machine_register_index[base];
+        rm->reg1.width = REG_64;
+    }
+    if (has_index) {
+        rm->reg2.index = machine_register_index[index];
+        rm->reg2.width = REG_64;
+        rm->scal = scale;
+    }
+
+    if (has_base && has_index) {
+        if (scale == 1) {
+            rm->type = has_disp ? MEM_IMM_REG1_REG2 : MEM_REG1_REG2;
+        } else {
+            rm->type = has_disp ? MEM_IMM_REG1_REG2_SCAL : MEM_REG1_REG2_SCAL;
+        }
+    } else if (has_base) {
+        rm->type = has_disp ? MEM_IMM_REG1 : MEM_REG1;
+    } else if (has_index) {
+        rm->type = MEM_IMM_REG2_SCAL;
+    } else {
+        rm->type = MEM_IMM;
+    }
+    return reg;
+}
+
+static inline int is_memory(od_t *od) {
+    return od->type >= MEM_IMM;
+}
+
+// the operands of add, sub and cmp which the handlers run, with 64-bit flags
+static int is_handled(inst_t *inst, reg_width_t width) {
+    switch (inst->op) {
+    case INST_ADD: return width == REG_64 && inst->src.type == REG && inst->dst.type == REG;
+    case INST_SUB: return width == REG_64 && inst->src.type == IMM && inst->dst.type == REG;
+    case INST_CMP: return width == REG_64 && inst->src.type == IMM && is_memory(&(inst->dst));
+    default: return 1;
+    }
+}
+
+// decode the x86-64 machine code at virtual address vaddr
+// code holds at least MAX_INSTRUCTION_BYTE bytes
+// return the bytes read by the decoder, also of an unknown instruction
+uint64_t decode_machine_code(const uint8_t *code, uint64_t vaddr, inst_t *inst) {
+    decoder_t d = {code, 0, 0, 0};
+    memset(inst, 0, sizeof(inst_t));
+
+    uint8_t opcode = fetch8(&d);
+    if ((opcode & 0xf0) == 0x40) {
+        d.rex = opcode & 0xf;
+        opcode = fetch8(&d);
+    }
+    reg_width_t width = (d.rex & REX_W) ? REG_64 : REG_32;
+    od_t *src = &(inst->src);
+    od_t *dst = &(inst->dst);
+
+    switch (opcode) {
+    case 0x50: case 0x51: case 0x52: case 0x53:
+    case 0x54: case 0x55: case 0x56: case 0x57:
+        inst->op = INST_PUSH;
+        set_register(src, (opcode & 0x7) | ((d.rex & REX_B) ? 0x8 : 0), REG_64);
+        break;
+    case 0x58: case 0x59: case 0x5a: case 0x5b:
+    case 0x5c: case 0x5d: case 0x5e: case 0x5f:
+        inst->op = INST_POP;
+        set_register(src, (opcode & 0x7) | ((d.rex & REX_B) ? 0x8 : 0), REG_64);
+        break;
+    case 0xb8: case 0xb9: case 0xba: case 0xbb:
+    case 0xbc: case 0xbd: case 0xbe: case 0xbf:
+        inst->op = INST_MOV;
+        src->type = IMM;
+        src->imm = (width == REG_64) ? fetch_imm64(&d) : (fetch_imm32(&d) & 0xffffffff);
+        set_register(dst, (opcode & 0x7) | ((d.rex & REX_B) ? 0x8 : 0), width);
+        break;
+    case 0x89: case 0x01: case 0x29: case 0x39:
+        // op %reg,r/m
+        inst->op = (opcode == 0x89) ? INST_MOV : (opcode == 0x01) ? INST_ADD : (opcode == 0x29) ? INST_SUB : INST_CMP;
+        set_register(src, decode_modrm(&d, dst, width), width);
+        break;
+    case 0x8b: case 0x03: case 0x2b: case 0x3b:
+        // op r/m,%reg
+        inst->op = (opcode == 0x8b) ? INST_MOV : (opcode == 0x03) ? INST_ADD : (opcode == 0x2b) ? INST_SUB : INST_CMP;
+        set_register(dst, decode_modrm(&d, src, width), width);
+        break;
+    case 0xc7:
+        inst->op = (decode_modrm(&d, dst, width) & 0x7) == 0 ? INST_MOV : INST_UNKNOWN;
+        src->type = IMM;
+        src->imm = fetch_imm32(&d);
+        break;
+    case 0x81: case 0x83: {
+        uint8_t ext = decode_modrm(&d, dst, width) & 0x7;
+        inst->op = (ext == 0) ? INST_ADD : (ext == 5) ? INST_SUB : (ext == 7) ? INST_CMP : INST_UNKNOWN;
+        src->type = IMM;
+        src->imm = (opcode == 0x81) ? fetch_imm32(&d) : fetch_imm8(&d);
+        break;
+    }
+    case 0xe8:
+        inst->op = INST_CALL;
+        src->type = IMM;
+        src->imm = fetch_imm32(&d);
+        break;
+    case 0xe9:
+        inst->op = INST_JMP;
+        src->type = IMM;
+        src->imm = fetch_imm32(&d);
+        break;
+    case 0xeb:
+        inst->op = INST_JMP;
+        src->type = IMM;
+        src->imm = fetch_imm8(&d);
+        break;
+    case 0x75:
+        inst->op = INST_JNE;
+        src->type = IMM;
+        src->imm = fetch_imm8(&d);
+        break;
+    case 0x0f:
+        if (fetch8(&d) == 0x85) {
+            inst->op = INST_JNE;
+            src->type = IMM;
+            src->imm = fetch_imm32(&d);
+        } else {
+            inst->op = INST_UNKNOWN;
+        }
+        break;
+    case 0xc3:
+        inst->op = INST_RET;
+        break;
+    case 0xc9:
+        inst->op = INST_LEAVE;
+        break;
+    default:
+        inst->op = INST_UNKNOWN;
+        break;
+    }
+
+    if ((width == REG_32 && (is_memory(src) || is_memory(dst))) || is_handled(inst, width) == 0) {
+        inst->op = INST_UNKNOWN;
+    }
+    if (inst->op == INST_UNKNOWN) {
+        inst->src.type = EMPTY;
+        inst->dst.type = EMPTY;
+        inst->len = 0;
+        return d.pos;
+    }
+
+    inst->len = d.pos;
+    uint64_t next = vaddr + d.pos;
+    if (inst->op == INST_CALL || inst->op == INST_JMP || inst->op == INST_JNE) {
+        // the handlers take the absolute target
+        src->imm = next + src->imm;
+    }
+    if (d.rip_relative) {
+        // disp32(%rip) is the absolute address of MEM_IMM
+        od_t *mem = is_memory(src) ? src : dst;
+        mem->imm = next + mem->imm;
+    }
+    return d.pos;
+}
@@ -2,160 +2,34 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include "cpu.h"
 #include "memory.h"
 #include "common.h"
+#include "instruction.h"
+#include "trace.h"
 
 extern core_t cores[NUM_CORES];
 extern uint64_t ACTIVE_CORE;
-extern uint8_t pm[PHYSICAL_MEMORY_SPACE];
-/*======================================*/
-/*      instruction set architecture    */
-/*======================================*/
-
-// data structures
-typedef enum INST_OPERATOR {
-    INST_MOV,   // 0
-    INST_PUSH,  // 1
-    INST_POP,   // 2
-    INST_LEAVE, // 3
-    INST_CALL,  // 4
-    INST_RET,   // 5
-    INST_ADD,   // 6
-    INST_SUB,   // 7
-    INST_CMP,   // 8
-    INST_JNE,   // 9
-    INST_JMP,   // 10
-} op_t;
-
-typedef enum OPERAND_TYPE {
-    EMPTY,                 // 0
-    IMM,                   // 1
-    REG,                   // 2
-    MEM_IMM,               // 3
-    MEM_REG1,              // 4
-    MEM_IMM_REG1,          // 5
-    MEM_REG1_REG2,         // 6
-    MEM_IMM_REG1_REG2,     // 7
-    MEM_REG2_SCAL,         // 8
-    MEM_IMM_REG2_SCAL,     // 9
-    MEM_REG1_REG2_SCAL,    // 10
-    MEM_IMM_REG1_REG2_SCAL // 11
-} od_type_t;
-
-typedef struct OPERAND_STRUCT {
-    od_type_t type; // IMM, REG, MEM
-    uint64_t imm;   // immediate number
-    uint64_t scal;  // scale number to register 2
-    uint64_t reg1;  // main register
-    uint64_t reg2;  // register 2
-} od_t;
-
-// lookup table
-static const char *reg_name_list[72] = {
-    "%rax",
-    "%eax",
-    "%ax",
-    "%ah",
-    "%al",
-    "%rbx",
-    "%ebx",
-    "%bx",
-    "%bh",
-    "%bl",
-    "%rcx",
-    "%ecx",
-    "%cx",
-    "%ch",
-    "%cl",
-    "%rdx",
-    "%edx",
-    "%dx",
-    "%dh",
-    "%dl",
-    "%rsi",
-    "%esi",
-    "%si",
-    "%sih",
-    "%sil",
-    "%rdi",
-    "%edi",
-    "%di",
-    "%dih",
-    "%dil",
-    "%rbp",
-    "%ebp",
-    "%bp",
-    "%bph",
-    "%bpl",
-    "%rsp",
-    "%esp",
-    "%sp",
-    "%sph",
-    "%spl",
-    "%r8",
-    "%r8d",
-    "%r8w",
-    "%r8b",
-    "%r9",
-    "%r9d",
-    "%r9w",
-    "%r9b",
-    "%r10",
-    "%r10d",
-    "%r10w",
-    "%r10b",
-    "%r11",
-    "%r11d",
-    "%r11w",
-    "%r11b",
-    "%r12",
-    "%r12d",
-    "%r12w",
-    "%r12b",
-    "%r13",
-    "%r13d",
-    "%r13w",
-    "%r13b",
-    "%r14",
-    "%r14d",
-    "%r14w",
-    "%r14b",
-    "%r15",
-    "%r15d",
-    "%r15w",
-    "%r15b",
-};
-
-// local variables are allocated in stack in run-time
-// we don't consider local STATIC variables
-// ref: Computer Systems: A Programmer's Perspective 3rd
-// Chapter 7 Linking: 7.5 Symbols and Symbol Tables
-typedef struct INST_STRUCT {
-    op_t op;  // enum of operators. e.g. mov, call, etc.
-    od_t src; // operand src of instruction
-    od_t dst; // operand dst of instruction
-} inst_t;
-
 /*======================================*/
 /*      parse assembly instruction      */
 /*======================================*/
 
 // functions to map the string assembly code to inst_t instance
-static void parse_instruction(const char *str, inst_t *inst, core_t *cr);
-static void parse_operand(const char *str, od_t *od, core_t *cr);
-static uint64_t decode_operand(od_t *od);
-static uint64_t reflect_register(const char *str, core_t *cr);
+static void parse_instruction(const char *str, inst_t *inst);
+static void parse_operand(const char *str, od_t *od);
+static reg_od_t reflect_register(const char *str);
 
 // interpret the operand
-static uint64_t decode_operand(od_t *od) {
+// IMM: the immediate number; REG: the register value; MEM: the virtual address
+uint64_t decode_operand(od_t *od, core_t *cr) {
     if (od->type == IMM) {
         // immediate signed number can be negative: convert to bitmap
         return *(uint64_t *)&od->imm;
     } else if (od->type == REG) {
         // default register 1
-        return od->reg1;
+        return read_register(od->reg1, cr);
     } else if (od->type == EMPTY) {
         return 0;
     } else {
@@ -165,21 +39,21 @@ static uint64_t decode_operand(od_t *od) {
         if (od->type == MEM_IMM) {
             vaddr = od->imm;
         } else if (od->type == MEM_REG1) {
-            vaddr = *((uint64_t *)od->reg1);
+            vaddr = read_register(od->reg1, cr);
         } else if (od->type == MEM_IMM_REG1) {
-            vaddr = od->imm + (*((uint64_t *)od->reg1));
+            vaddr = od->imm + read_register(od->reg1, cr);
         } else if (od->type == MEM_REG1_REG2) {
-            vaddr = (*((uint64_t *)od->reg1)) + (*((uint64_t *)od->reg2));
+            vaddr = read_register(od->reg1, cr) + read_register(od->reg2, cr);
         } else if (od->type == MEM_IMM_REG1_REG2) {
-            vaddr = od->imm + (*((uint64_t *)od->reg1)) + (*((uint64_t *)od->reg2));
+            vaddr = od->imm + read_register(od->reg1, cr) + read_register(od->reg2, cr);
         } else if (od->type == MEM_REG2_SCAL) {
-            vaddr = (*((uint64_t *)od->reg2)) * od->scal;
+            vaddr = read_register(od->reg2, cr) * od->scal;
         } else if (od->type == MEM_IMM_REG2_SCAL) {
-            vaddr = od->imm + (*((uint64_t *)od->reg2)) * od->scal;
+            vaddr = od->imm + read_register(od->reg2, cr) * od->scal;
         } else if (od->type == MEM_REG1_REG2_SCAL) {
-            vaddr = (*((uint64_t *)od->reg1)) + (*((uint64_t *)od->reg2)) * od->scal;
+            vaddr = read_register(od->reg1, cr) + read_register(od->reg2, cr) * od->scal;
         } else if (od->type == MEM_IMM_REG1_REG2_SCAL) {
-            vaddr = od->imm + (*((uint64_t *)od->reg1)) + (*((uint64_t *)od->reg2)) * od->scal;
+            vaddr = od->imm + read_register(od->reg1, cr) + read_register(od->reg2, cr) * od->scal;
         }
         return vaddr;
     }
@@ -188,7 +62,155 @@ static uint64_t decode_operand(od_t *od) {
     return 0;
 }
 
-static void parse_instruction(const char *str, inst_t *inst, core_t *cr) {
+/*======================================*/
+/*      mnemonic table                  */
+/*======================================*/
+
+// the mnemonics without AT&T size suffix
+static const struct {
+    const char *name;
+    op_t op;
+} mnemonic_list[] = {
+    {"mov", INST_MOV},
+    {"push", INST_PUSH},
+    {"pop", INST_POP},
+    {"leave", INST_LEAVE},
+    {"call", INST_CALL},
+    {"ret", INST_RET},
+    {"add", INST_ADD},
+    {"sub", INST_SUB},
+    {"cmp", INST_CMP},
+    {"jne", INST_JNE},
+    {"jnz", INST_JNE},
+    {"jmp", INST_JMP},
+};
+
+// open addressing hash table keyed by the mnemonic packed into uint64_t
+// built from mnemonic_list on the first lookup
+#define NUM_MNEMONIC_SLOT 64
+
+typedef struct MNEMONIC_SLOT_STRUCT {
+    uint64_t key; // 0: empty slot
+    op_t op;
+} mnemonic_slot_t;
+
+static mnemonic_slot_t mnemonic_table[NUM_MNEMONIC_SLOT];
+// the cores on different host threads may parse the first instruction together
+static pthread_once_t mnemonic_table_once = PTHREAD_ONCE_INIT;
+
+// pack the first (at most 8) chars of the mnemonic in little-endian order
+// return 0 if the mnemonic is empty or longer than 8 chars
+static inline uint64_t pack_mnemonic(const char *str, int len) {
+    if (len <= 0 || len > 8) {
+        return 0;
+    }
+    uint64_t key = 0;
+    for (int i = 0; i < len; ++i) {
+        key |= ((uint64_t)(uint8_t)str[i]) << (i * 8);
+    }
+    return key;
+}
+
+static inline uint64_t mnemonic_slot(uint64_t key) {
+    // fibonacci hashing: the high 6 bits of the product
+    return (key * 0x9e3779b97f4a7c15) >> 58;
+}
+
+static void build_mnemonic_table() {
+    for (size_t i = 0; i < sizeof(mnemonic_list) / sizeof(mnemonic_list[0]); ++i) {
+        uint64_t key = pack_mnemonic(mnemonic_list[i].name, strlen(mnemonic_list[i].name));
+        uint64_t slot = mnemonic_slot(key);
+        while (mnemonic_table[slot].key != 0) {
+            slot = (slot + 1) % NUM_MNEMONIC_SLOT;
+        }
+        mnemonic_table[slot].key = key;
+        mnemonic_table[slot].op = mnemonic_list[i].op;
+    }
+}
+
+static inline op_t find_mnemonic(uint64_t key) {
+    if (key == 0) {
+        return INST_UNKNOWN;
+    }
+    uint64_t slot = mnemonic_slot(key);
+    while (mnemonic_table[slot].key != 0) {
+        if (mnemonic_table[slot].key == key) {
+            return mnemonic_table[slot].op;
+        }
+        slot = (slot + 1) % NUM_MNEMONIC_SLOT;
+    }
+    return INST_UNKNOWN;
+}
+
+// map the mnemonic to its operator
+// accept the AT&T size suffix b, w, l, q, e.g. movq, addq, callq, leaveq
+// the suffix is returned in *suffix, 0 without suffix
+// return INST_UNKNOWN if the mnemonic is not in the instruction set
+static op_t lookup_mnemonic(const char *str, char *suffix) {
+    pthread_once(&mnemonic_table_once, &build_mnemonic_table);
+
+    int len = strlen(str);
+    *suffix = 0;
+    op_t op = find_mnemonic(pack_mnemonic(str, len));
+    if (op == INST_UNKNOWN && len > 1) {
+        char c = str[len - 1];
+        if (c == 'b' || c == 'w' || c == 'l' || c == 'q') {
+            op = find_mnemonic(pack_mnemonic(str, len - 1));
+            *suffix = c;
+        }
+    }
+    return op;
+}
+
+static inline int suffix_width(char suffix, uint8_t width) {
+    switch (suffix) {
+    case 'b': return width == REG_8_LOW || width == REG_8_HIGH;
+    case 'w': return width == REG_16;
+    case 'l': return width == REG_32;
+    default: return width == REG_64;
+    }
+}
+
+// the handlers move 64 bits, except mov, add, sub and cmp which take the width of the register operands
+// so the suffix must agree with the register operands, and only q is honored without them,
+// e.g. movl $1,(%rax) would write 8 bytes
+static int honor_suffix(inst_t *inst, char suffix) {
+    if (suffix == 0) {
+        return 1;
+    }
+    int sized = inst->op == INST_MOV || inst->op == INST_ADD || inst->op == INST_SUB || inst->op == INST_CMP;
+    if (suffix != 'q' && sized == 0) {
+        return 0;
+    }
+    int num_reg = 0;
+    od_t *od[2] = {&(inst->src), &(inst->dst)};
+    for (int i = 0; i < 2; ++i) {
+        if (od[i]->type == REG) {
+            if (suffix_width(suffix, od[i]->reg1.width) == 0) {
+                return 0;
+            }
+            num_reg += 1;
+        }
+    }
+    return num_reg > 0 || suffix == 'q';
+}
+
+// add, sub and cmp compute the condition flags on 64 bits,
+// so their register operands must be 64-bit, as decode_machine_code requires
+static int has_64bit_flags(inst_t *inst) {
+    if (inst->op != INST_ADD && inst->op != INST_SUB && inst->op != INST_CMP) {
+        return 1;
+    }
+    od_t *od[2] = {&(inst->src), &(inst->dst)};
+    for (int i = 0; i < 2; ++i) {
+        if (od[i]->type == REG && od[i]->reg1.width != REG_64) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void parse_instruction(const char *str, inst_t *inst) {
     char op_str[64] = {0};
     int op_len = 0;
     char src_str[64] = {0};
@@ -230,44 +252,25 @@ static void parse_instruction(const char *str, inst_t *inst, core_t *cr) {
             ++dst_len;
         }
     }
-    parse_operand(src_str, &(inst->src), cr);
-    parse_operand(dst_str, &(inst->dst), cr);
-    if (strcmp(op_str, "mov") == 0 || strcmp(op_str, "movq") == 0) {
-        inst->op = INST_MOV;
-    } else if (strcmp(op_str, "push") == 0) {
-        inst->op = INST_PUSH;
-    } else if (strcmp(op_str, "pop") == 0) {
-        inst->op = INST_POP;
-    } else if (strcmp(op_str, "leaveq") == 0) {
-        inst->op = INST_LEAVE;
-    } else if (strcmp(op_str, "callq") == 0) {
-        inst->op = INST_CALL;
-    } else if (strcmp(op_str, "retq") == 0) {
-        inst->op = INST_RET;
-    } else if (strcmp(op_str, "add") == 0) {
-        inst->op = INST_ADD;
-    } else if (strcmp(op_str, "sub") == 0) {
-        inst->op = INST_SUB;
-    } else if (strcmp(op_str, "cmpq") == 0) {
-        inst->op = INST_CMP;
-    } else if (strcmp(op_str, "jne") == 0) {
-        inst->op = INST_JNE;
-    } else if (strcmp(op_str, "jmp") == 0) {
-        inst->op = INST_JMP;
+    parse_operand(src_str, &(inst->src));
+    parse_operand(dst_str, &(inst->dst));
+    char suffix = 0;
+    inst->op = lookup_mnemonic(op_str, &suffix);
+    if (honor_suffix(inst, suffix) == 0 || has_64bit_flags(inst) == 0) {
+        inst->op = INST_UNKNOWN;
     }
 
     debug_printf(DEBUG_PARSEINST, "[%s (%d)] [%s (%d)] [%s (%d)]\n", op_str, inst->op, src_str, inst->src.type, dst_str, inst->dst.type);
 }
 
-static void parse_operand(const char *str, od_t *od, core_t *cr) {
+static void parse_operand(const char *str, od_t *od) {
     // str: assembly code string, e.g. mov $rsp, $rbp
     // od: pointer to the address to store the parsed operand
-    // cr: the active core processor
     od->type = EMPTY;
     od->imm = 0;
     od->scal = 0;
-    od->reg1 = 0;
-    od->reg2 = 0;
+    od->reg1 = (reg_od_t){0, REG_64};
+    od->reg2 = (reg_od_t){0, REG_64};
 
     int str_len = strlen(str);
     if (str_len == 0) {
@@ -282,17 +285,17 @@ static void parse_operand(const char *str, od_t *od, core_t *cr) {
     } else if (str[0] == '%') {
         // register
         od->type = REG;
-        od->reg1 = reflect_register(str, cr);
+        od->reg1 = reflect_register(str);
         return;
     } else {
         // memory
-        char imm[64];
+        char imm[64] = {0};
         int imm_len = 0;
-        char reg1[64];
+        char reg1[64] = {0};
         int reg1_len = 0;
-        char reg2[64];
+        char reg2[64] = {0};
         int reg2_len = 0;
-        char scal[64];
+        char scal[64] = {0};
         int scal_len = 0;
         int ca = 0; // 表示括号
         int cb = 0; // comma ,
@@ -343,10 +346,10 @@ static void parse_operand(const char *str, od_t *od, core_t *cr) {
         }
 
         if (reg1_len > 0) {
-            od->reg1 = reflect_register(reg1, cr);
+            od->reg1 = reflect_register(reg1);
         }
         if (reg2_len > 0) {
-            od->reg2 = reflect_register(reg2, cr);
+            od->reg2 = reflect_register(reg2);
         }
         if (cb == 0) {
             if (imm_len > 0) {
@@ -391,11 +394,9 @@ static void parse_operand(const char *str, od_t *od, core_t *cr) {
 /*======================================*/
 
 // insturction (sub)set
-// In this simulator, the instructions have been decoded and fetched
-// so there will be no page fault during fetching
-// otherwise the instructions must handle the page fault (swap in from disk) first
-// and then re-fetch the instruction and do decoding
-// and finally re-run the instruction
+// In this simulator, the page faults are handled inside va2pa
+// the missing page is mapped or swapped in from disk before va2pa returns
+// so the instructions never re-fetch, re-decode and re-run
 
 static void mov_handler(od_t *src_od, od_t *dst_od, core_t *cr);
 static void push_handler(od_t *src_od, od_t *dst_od, core_t *cr);
@@ -408,84 +409,93 @@ static void sub_handler(od_t *src_od, od_t *dst_od, core_t *cr);
 static void cmp_handler(od_t *src_od, od_t *dst_od, core_t *cr);
 static void jne_handler(od_t *src_od, od_t *dst_od, core_t *cr);
 static void jmp_handler(od_t *src_od, od_t *dst_od, core_t *cr);
+static void unknown_handler(od_t *src_od, od_t *dst_od, core_t *cr);
 
-// handler table storing the handlers to different instruction types
-typedef void (*handler_t)(od_t *, od_t *, core_t *);
 // look-up table of pointers to function
-static handler_t handler_table[NUM_INSTRTYPE] = {
-    &mov_handler,   // 0
-    &push_handler,  // 1
-    &pop_handler,   // 2
-    &leave_handler, // 3
-    &call_handler,  // 4
-    &ret_handler,   // 5
-    &add_handler,   // 6
-    &sub_handler,   // 7
-    &cmp_handler,   // 8
-    &jne_handler,   // 9
-    &jmp_handler,   // 10
+handler_t handler_table[NUM_INSTRTYPE] = {
+    &mov_handler,     // 0
+    &push_handler,    // 1
+    &pop_handler,     // 2
+    &leave_handler,   // 3
+    &call_handler,    // 4
+    &ret_handler,     // 5
+    &add_handler,     // 6
+    &sub_handler,     // 7
+    &cmp_handler,     // 8
+    &jne_handler,     // 9
+    &jmp_handler,     // 10
+    &unknown_handler, // 11
 };
 
-// reset the condition flags
-// inline to reduce cost
-static inline void reset_cflags(core_t *cr) {
-    cr->flags._flag_values = 0;
+// memory access with the width of the register operand
+static uint64_t read_memory(uint64_t vaddr, reg_od_t r, core_t *cr) {
+    uint64_t paddr = va2pa(vaddr, cr);
+    switch (r.width) {
+    case REG_32: return read32bits_dram(paddr, cr);
+    case REG_16: return read16bits_dram(paddr, cr);
+    case REG_8_HIGH:
+    case REG_8_LOW: return read8bits_dram(paddr, cr);
+    default: return read64bits_dram(paddr, cr);
+    }
 }
 
-// update the rip pointer to the next instruction sequentially
-static inline void next_rip(core_t *cr) {
-    // we are handling the fixed-length of assembly string here
-    // but their size can be variable as true X86 instructions
-    // that's because the operands' sizes follow the specific encoding rule
-    // the risc-v is a fixed length ISA
-    cr->rip = cr->rip + sizeof(char) * MAX_INSTRUCTION_CHAR;
+static void write_memory(uint64_t vaddr, uint64_t data, reg_od_t r, core_t *cr) {
+    uint64_t paddr = va2pa(vaddr, cr);
+    switch (r.width) {
+    case REG_32: write32bits_dram(paddr, (uint32_t)data, cr); return;
+    case REG_16: write16bits_dram(paddr, (uint16_t)data, cr); return;
+    case REG_8_HIGH:
+    case REG_8_LOW: write8bits_dram(paddr, (uint8_t)data, cr); return;
+    default: write64bits_dram(paddr, data, cr); return;
+    }
 }
 
 // instruction handlers
+// as on x86, rip has been moved to the next instruction when the handler runs
 
 static void mov_handler(od_t *src_od, od_t *dst_od, core_t *cr) {
-    uint64_t src = decode_operand(src_od);
-    uint64_t dst = decode_operand(dst_od);
+    uint64_t src = decode_operand(src_od, cr);
+    uint64_t dst = decode_operand(dst_od, cr);
 
     if (src_od->type == REG && dst_od->type == REG) {
         // src: register
         // dst: register
-        *(uint64_t *)dst = *(uint64_t *)src;
-        next_rip(cr);
+        write_register(dst_od->reg1, src, cr);
         reset_cflags(cr);
         return;
     } else if (src_od->type == REG && dst_od->type >= MEM_IMM) {
         // src: register
-        // dst: virtual address
-        write64bits_dram(
-            va2pa(dst, cr),
-            *(uint64_t *)src,
-            cr);
-        next_rip(cr);
+        // dst: virtual address, written with the width of the register
+        write_memory(dst, src, src_od->reg1, cr);
         reset_cflags(cr);
         return;
     } else if (src_od->type >= MEM_IMM && dst_od->type == REG) {
-        // src: virtual address
+        // src: virtual address, read with the width of the register
         // dst: register
-        *(uint64_t *)dst = read64bits_dram(
-            va2pa(src, cr),
-            cr);
-        next_rip(cr);
+        write_register(dst_od->reg1, read_memory(src, dst_od->reg1, cr), cr);
         reset_cflags(cr);
         return;
     } else if (src_od->type == IMM && dst_od->type == REG) {
         // src: immediate number (uint64_t bit map)
         // dst: register
-        *(uint64_t *)dst = src;
-        next_rip(cr);
+        write_register(dst_od->reg1, src, cr);
+        reset_cflags(cr);
+        return;
+    } else if (src_od->type == IMM && dst_od->type >= MEM_IMM) {
+        // src: immediate number (uint64_t bit map)
+        // dst: virtual address
+        write64bits_dram(
+            va2pa(dst, cr),
+            src,
+            cr);
         reset_cflags(cr);
         return;
     }
 }
 
 static void push_handler(od_t *src_od, od_t *dst_od, core_t *cr) {
-    uint64_t src = decode_operand(src_od);
-    // uint64_t dst = decode_operand(dst_od);
+    uint64_t src = decode_operand(src_od, cr);
+    // uint64_t dst = decode_operand(dst_od, cr);
 
     if (src_od->type == REG) {
         // src: register
@@ -493,17 +503,16 @@ static void push_handler(od_t *src_od, od_t *dst_od, core_t *cr) {
         (cr->reg).rsp = (cr->reg).rsp - 8;
         write64bits_dram(
             va2pa((cr->reg).rsp, cr),
-            *(uint64_t *)src,
+            src,
             cr);
-        next_rip(cr);
         reset_cflags(cr);
         return;
     }
 }
 
 static void pop_handler(od_t *src_od, od_t *dst_od, core_t *cr) {
-    uint64_t src = decode_operand(src_od);
-    // uint64_t dst = decode_operand(dst_od);
+    // uint64_t src = decode_operand(src_od, cr);
+    // uint64_t dst = decode_operand(dst_od, cr);
 
     if (src_od->type == REG) {
         // src: register
@@ -512,8 +521,7 @@ static void pop_handler(od_t *src_od, od_t *dst_od, core_t *cr) {
             va2pa((cr->reg).rsp, cr),
             cr);
         (cr->reg).rsp = (cr->reg).rsp + 8;
-        *(uint64_t *)src = old_val;
-        next_rip(cr);
+        write_register(src_od->reg1, old_val, cr);
         reset_cflags(cr);
         return;
     }
@@ -529,13 +537,12 @@ static void leave_handler(od_t *src_od, od_t *dst_od, core_t *cr) {
         cr);
     (cr->reg).rsp = (cr->reg).rsp + 8;
     (cr->reg).rbp = old_val;
-    next_rip(cr);
-    cr->flags._flag_values = 0;
+    reset_cflags(cr);
 }
 
 static void call_handler(od_t *src_od, od_t *dst_od, core_t *cr) {
-    uint64_t src = decode_operand(src_od);
-    // uint64_t dst = decode_operand(dst_od);
+    uint64_t src = decode_operand(src_od, cr);
+    // uint64_t dst = decode_operand(dst_od, cr);
 
     // src: immediate number: virtual address of target function starting
     // dst: empty
@@ -543,7 +550,7 @@ static void call_handler(od_t *src_od, od_t *dst_od, core_t *cr) {
     (cr->reg).rsp = (cr->reg).rsp - 8;
     write64bits_dram(
         va2pa((cr->reg).rsp, cr),
-        cr->rip + sizeof(char) * MAX_INSTRUCTION_CHAR,
+        cr->rip,
         cr);
     // jump to target function address
     cr->rip = src;
@@ -551,8 +558,8 @@ static void call_handler(od_t *src_od, od_t *dst_od, core_t *cr) {
 }
 
 static void ret_handler(od_t *src_od, od_t *dst_od, core_t *cr) {
-    // uint64_t src = decode_operand(src_od);
-    // uint64_t dst = decode_operand(dst_od);
+    // uint64_t src = decode_operand(src_od, cr);
+    // uint64_t dst = decode_operand(dst_od, cr);
 
     // src: empty
     // dst: empty
@@ -567,112 +574,273 @@ static void ret_handler(od_t *src_od, od_t *dst_od, core_t *cr) {
 }
 
 static void add_handler(od_t *src_od, od_t *dst_od, core_t *cr) {
-    uint64_t src = decode_operand(src_od);
-    uint64_t dst = decode_operand(dst_od);
+    uint64_t src = decode_operand(src_od, cr);
+    uint64_t dst = decode_operand(dst_od, cr);
 
     if (src_od->type == REG && dst_od->type == REG) {
         // src: register (value: int64_t bit map)
         // dst: register (value: int64_t bit map)
-        uint64_t val = *(uint64_t *)dst + *(uint64_t *)src;
-        int val_sign = ((val >> 63) & 0x01);
-        int src_sign = ((val >> 63) & 0x01);
-        int dst_sign = ((val >> 63) & 0x01);
+        uint64_t val = dst + src;
         // set condition flags
-        cr->flags.CF = (val < *(uint64_t *)src); // unsigned
-        cr->flags.ZF = (val == 0);
-        cr->flags.SF = ((val >> 63) & 0x1);
-        cr->flags.OF = ((src_sign == 0 && dst_sign == 0 && val_sign == 1) || (src_sign == 1 && dst_sign == 1 && val_sign == 0));
+        add_cflags(src, dst, val, cr);
 
         // update registers
-        *(uint64_t *)dst = val;
+        write_register(dst_od->reg1, val, cr);
         // signed and unsigned value follow the same addition. e.g.
         // 5 = 0000000000000101, 3 = 0000000000000011, -3 = 1111111111111101, 5 + (-3) = 0000000000000010
-        next_rip(cr);
         return;
     }
 }
 
 static void sub_handler(od_t *src_od, od_t *dst_od, core_t *cr) {
-    uint64_t src = decode_operand(src_od);
-    uint64_t dst = decode_operand(dst_od);
+    uint64_t src = decode_operand(src_od, cr);
+    uint64_t dst = decode_operand(dst_od, cr);
 
     if (src_od->type == IMM && dst_od->type == REG) {
-        uint64_t val = *(uint64_t *)dst + (~src + 1);
-        int val_sign = ((val >> 63) & 0x1);
-        int src_sign = ((src >> 63) & 0x1);
-        int dst_sign = ((dst >> 63) & 0x1);
-        cr->flags.CF = (val > *(uint64_t *)dst); //
-        cr->flags.ZF = (val == 0);
-        cr->flags.SF = val_sign;
-        cr->flags.OF = ((src_sign == 1 && dst_sign == 0 && val_sign == 1) || (src_sign == 0 && dst_sign == 1 && val_sign == 0)); // 实际上这里是用高位 1 表示是否是负数，即实际表示范围是 int64_t;
-        *(uint64_t *)dst = val;
-        next_rip(cr);
+        uint64_t val = dst + (~src + 1);
+        sub_cflags(src, dst, val, cr);
+        write_register(dst_od->reg1, val, cr);
         return;
     }
 }
 
 static void cmp_handler(od_t *src_od, od_t *dst_od, core_t *cr) {
-    uint64_t src = decode_operand(src_od);
-    uint64_t dst = decode_operand(dst_od);
+    uint64_t src = decode_operand(src_od, cr);
+    uint64_t dst = decode_operand(dst_od, cr);
 
     if (src_od->type == IMM && dst_od->type >= MEM_IMM) {
         uint64_t dst_val = read64bits_dram(va2pa(dst, cr), cr);
         uint64_t val = dst_val + (~src + 1);
 
-        int val_sign = ((val >> 63) & 0x1);
-        int src_sign = ((src >> 63) & 0x1);
-        int dst_sign = ((dst_val >> 63) & 0x1);
-
         // condition flags
-        cr->flags.CF = (val > dst_val);
-        cr->flags.ZF = (val == 0);
-        cr->flags.SF = val_sign;
-        cr->flags.OF = ((src_sign == 1 && dst_sign == 0 && val_sign == 1) || (src_sign == 0 && dst_sign == 1 && val_sign == 0));
+        sub_cflags(src, dst_val, val, cr);
+        return;
     }
 }
 
 static void jne_handler(od_t *src_od, od_t *dst_od, core_t *cr) {
-    uint64_t src = decode_operand(src_od);
-    uint64_t dst = decode_operand(dst_od);
+    uint64_t src = decode_operand(src_od, cr);
+    uint64_t dst = decode_operand(dst_od, cr);
     // if (src_od->type == IMM) {
-    if (cr->flags.ZF != 1) { // 说明上一个指令的结果不是0，即 ZF 不为 1；
+    if (read_ZF(cr) != 1) { // 说明上一个指令的结果不是0，即 ZF 不为 1；
         // last instruction val != 0
         cr->rip = src;
-    } else {
-        // last instruction val == 0
-        next_rip(cr);
     }
-    cr->flags._flag_values = 0;
+    // else: last instruction val == 0, rip is already the next instruction
+    reset_cflags(cr);
     // }
 }
 
 static void jmp_handler(od_t *src_od, od_t *dst_od, core_t *cr) {
-    uint64_t src = decode_operand(src_od);
-    if (cr->flags.ZF == 0) {
-        cr->rip = src;
+    uint64_t src = decode_operand(src_od, cr);
+    // unconditional jump
+    cr->rip = src;
+    reset_cflags(cr);
+}
+
+static void unknown_handler(od_t *src_od, od_t *dst_od, core_t *cr) {
+    printf("unknown opcode at 0x%lx\n", cr->rip);
+    exit(0);
+}
+
+/*======================================*/
+/*      code pages                      */
+/*======================================*/
+
+// the generation of each physical page holding decoded code, hashed by the page number
+// shared by all the host threads: a write to a code page bumps its generation,
+// so the decoded instructions and the blocks of the page are stale on every core
+#define NUM_CODE_PAGE 4096
+
+// one cache line per slot: the cores writing different pages do not share it
+typedef struct CODE_PAGE_STRUCT {
+    uint64_t mark; // 1: the page may hold decoded code, set before the code is read and never cleared
+    uint64_t gen;
+    uint64_t pad[6];
+} code_page_t;
+
+static code_page_t code_page[NUM_CODE_PAGE];
+
+uint64_t code_generation(uint64_t paddr, uint64_t len) {
+    uint64_t first = paddr >> PHYSICAL_PAGE_OFFSET_LENGTH;
+    uint64_t last = (paddr + len - 1) >> PHYSICAL_PAGE_OFFSET_LENGTH;
+    uint64_t gen = 0;
+    for (uint64_t ppn = first; ppn <= last; ++ppn) {
+        code_page_t *page = &code_page[ppn % NUM_CODE_PAGE];
+        if (__atomic_load_n(&(page->mark), __ATOMIC_ACQUIRE) == 0) {
+            // ordered with the read-modify-write of the mark in invalidate_inst_cache:
+            // a write racing with the decoder either bumps the generation or is read by it
+            __atomic_fetch_or(&(page->mark), 1, __ATOMIC_ACQ_REL);
+        }
+        gen += __atomic_load_n(&(page->gen), __ATOMIC_ACQUIRE);
+    }
+    return gen;
+}
+
+// make the decoded code overlapping [paddr, paddr + len) stale
+// called by the dram when the memory is written, by any core
+void invalidate_inst_cache(uint64_t paddr, uint64_t len) {
+    uint64_t first = paddr >> PHYSICAL_PAGE_OFFSET_LENGTH;
+    uint64_t last = (paddr + len - 1) >> PHYSICAL_PAGE_OFFSET_LENGTH;
+    for (uint64_t ppn = first; ppn <= last; ++ppn) {
+        code_page_t *page = &code_page[ppn % NUM_CODE_PAGE];
+        // with several cores, a read-modify-write releases the written bytes to a decoder marking the page
+        uint64_t mark = (NUM_CORES > 1) ? __atomic_fetch_or(&(page->mark), 0, __ATOMIC_ACQ_REL)
+                                        : __atomic_load_n(&(page->mark), __ATOMIC_ACQUIRE);
+        if (mark != 0) {
+            __atomic_add_fetch(&(page->gen), 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+void flush_inst_cache() {
+    for (int i = 0; i < NUM_CODE_PAGE; ++i) {
+        __atomic_add_fetch(&(code_page[i].gen), 1, __ATOMIC_RELEASE);
+    }
+}
+
+/*======================================*/
+/*      decoded instruction cache       */
+/*======================================*/
+
+// the decoded inst_t of recently executed instructions
+// direct-mapped, indexed by the physical address of the instruction
+// and tagged by both addresses: branch targets of machine code are decoded from rip
+// so a hot loop is fetched and decoded only once
+#define NUM_DECODED_INST 1024
+
+typedef struct DECODED_INST_STRUCT {
+    uint64_t valid;
+    uint64_t vaddr; // tag: rip of the instruction
+    uint64_t paddr; // tag: physical address of the instruction
+    uint64_t gen;   // tag: code_generation() of its bytes before they were read
+    inst_t inst;
+} decoded_inst_t;
+
+#define DECODED_INST_WORD (sizeof(decoded_inst_t) / sizeof(uint64_t))
+_Static_assert(sizeof(decoded_inst_t) % sizeof(uint64_t) == 0, "decoded_inst_t must be 64-bit words");
+
+typedef union DECODED_WORD_UNION {
+    decoded_inst_t entry;
+    uint64_t word[DECODED_INST_WORD];
+} decoded_word_t;
+
+// shared by all the host threads (cores of run_cores), as the physical memory
+// each entry is a seqlock: seq is odd while a thread fills it,
+// the readers copy the entry out word by word and check seq did not change
+// the words are stored with release and loaded with acquire, in place of the fences of a seqlock:
+// a reader seeing a new word sees the odd seq after it
+typedef struct DECODED_SLOT_STRUCT {
+    uint64_t seq;
+    decoded_word_t d;
+} decoded_slot_t;
+
+static decoded_slot_t decoded_inst_cache[NUM_DECODED_INST];
+
+static inline uint64_t decoded_inst_index(uint64_t paddr) {
+    // fibonacci hashing: both the 64-byte text and the packed machine code spread out
+    return (paddr * 0x9e3779b97f4a7c15) >> 54;
+}
+
+// return 0 if another thread is filling the slot
+static inline int read_decoded(decoded_slot_t *slot, decoded_word_t *d) {
+    uint64_t seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+    if ((seq & 1) != 0) {
+        return 0;
+    }
+    // the acquire loads keep the second load of seq after the words
+    // and synchronize with the stores of a writer, so its odd seq is seen
+    for (uint64_t i = 0; i < DECODED_INST_WORD; ++i) {
+        d->word[i] = __atomic_load_n(&(slot->d.word[i]), __ATOMIC_ACQUIRE);
+    }
+    return __atomic_load_n(&(slot->seq), __ATOMIC_RELAXED) == seq;
+}
+
+static inline void write_decoded(decoded_slot_t *slot, decoded_word_t *d) {
+    uint64_t seq = __atomic_load_n(&(slot->seq), __ATOMIC_RELAXED);
+    if ((seq & 1) != 0
+        || __atomic_compare_exchange_n(&(slot->seq), &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) == 0) {
+        // another thread is filling the slot: keep the instruction to this one
+        return;
     }
-    cr->flags._flag_values = 0;
+    // the release stores are not visible before the odd seq
+    for (uint64_t i = 0; i < DECODED_INST_WORD; ++i) {
+        __atomic_store_n(&(slot->d.word[i]), d->word[i], __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&(slot->seq), seq + 2, __ATOMIC_RELEASE);
+}
+
+// fetch and decode the instruction at virtual address vaddr (physical address paddr)
+// in the encoding of the core
+void decode_instruction(uint64_t vaddr, uint64_t paddr, inst_t *inst, core_t *cr) {
+    if (cr->encoding == INST_ENCODING_BINARY) {
+        // the machine code may cross the page: fetch the rest from the next page
+        // only if the decoder reads beyond this one, the next page may not be mapped
+        uint8_t code[MAX_INSTRUCTION_BYTE] = {0};
+        uint64_t n = PAGE_SIZE - (paddr & (PAGE_SIZE - 1));
+        if (n >= MAX_INSTRUCTION_BYTE) {
+            readbytes_dram(paddr, code, MAX_INSTRUCTION_BYTE, cr);
+        } else {
+            readbytes_dram(paddr, code, n, cr);
+            if (decode_machine_code(code, vaddr, inst) <= n) {
+                return;
+            }
+            readbytes_dram(va2pa(vaddr + n, cr), &code[n], MAX_INSTRUCTION_BYTE - n, cr);
+        }
+        decode_machine_code(code, vaddr, inst);
+        return;
+    }
+
+    char inst_str[MAX_INSTRUCTION_CHAR + 10];
+    readinst_dram(paddr, inst_str, cr);
+    parse_instruction(inst_str, inst);
+    inst->len = (inst->op == INST_UNKNOWN) ? 0 : sizeof(char) * MAX_INSTRUCTION_CHAR;
 }
 
 // instruction cycle is implemented in CPU
 // the only exposed interface outside CPU
 void instruction_cycle(core_t *cr) {
     // FETCH: get the instruction string by program counter
-    const char *inst_str = (const char *)cr->rip;
-    debug_printf(DEBUG_INSTRUCTIONCYCLE, "%lx    %s\n", cr->rip, inst_str);
+    uint64_t paddr = va2pa(cr->rip, cr);
+    if (debug_enabled(DEBUG_INSTRUCTIONCYCLE) && cr->encoding == INST_ENCODING_TEXT) {
+        char inst_str[MAX_INSTRUCTION_CHAR + 10];
+        readinst_dram(paddr, inst_str, cr);
+        debug_printf(DEBUG_INSTRUCTIONCYCLE, "%lx    %s\n", cr->rip, inst_str);
+    }
 
     // DECODE: decode the run-time instruction operands
-    inst_t inst;
-    parse_instruction(inst_str, &inst, cr);
+    // only when the instruction is not in the decoded instruction cache
+    // or its bytes have been written since, by any core
+    uint64_t gen = code_generation(paddr, (cr->encoding == INST_ENCODING_BINARY) ? MAX_INSTRUCTION_BYTE : MAX_INSTRUCTION_CHAR);
+    decoded_slot_t *slot = &decoded_inst_cache[decoded_inst_index(paddr)];
+    decoded_word_t d;
+    decoded_inst_t *entry = &(d.entry);
+    if (read_decoded(slot, &d) == 0 || entry->valid == 0 || entry->paddr != paddr || entry->vaddr != cr->rip || entry->gen != gen) {
+        decode_instruction(cr->rip, paddr, &(entry->inst), cr);
+        entry->valid = 1;
+        entry->vaddr = cr->rip;
+        entry->paddr = paddr;
+        entry->gen = gen;
+        write_decoded(slot, &d);
+    }
+    inst_t *inst = &(entry->inst);
+    if (DEBUG_ENABLE_SRAM_CACHE == 1) {
+        // the fetch goes through L1i even if the instruction is decoded
+        uint64_t latency = cache_fetch(cr, paddr, inst->len > 0 ? inst->len : 1, 1);
+        if (timing_enabled != 0) {
+            time_fetch(cr, latency - cache_latency[CACHE_L1I]);
+        }
+    }
+    if (cr->encoding == INST_ENCODING_BINARY) {
+        debug_printf(DEBUG_INSTRUCTIONCYCLE, "%lx    op %d (%lu bytes)\n", cr->rip, inst->op, inst->len);
+    }
 
-    // EXECUTE: get the function pointer or handler by the operator
-    handler_t handler = handler_table[inst.op];
-    // update CPU and memory according the instruction
-    handler(&(inst.src), &(inst.dst), cr);
+    // EXECUTE: update CPU and memory by the handler of the operator
+    execute_instruction(inst, cr);
 }
 
 void print_register(core_t *cr) {
-    if ((DEBUG_VERBOSE_SET & DEBUG_REGISTERS) == 0x0) {
+    if (!debug_enabled(DEBUG_REGISTERS)) {
         return;
     }
 
@@ -683,23 +851,24 @@ void print_register(core_t *cr) {
     printf("rsi = %16lx\trdi = %16lx\trbp = %16lx\trsp = %16lx\n",
            reg.rsi, reg.rdi, reg.rbp, reg.rsp);
     printf("rip = %16lx\n", cr->rip);
+    evaluate_cflags(cr);
     printf("CF = %u\tZF = %u\tSF = %u\tOF = %u\n",
            cr->flags.CF, cr->flags.ZF, cr->flags.SF, cr->flags.OF);
 }
 
 void print_stack(core_t *cr) {
-    if ((DEBUG_VERBOSE_SET & DEBUG_PRINTSTACK) == 0x0) {
+    if (!debug_enabled(DEBUG_PRINTSTACK)) {
         return;
     }
 
     int n = 10;
-    uint64_t *high = (uint64_t *)&pm[va2pa((cr->reg).rsp, cr)];
-    high = &high[n];
     uint64_t va = (cr->reg).rsp + n * 8;
 
     for (int i = 0; i < 2 * n; ++i) {
-        uint64_t *ptr = (uint64_t *)(high - i);
-        printf("0x%16lx : %16lx", va, (uint64_t)*ptr);
+        // the words may be on different frames
+        uint64_t val = 0;
+        readbytes_dram(va2pa(va, cr), (uint8_t *)&val, sizeof(val), cr);
+        printf("0x%16lx : %16lx", va, val);
 
         if (i == n) {
             printf(" <== rsp");
@@ -709,87 +878,93 @@ void print_stack(core_t *cr) {
     }
 }
 
-static uint64_t reflect_register(const char *str, core_t *cr) {
-    reg_t *reg = &(cr->reg);
-    uint64_t reg_addr[72] = {
-        (uint64_t) & (reg->rax),
-        (uint64_t) & (reg->eax),
-        (uint64_t) & (reg->ax),
-        (uint64_t) & (reg->ah),
-        (uint64_t) & (reg->al),
-        (uint64_t) & (reg->rbx),
-        (uint64_t) & (reg->ebx),
-        (uint64_t) & (reg->bx),
-        (uint64_t) & (reg->bh),
-        (uint64_t) & (reg->bl),
-        (uint64_t) & (reg->rcx),
-        (uint64_t) & (reg->ecx),
-        (uint64_t) & (reg->cx),
-        (uint64_t) & (reg->ch),
-        (uint64_t) & (reg->cl),
-        (uint64_t) & (reg->rdx),
-        (uint64_t) & (reg->edx),
-        (uint64_t) & (reg->dx),
-        (uint64_t) & (reg->dh),
-        (uint64_t) & (reg->dl),
-        (uint64_t) & (reg->rsi),
-        (uint64_t) & (reg->esi),
-        (uint64_t) & (reg->si),
-        (uint64_t) & (reg->sih),
-        (uint64_t) & (reg->sil),
-        (uint64_t) & (reg->rdi),
-        (uint64_t) & (reg->edi),
-        (uint64_t) & (reg->di),
-        (uint64_t) & (reg->dih),
-        (uint64_t) & (reg->dil),
-        (uint64_t) & (reg->rbp),
-        (uint64_t) & (reg->ebp),
-        (uint64_t) & (reg->bp),
-        (uint64_t) & (reg->bph),
-        (uint64_t) & (reg->bpl),
-        (uint64_t) & (reg->rsp),
-        (uint64_t) & (reg->esp),
-        (uint64_t) & (reg->sp),
-        (uint64_t) & (reg->sph),
-        (uint64_t) & (reg->spl),
-        (uint64_t) & (reg->r8),
-        (uint64_t) & (reg->r8d),
-        (uint64_t) & (reg->r8w),
-        (uint64_t) & (reg->r8b),
-        (uint64_t) & (reg->r9),
-        (uint64_t) & (reg->r9d),
-        (uint64_t) & (reg->r9w),
-        (uint64_t) & (reg->r9b),
-        (uint64_t) & (reg->r10),
-        (uint64_t) & (reg->r10d),
-        (uint64_t) & (reg->r10w),
-        (uint64_t) & (reg->r10b),
-        (uint64_t) & (reg->r11),
-        (uint64_t) & (reg->r11d),
-        (uint64_t) & (reg->r11w),
-        (uint64_t) & (reg->r11b),
-        (uint64_t) & (reg->r12),
-        (uint64_t) & (reg->r12d),
-        (uint64_t) & (reg->r12w),
-        (uint64_t) & (reg->r12b),
-        (uint64_t) & (reg->r13),
-        (uint64_t) & (reg->r13d),
-        (uint64_t) & (reg->r13w),
-        (uint64_t) & (reg->r13b),
-        (uint64_t) & (reg->r14),
-        (uint64_t) & (reg->r14d),
-        (uint64_t) & (reg->r14w),
-        (uint64_t) & (reg->r14b),
-        (uint64_t) & (reg->r15),
-        (uint64_t) & (reg->r15d),
-        (uint64_t) & (reg->r15w),
-        (uint64_t) & (reg->r15b),
-    };
-    for (int i = 0; i < 72; ++i) {
-        if (strcmp(str, reg_name_list[i]) == 0) {
-            return reg_addr[i];
+// index of rax ... rsp in reg_t by the two letters of the 16-bit name
+// -1 if the letters do not name a register
+static inline int legacy_register_index(char c0, char c1) {
+    switch (c0) {
+    case 'a': return c1 == 'x' ? 0 : -1;
+    case 'b': return c1 == 'x' ? 1 : (c1 == 'p' ? 6 : -1);
+    case 'c': return c1 == 'x' ? 2 : -1;
+    case 'd': return c1 == 'x' ? 3 : (c1 == 'i' ? 5 : -1);
+    case 's': return c1 == 'i' ? 4 : (c1 == 'p' ? 7 : -1);
+    default: return -1;
+    }
+}
+
+static reg_od_t reflect_register(const char *str) {
+    // str: register name with '%', e.g.
+    // %rax %eax %ax %ah %al            rax ... rdx
+    // %rsi %esi %si %sih %sil          rsi ... rsp
+    // %r8 %r8d %r8w %r8b               r8 ... r15
+    // switch on the characters instead of comparing against every name
+    if (str[0] != '%') {
+        goto fail;
+    }
+    const char *s = &str[1];
+    int index = -1;
+
+    if (s[0] == 'r' && '0' <= s[1] && s[1] <= '9') {
+        // r8 ... r15
+        index = s[1] - '0';
+        int i = 2;
+        if ('0' <= s[2] && s[2] <= '9') {
+            index = index * 10 + s[2] - '0';
+            i = 3;
+        }
+        if (index < 8 || index > 15) {
+            goto fail;
+        }
+        if (s[i] == '\0') {
+            return (reg_od_t){index, REG_64};
+        } else if (s[i + 1] == '\0') {
+            switch (s[i]) {
+            case 'd': return (reg_od_t){index, REG_32};
+            case 'w': return (reg_od_t){index, REG_16};
+            case 'b': return (reg_od_t){index, REG_8_LOW};
+            default: break;
+            }
+        }
+        goto fail;
+    }
+
+    if (s[0] == 'r' || s[0] == 'e') {
+        // rax, eax
+        if (s[1] == '\0' || s[2] == '\0') {
+            goto fail;
+        }
+        index = legacy_register_index(s[1], s[2]);
+        if (index >= 0 && s[3] == '\0') {
+            return (reg_od_t){index, s[0] == 'r' ? REG_64 : REG_32};
         }
+        goto fail;
     }
+
+    if (s[0] == '\0' || s[1] == '\0') {
+        goto fail;
+    }
+    if (s[2] == '\0') {
+        // ax, ah, al
+        index = legacy_register_index(s[0], s[1]);
+        if (index >= 0) {
+            return (reg_od_t){index, REG_16};
+        }
+        index = legacy_register_index(s[0], 'x');
+        if (index >= 0 && s[1] == 'h') {
+            return (reg_od_t){index, REG_8_HIGH};
+        } else if (index >= 0 && s[1] == 'l') {
+            return (reg_od_t){index, REG_8_LOW};
+        }
+    } else if (s[3] == '\0') {
+        // sih, sil
+        index = legacy_register_index(s[0], s[1]);
+        if (index >= 4 && s[2] == 'h') {
+            return (reg_od_t){index, REG_8_HIGH};
+        } else if (index >= 4 && s[2] == 'l') {
+            return (reg_od_t){index, REG_8_LOW};
+        }
+    }
+
+fail:
     printf("parse register %s error\n", str);
     exit(0);
-}
\ No newline at end of file
+}
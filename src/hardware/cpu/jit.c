@@ -0,0 +1,575 @@
+// Just-in-time compiler of hot basic blocks to x86-64 host code
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include "cpu.h"
+#include "memory.h"
+#include "common.h"
+#include "instruction.h"
+#include "trace.h"
+
+// the code buffer, its offset and generation are global, and the host code is kept in the blocks:
+// the JIT is built for one core, the cores of run_cores on several host threads run the threaded code
+#if defined(__x86_64__) && defined(__linux__) && NUM_CORES == 1
+#include <sys/mman.h>
+
+/*======================================*/
+/*      code buffer                     */
+/*======================================*/
+
+// the blocks executed JIT_THRESHOLD times are compiled to host code
+// the compiled code is a function uint64_t (core_t *cr) executing the block
+// and returning the number of instructions executed, less than the block after a store to its code:
+// the registers stay in cr->reg and the memory is accessed through va2pa
+// the buffer is never writable and executable at once:
+// it is read-write while a block is emitted and read-execute while the blocks run
+#define JIT_THRESHOLD 16
+#define JIT_BUFFER_SIZE (4 << 20)
+// upper bound of the host code of one instruction
+#define JIT_MAX_INST_CODE 160
+
+static uint8_t *jit_buffer = NULL;
+static uint64_t jit_offset = 0;
+// blocks compiled in an older generation of the buffer are stale
+// generation 0 means not compiled
+static uint64_t jit_generation = 1;
+// 1: mmap or mprotect of the buffer failed, do not try again
+static int jit_disabled = 0;
+
+static int init_jit_buffer() {
+    void *buf = mmap(NULL, JIT_BUFFER_SIZE,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        debug_printf(DEBUG_INSTRUCTIONCYCLE, "jit: cannot map the code buffer\n");
+        jit_disabled = 1;
+        return 0;
+    }
+    jit_buffer = (uint8_t *)buf;
+    jit_offset = 0;
+    return 1;
+}
+
+// PROT_READ | PROT_WRITE to emit, PROT_READ | PROT_EXEC to run
+static int protect_jit_buffer(int prot) {
+    if (mprotect(jit_buffer, JIT_BUFFER_SIZE, prot) != 0) {
+        debug_printf(DEBUG_INSTRUCTIONCYCLE, "jit: cannot change the protection of the code buffer\n");
+        jit_disabled = 1;
+        // the compiled blocks may not be executable any more
+        jit_generation += 1;
+        return 0;
+    }
+    return 1;
+}
+
+/*======================================*/
+/*      helpers called by host code     */
+/*======================================*/
+
+static uint64_t jit_read64(core_t *cr, uint64_t vaddr) {
+    return read64bits_dram(va2pa(vaddr, cr), cr);
+}
+
+// return 1 if the write made the block stale
+static uint64_t jit_write64(core_t *cr, uint64_t vaddr, uint64_t data, block_t *block) {
+    write64bits_dram(va2pa(vaddr, cr), data, cr);
+    return is_stale_block(block, cr);
+}
+
+static uint64_t jit_read_zf(core_t *cr) {
+    return read_ZF(cr);
+}
+
+/*======================================*/
+/*      x86-64 encoder                  */
+/*======================================*/
+
+// host registers used by the emitted code
+// rbx holds cr during the whole block (callee saved)
+// rax, rcx, rdx, rsi, rdi are scratch and the arguments of the helpers
+#define HOST_RAX 0
+#define HOST_RCX 1
+#define HOST_RDX 2
+#define HOST_RBX 3
+#define HOST_RSI 6
+#define HOST_RDI 7
+
+// byte offsets in core_t
+#define CORE_RIP ((uint32_t)offsetof(core_t, rip))
+#define CORE_LAZY(field) ((uint32_t)(offsetof(core_t, lazy_flags) + offsetof(lazy_flags_t, field)))
+#define CORE_REG(index) ((uint32_t)(offsetof(core_t, reg) + (index) * sizeof(uint64_t)))
+
+// index of the registers in reg_t
+#define REG_INDEX_RBP 6
+#define REG_INDEX_RSP 7
+
+typedef struct JIT_EMITTER_STRUCT {
+    uint8_t *code;
+    uint64_t len;
+} emitter_t;
+
+static inline void emit8(emitter_t *e, uint8_t b) {
+    e->code[e->len] = b;
+    e->len += 1;
+}
+
+static inline void emit32(emitter_t *e, uint32_t v) {
+    memcpy(&e->code[e->len], &v, 4);
+    e->len += 4;
+}
+
+static inline void emit64(emitter_t *e, uint64_t v) {
+    memcpy(&e->code[e->len], &v, 8);
+    e->len += 8;
+}
+
+// REX.W opcode modrm(mod = 10, reg, rm = rbx) disp32: op reg, [rbx + disp]
+static void emit_rbx_disp(emitter_t *e, uint8_t opcode, int reg, uint32_t disp) {
+    emit8(e, 0x48);
+    emit8(e, opcode);
+    emit8(e, 0x80 | (reg << 3) | HOST_RBX);
+    emit32(e, disp);
+}
+
+// mov reg, [rbx + disp]
+static void emit_load(emitter_t *e, int reg, uint32_t disp) {
+    emit_rbx_disp(e, 0x8b, reg, disp);
+}
+
+// mov [rbx + disp], reg
+static void emit_store(emitter_t *e, int reg, uint32_t disp) {
+    emit_rbx_disp(e, 0x89, reg, disp);
+}
+
+// add reg, [rbx + disp]
+static void emit_add_load(emitter_t *e, int reg, uint32_t disp) {
+    emit_rbx_disp(e, 0x03, reg, disp);
+}
+
+// mov reg, imm64
+static void emit_mov_imm(emitter_t *e, int reg, uint64_t imm) {
+    emit8(e, 0x48);
+    emit8(e, 0xb8 + reg);
+    emit64(e, imm);
+}
+
+// mov dst, src
+static void emit_mov_reg(emitter_t *e, int dst, int src) {
+    emit8(e, 0x48);
+    emit8(e, 0x89);
+    emit8(e, 0xc0 | (src << 3) | dst);
+}
+
+// add dst, src (opcode 0x01) or sub dst, src (opcode 0x29)
+static void emit_alu_reg(emitter_t *e, uint8_t opcode, int dst, int src) {
+    emit8(e, 0x48);
+    emit8(e, opcode);
+    emit8(e, 0xc0 | (src << 3) | dst);
+}
+
+// add qword [rbx + disp], imm8 (ext 0) or sub qword [rbx + disp], imm8 (ext 5)
+static void emit_alu_mem_imm8(emitter_t *e, int ext, uint32_t disp, int8_t imm) {
+    emit_rbx_disp(e, 0x83, ext, disp);
+    emit8(e, (uint8_t)imm);
+}
+
+// mov qword [rbx + disp], imm32
+static void emit_store_imm(emitter_t *e, uint32_t disp, uint32_t imm) {
+    emit_rbx_disp(e, 0xc7, 0, disp);
+    emit32(e, imm);
+}
+
+// call the C function at addr, the arguments are in rdi, rsi, rdx, rcx
+static void emit_call(emitter_t *e, void *addr) {
+    emit_mov_imm(e, HOST_RAX, (uint64_t)addr);
+    // call rax
+    emit8(e, 0xff);
+    emit8(e, 0xd0);
+}
+
+// rip = next before the instructions calling the helpers,
+// so a page fault or a write to the code sees rip as the interpreter sets it
+static void emit_sync_rip(emitter_t *e, uint64_t next) {
+    emit_mov_imm(e, HOST_RAX, next);
+    emit_store(e, HOST_RAX, CORE_RIP);
+}
+
+// write rdx at the virtual address rsi, rax = 1 if the block is stale after it
+static void emit_write(emitter_t *e, block_t *block) {
+    emit_mov_imm(e, HOST_RCX, (uint64_t)block);
+    emit_mov_reg(e, HOST_RDI, HOST_RBX);
+    emit_call(e, &jit_write64);
+}
+
+// return num_done if the store wrote the code of the block (rax != 0)
+// rip is already the next instruction
+static void emit_leave_if_stale(emitter_t *e, uint64_t num_done) {
+    // test rax, rax; jz +7
+    emit8(e, 0x48);
+    emit8(e, 0x85);
+    emit8(e, 0xc0);
+    emit8(e, 0x74);
+    emit8(e, 0x07);
+    // mov eax, num_done; pop rbx; ret
+    emit8(e, 0xb8);
+    emit32(e, (uint32_t)num_done);
+    emit8(e, 0x5b);
+    emit8(e, 0xc3);
+}
+
+static void emit_reset_cflags(emitter_t *e) {
+    emit_store_imm(e, CORE_LAZY(op), FLAGS_OP_RESET);
+}
+
+// record the flags of val (rdx) = dst (rsi) op src (rdi), as add_cflags and sub_cflags
+static void emit_lazy_cflags(emitter_t *e, flags_op_t op) {
+    emit_store(e, HOST_RDI, CORE_LAZY(src));
+    emit_store(e, HOST_RSI, CORE_LAZY(dst));
+    emit_store(e, HOST_RDX, CORE_LAZY(val));
+    emit_store_imm(e, CORE_LAZY(op), op);
+}
+
+// rsi = virtual address of the memory operand
+// return 0 if the operand is not supported
+static int emit_address(emitter_t *e, od_t *od) {
+    emit_mov_imm(e, HOST_RSI, od->imm);
+    if (od->type == MEM_IMM) {
+        return 1;
+    }
+    if (od->type == MEM_REG1 || od->type == MEM_IMM_REG1 || od->type == MEM_REG1_REG2 || od->type == MEM_IMM_REG1_REG2
+        || od->type == MEM_REG1_REG2_SCAL || od->type == MEM_IMM_REG1_REG2_SCAL) {
+        if (od->reg1.width != REG_64) {
+            return 0;
+        }
+        emit_add_load(e, HOST_RSI, CORE_REG(od->reg1.index));
+    }
+    if (od->type == MEM_REG1_REG2 || od->type == MEM_IMM_REG1_REG2) {
+        if (od->reg2.width != REG_64) {
+            return 0;
+        }
+        emit_add_load(e, HOST_RSI, CORE_REG(od->reg2.index));
+    } else if (od->type == MEM_REG2_SCAL || od->type == MEM_IMM_REG2_SCAL
+               || od->type == MEM_REG1_REG2_SCAL || od->type == MEM_IMM_REG1_REG2_SCAL) {
+        if (od->reg2.width != REG_64) {
+            return 0;
+        }
+        // rax = reg2 << log2(scal); rsi += rax
+        emit_load(e, HOST_RAX, CORE_REG(od->reg2.index));
+        int shift = od->scal == 8 ? 3 : (od->scal == 4 ? 2 : (od->scal == 2 ? 1 : 0));
+        emit8(e, 0x48);
+        emit8(e, 0xc1);
+        emit8(e, 0xe0);
+        emit8(e, (uint8_t)shift);
+        emit_alu_reg(e, 0x01, HOST_RSI, HOST_RAX);
+    }
+    return 1;
+}
+
+static inline int is_reg64(od_t *od) {
+    return od->type == REG && od->reg1.width == REG_64;
+}
+
+// emit the host code of the instruction i of the block, at virtual address vaddr
+// return 0 if the instruction is not supported
+static int emit_instruction(emitter_t *e, block_t *block, uint64_t i, uint64_t vaddr) {
+    inst_t *inst = &(block->inst[i]);
+    inst_t *prev = (i == 0) ? NULL : &(block->inst[i - 1]);
+    od_t *src = &(inst->src);
+    od_t *dst = &(inst->dst);
+    uint64_t next = vaddr + inst->len;
+
+    switch (inst->op) {
+    case INST_MOV:
+        if (is_reg64(src) && is_reg64(dst)) {
+            emit_load(e, HOST_RAX, CORE_REG(src->reg1.index));
+            emit_store(e, HOST_RAX, CORE_REG(dst->reg1.index));
+        } else if (src->type == IMM && is_reg64(dst)) {
+            emit_mov_imm(e, HOST_RAX, src->imm);
+            emit_store(e, HOST_RAX, CORE_REG(dst->reg1.index));
+        } else if (is_reg64(src) && dst->type >= MEM_IMM) {
+            emit_sync_rip(e, next);
+            if (emit_address(e, dst) == 0) {
+                return 0;
+            }
+            emit_load(e, HOST_RDX, CORE_REG(src->reg1.index));
+            emit_write(e, block);
+            emit_reset_cflags(e);
+            emit_leave_if_stale(e, i + 1);
+            return 1;
+        } else if (src->type >= MEM_IMM && is_reg64(dst)) {
+            emit_sync_rip(e, next);
+            if (emit_address(e, src) == 0) {
+                return 0;
+            }
+            emit_mov_reg(e, HOST_RDI, HOST_RBX);
+            emit_call(e, &jit_read64);
+            emit_store(e, HOST_RAX, CORE_REG(dst->reg1.index));
+        } else {
+            return 0;
+        }
+        emit_reset_cflags(e);
+        return 1;
+    case INST_PUSH:
+        if (is_reg64(src) == 0) {
+            return 0;
+        }
+        emit_sync_rip(e, next);
+        emit_load(e, HOST_RDX, CORE_REG(src->reg1.index));
+        emit_alu_mem_imm8(e, 5, CORE_REG(REG_INDEX_RSP), 8);
+        emit_load(e, HOST_RSI, CORE_REG(REG_INDEX_RSP));
+        emit_write(e, block);
+        emit_reset_cflags(e);
+        emit_leave_if_stale(e, i + 1);
+        return 1;
+    case INST_POP:
+        if (is_reg64(src) == 0) {
+            return 0;
+        }
+        emit_sync_rip(e, next);
+        emit_load(e, HOST_RSI, CORE_REG(REG_INDEX_RSP));
+        emit_mov_reg(e, HOST_RDI, HOST_RBX);
+        emit_call(e, &jit_read64);
+        emit_alu_mem_imm8(e, 0, CORE_REG(REG_INDEX_RSP), 8);
+        emit_store(e, HOST_RAX, CORE_REG(src->reg1.index));
+        emit_reset_cflags(e);
+        return 1;
+    case INST_LEAVE:
+        emit_sync_rip(e, next);
+        emit_load(e, HOST_RSI, CORE_REG(REG_INDEX_RBP));
+        emit_store(e, HOST_RSI, CORE_REG(REG_INDEX_RSP));
+        emit_mov_reg(e, HOST_RDI, HOST_RBX);
+        emit_call(e, &jit_read64);
+        emit_alu_mem_imm8(e, 0, CORE_REG(REG_INDEX_RSP), 8);
+        emit_store(e, HOST_RAX, CORE_REG(REG_INDEX_RBP));
+        emit_reset_cflags(e);
+        return 1;
+    case INST_CALL:
+        if (src->type != IMM) {
+            return 0;
+        }
+        emit_sync_rip(e, next);
+        emit_alu_mem_imm8(e, 5, CORE_REG(REG_INDEX_RSP), 8);
+        emit_load(e, HOST_RSI, CORE_REG(REG_INDEX_RSP));
+        emit_mov_imm(e, HOST_RDX, next);
+        // the call ends the block, which is left anyway
+        emit_write(e, block);
+        emit_mov_imm(e, HOST_RAX, src->imm);
+        emit_store(e, HOST_RAX, CORE_RIP);
+        emit_reset_cflags(e);
+        return 1;
+    case INST_RET:
+        emit_sync_rip(e, next);
+        emit_load(e, HOST_RSI, CORE_REG(REG_INDEX_RSP));
+        emit_mov_reg(e, HOST_RDI, HOST_RBX);
+        emit_call(e, &jit_read64);
+        emit_alu_mem_imm8(e, 0, CORE_REG(REG_INDEX_RSP), 8);
+        emit_store(e, HOST_RAX, CORE_RIP);
+        emit_reset_cflags(e);
+        return 1;
+    case INST_ADD:
+        if (is_reg64(src) == 0 || is_reg64(dst) == 0) {
+            return 0;
+        }
+        emit_load(e, HOST_RDI, CORE_REG(src->reg1.index));
+        emit_load(e, HOST_RSI, CORE_REG(dst->reg1.index));
+        emit_mov_reg(e, HOST_RDX, HOST_RSI);
+        emit_alu_reg(e, 0x01, HOST_RDX, HOST_RDI);
+        emit_store(e, HOST_RDX, CORE_REG(dst->reg1.index));
+        emit_lazy_cflags(e, FLAGS_OP_ADD);
+        return 1;
+    case INST_SUB:
+        if (src->type != IMM || is_reg64(dst) == 0) {
+            return 0;
+        }
+        emit_mov_imm(e, HOST_RDI, src->imm);
+        emit_load(e, HOST_RSI, CORE_REG(dst->reg1.index));
+        emit_mov_reg(e, HOST_RDX, HOST_RSI);
+        emit_alu_reg(e, 0x29, HOST_RDX, HOST_RDI);
+        emit_store(e, HOST_RDX, CORE_REG(dst->reg1.index));
+        emit_lazy_cflags(e, FLAGS_OP_SUB);
+        return 1;
+    case INST_CMP:
+        if (src->type != IMM || dst->type < MEM_IMM) {
+            return 0;
+        }
+        emit_sync_rip(e, next);
+        if (emit_address(e, dst) == 0) {
+            return 0;
+        }
+        emit_mov_reg(e, HOST_RDI, HOST_RBX);
+        emit_call(e, &jit_read64);
+        emit_mov_reg(e, HOST_RSI, HOST_RAX);
+        emit_mov_imm(e, HOST_RDI, src->imm);
+        emit_mov_reg(e, HOST_RDX, HOST_RSI);
+        emit_alu_reg(e, 0x29, HOST_RDX, HOST_RDI);
+        emit_lazy_cflags(e, FLAGS_OP_SUB);
+        return 1;
+    case INST_JNE:
+        if (src->type != IMM) {
+            return 0;
+        }
+        // rip = (ZF != 1) ? target : next
+        if (prev != NULL && (prev->op == INST_ADD || prev->op == INST_SUB || prev->op == INST_CMP)) {
+            // the flags were just recorded in this block: ZF = (val == 0)
+            emit_load(e, HOST_RDX, CORE_LAZY(val));
+            // test rdx, rdx
+            emit8(e, 0x48);
+            emit8(e, 0x85);
+            emit8(e, 0xd2);
+        } else {
+            emit_sync_rip(e, next);
+            emit_mov_reg(e, HOST_RDI, HOST_RBX);
+            emit_call(e, &jit_read_zf);
+            // cmp eax, 1
+            emit8(e, 0x83);
+            emit8(e, 0xf8);
+            emit8(e, 0x01);
+        }
+        // the movs keep the flags of the host
+        emit_mov_imm(e, HOST_RAX, src->imm);
+        emit_mov_imm(e, HOST_RCX, next);
+        // cmove rax, rcx
+        emit8(e, 0x48);
+        emit8(e, 0x0f);
+        emit8(e, 0x44);
+        emit8(e, 0xc0 | (HOST_RAX << 3) | HOST_RCX);
+        emit_store(e, HOST_RAX, CORE_RIP);
+        emit_reset_cflags(e);
+        return 1;
+    case INST_JMP:
+        if (src->type != IMM) {
+            return 0;
+        }
+        emit_mov_imm(e, HOST_RAX, src->imm);
+        emit_store(e, HOST_RAX, CORE_RIP);
+        emit_reset_cflags(e);
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*======================================*/
+/*      block compiler                  */
+/*======================================*/
+
+// compile the block to host code in the buffer
+// return 0 if the block has an instruction not supported by the compiler
+static int compile_block(block_t *block) {
+    if (jit_buffer == NULL && init_jit_buffer() == 0) {
+        return 0;
+    }
+
+    uint64_t max_len = block->num_inst * JIT_MAX_INST_CODE + 64;
+    if (jit_offset + max_len > JIT_BUFFER_SIZE) {
+        // buffer full: drop all compiled code
+        jit_generation += 1;
+        jit_offset = 0;
+    }
+    if (protect_jit_buffer(PROT_READ | PROT_WRITE) == 0) {
+        return 0;
+    }
+
+    emitter_t e = {&jit_buffer[jit_offset], 0};
+
+    // push rbx; mov rbx, rdi
+    emit8(&e, 0x53);
+    emit_mov_reg(&e, HOST_RBX, HOST_RDI);
+
+    inst_t *last = &(block->inst[block->num_inst - 1]);
+    uint64_t vaddr = block->vaddr;
+    for (uint64_t i = 0; i < block->num_inst; ++i) {
+        if (emit_instruction(&e, block, i, vaddr) == 0) {
+            protect_jit_buffer(PROT_READ | PROT_EXEC);
+            return 0;
+        }
+        vaddr += block->inst[i].len;
+    }
+    if (last->op != INST_CALL && last->op != INST_RET && last->op != INST_JNE && last->op != INST_JMP) {
+        // the block ends at the page boundary or MAX_BLOCK_INST: fall through
+        emit_mov_imm(&e, HOST_RAX, block->vaddr + block->len);
+        emit_store(&e, HOST_RAX, CORE_RIP);
+    }
+
+    // mov eax, num_inst; pop rbx; ret
+    emit8(&e, 0xb8);
+    emit32(&e, (uint32_t)block->num_inst);
+    emit8(&e, 0x5b);
+    emit8(&e, 0xc3);
+    if (protect_jit_buffer(PROT_READ | PROT_EXEC) == 0) {
+        return 0;
+    }
+
+    block->jit_code = (uint64_t (*)(core_t *))e.code;
+    block->jit_gen = jit_generation;
+    jit_offset += (e.len + 15) & ~(uint64_t)15;
+
+    debug_printf(DEBUG_INSTRUCTIONCYCLE, "jit %lx    %lu instructions, %lu bytes\n", block->vaddr, block->num_inst, e.len);
+    return 1;
+}
+
+// execute at most max_num_inst instructions as basic blocks
+// the hot blocks are compiled to host code
+// return the number of instructions executed
+uint64_t jit_cycle(core_t *cr, uint64_t max_num_inst) {
+    if (instrumentation_enabled()) {
+        // the host code is not traced or profiled
+        return block_cycle(cr, max_num_inst);
+    }
+
+    uint64_t count = 0;
+    block_t *block = NULL;
+
+    while (count < max_num_inst) {
+        block = (block == NULL) ? find_block(cr) : next_block(block, cr);
+
+        uint64_t n = block->num_inst;
+        if (n <= max_num_inst - count) {
+            if (block->jit_gen != jit_generation && block->jit_unsupported == 0 && jit_disabled == 0) {
+                block->num_exec += 1;
+                if (block->num_exec >= JIT_THRESHOLD && compile_block(block) == 0) {
+                    block->jit_unsupported = 1;
+                }
+            }
+            if (block->jit_gen == jit_generation) {
+                fetch_block(block, 0, n, cr);
+                count += block->jit_code(cr);
+                if (is_stale_block(block, cr)) {
+                    block = NULL;
+                }
+                continue;
+            }
+        } else {
+            // the budget ends inside the block
+            n = max_num_inst - count;
+        }
+
+        inst_t *inst = block->inst;
+        fetch_block(block, 0, n, cr);
+        for (uint64_t i = 0; i < n; ++i) {
+            cr->rip = cr->rip + inst[i].len;
+            handler_table[inst[i].op](&(inst[i].src), &(inst[i].dst), cr);
+            if (wrote_block(&inst[i], block, cr)) {
+                // the last one executed
+                n = i + 1;
+            }
+        }
+        count += n;
+
+        if (n < block->num_inst || is_stale_block(block, cr)) {
+            block = NULL;
+        }
+    }
+    return count;
+}
+
+#else
+
+// no x86-64 host, or several cores: run the threaded code
+uint64_t jit_cycle(core_t *cr, uint64_t max_num_inst) {
+    return threaded_cycle(cr, max_num_inst);
+}
+
+#endif
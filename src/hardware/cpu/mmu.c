@@ -1,6 +1,7 @@
 // Memory Management Unit
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include "cpu.h"
 #include "memory.h"
@@ -8,7 +9,354 @@
 
 extern core_t cores[NUM_CORES];
 extern uint64_t ACTIVE_CORE;
-extern uint8_t pm[PHYSICAL_MEMORY_SPACE];
+
+/*======================================*/
+/*      page replacement                */
+/*======================================*/
+
+// the pages mapped by the page faults of each core
+// when the physical memory is exhausted, the clock algorithm evicts one to the swap file
+// a core only evicts its own pages, so it never shoots down the TLB of another host thread
+static resident_set_t resident_set[NUM_CORES];
+
+static resident_set_t *core_resident_set(core_t *cr) {
+    uint64_t id = cr - cores;
+    assert(id < NUM_CORES);
+    return &resident_set[id];
+}
+
+static void add_resident_page(uint64_t pte_paddr, uint64_t vpn, core_t *cr) {
+    resident_set_t *rs = core_resident_set(cr);
+    if (rs->num_page == rs->max_page) {
+        rs->max_page = rs->max_page == 0 ? 64 : 2 * rs->max_page;
+        rs->page = realloc(rs->page, rs->max_page * sizeof(resident_page_t));
+        if (rs->page == NULL) {
+            printf("out of host memory\n");
+            exit(0);
+        }
+    }
+    rs->page[rs->num_page].pte_paddr = pte_paddr;
+    rs->page[rs->num_page].vpn = vpn;
+    rs->num_page += 1;
+}
+
+// the resident sets are copied, the pages are shared by pm_snapshot
+void resident_snapshot(machine_snapshot_t *snapshot) {
+    for (int i = 0; i < NUM_CORES; ++i) {
+        resident_set_t *rs = &resident_set[i];
+        snapshot->resident_set[i] = *rs;
+        snapshot->resident_set[i].page = malloc((rs->num_page + 1) * sizeof(resident_page_t));
+        if (snapshot->resident_set[i].page == NULL) {
+            printf("out of host memory\n");
+            exit(0);
+        }
+        memcpy(snapshot->resident_set[i].page, rs->page, rs->num_page * sizeof(resident_page_t));
+        snapshot->resident_set[i].max_page = rs->num_page + 1;
+    }
+}
+
+void resident_restore(machine_snapshot_t *snapshot) {
+    for (int i = 0; i < NUM_CORES; ++i) {
+        resident_set_t *rs = &resident_set[i];
+        free(rs->page);
+        *rs = snapshot->resident_set[i];
+        rs->page = malloc(rs->max_page * sizeof(resident_page_t));
+        if (rs->page == NULL) {
+            printf("out of host memory\n");
+            exit(0);
+        }
+        memcpy(rs->page, snapshot->resident_set[i].page, rs->num_page * sizeof(resident_page_t));
+    }
+}
+
+void resident_free_snapshot(machine_snapshot_t *snapshot) {
+    for (int i = 0; i < NUM_CORES; ++i) {
+        free(snapshot->resident_set[i].page);
+    }
+}
+
+static void invalidate_tlb_entry(uint64_t vpn, core_t *cr) {
+    tlb_entry_t *set = cr->tlb.set[vpn & (NUM_TLB_SET - 1)];
+    for (int i = 0; i < NUM_TLB_WAY; ++i) {
+        if (set[i].vpn == vpn) {
+            set[i].valid = 0;
+        }
+    }
+}
+
+// the page walk sets the accessed bit, the hand clears it
+// and evicts the first page not accessed since the hand passed it last time
+// the TLB entry is invalidated with the bit, so the next access walks again
+// return the zeroed frame of the victim
+static uint64_t evict_page(core_t *cr) {
+    resident_set_t *rs = core_resident_set(cr);
+    if (rs->num_page == 0) {
+        printf("out of physical frames\n");
+        exit(0);
+    }
+
+    while (1) {
+        if (rs->hand >= rs->num_page) {
+            rs->hand = 0;
+        }
+        resident_page_t *page = &rs->page[rs->hand];
+        pte_t pte;
+        pte.pte_value = read64bits_dram(page->pte_paddr, cr);
+        invalidate_tlb_entry(page->vpn, cr);
+
+        if (pte.accessed == 1) {
+            pte.accessed = 0;
+            write64bits_dram(page->pte_paddr, pte.pte_value, cr);
+            rs->hand += 1;
+            continue;
+        }
+
+        uint64_t paddr = (uint64_t)pte.ppn << PHYSICAL_PAGE_OFFSET_LENGTH;
+        debug_printf(DEBUG_MMU, "evict page 0x%lx in frame 0x%lx\n", page->vpn << PHYSICAL_PAGE_OFFSET_LENGTH, paddr);
+        pte.present = 0;
+        pte.ppn = swap_out(paddr);
+        write64bits_dram(page->pte_paddr, pte.pte_value, cr);
+
+        // the last page takes the place of the victim
+        rs->num_page -= 1;
+        rs->page[rs->hand] = rs->page[rs->num_page];
+
+        pm_discard_frame(paddr);
+        invalidate_inst_cache(paddr, PAGE_SIZE);
+        return paddr;
+    }
+}
+
+// a zeroed frame: a free one, or a page of the core swapped out
+static uint64_t map_frame(core_t *cr) {
+    uint64_t paddr = try_allocate_frame();
+    return paddr != 0 ? paddr : evict_page(cr);
+}
+
+/*======================================*/
+/*      virtual memory areas            */
+/*======================================*/
+
+typedef struct VM_AREA_STRUCT {
+    uint64_t vaddr;
+    uint64_t len;
+    const uint8_t *bytes;
+} vm_area_t;
+
+typedef struct VM_AREA_LIST_STRUCT {
+    vm_area_t *area;
+    uint64_t num_area;
+    uint64_t max_area;
+} vm_area_list_t;
+
+static vm_area_list_t vm_area_list[NUM_CORES];
+
+void map_vm_area(uint64_t vaddr, const uint8_t *bytes, uint64_t len, core_t *cr) {
+    vm_area_list_t *list = &vm_area_list[cr - cores];
+    if (list->num_area == list->max_area) {
+        list->max_area = list->max_area == 0 ? 8 : 2 * list->max_area;
+        list->area = realloc(list->area, list->max_area * sizeof(vm_area_t));
+        if (list->area == NULL) {
+            printf("out of host memory\n");
+            exit(0);
+        }
+    }
+    list->area[list->num_area].vaddr = vaddr;
+    list->area[list->num_area].len = len;
+    list->area[list->num_area].bytes = bytes;
+    list->num_area += 1;
+
+    if (DEBUG_ENABLE_PAGE_WALK == 0) {
+        // flat mapping: no page faults to fill the pages, copy the bytes now, page by page as they alias
+        uint64_t done = 0;
+        while (done < len) {
+            uint64_t chunk = PAGE_SIZE - ((vaddr + done) & (PAGE_SIZE - 1));
+            chunk = chunk < len - done ? chunk : len - done;
+            writebytes_dram(va2pa(vaddr + done, cr), bytes + done, chunk, cr);
+            done += chunk;
+        }
+    }
+}
+
+void unmap_vm_areas(core_t *cr) {
+    vm_area_list_t *list = &vm_area_list[cr - cores];
+    free(list->area);
+    list->area = NULL;
+    list->num_area = 0;
+    list->max_area = 0;
+}
+
+// copy the bytes of the areas overlapping the virtual page to its new frame
+static void fill_page(uint64_t vaddr, uint64_t frame, core_t *cr) {
+    vm_area_list_t *list = &vm_area_list[cr - cores];
+    uint64_t page = vaddr & ~(uint64_t)(PAGE_SIZE - 1);
+    for (uint64_t i = 0; i < list->num_area; ++i) {
+        vm_area_t *area = &list->area[i];
+        uint64_t lo = area->vaddr > page ? area->vaddr : page;
+        uint64_t hi = area->vaddr + area->len < page + PAGE_SIZE ? area->vaddr + area->len : page + PAGE_SIZE;
+        if (lo < hi) {
+            debug_printf(DEBUG_LOADER, "fill page 0x%lx from the area at 0x%lx\n", page, area->vaddr);
+            writebytes_dram(frame + (lo - page), area->bytes + (lo - area->vaddr), hi - lo, cr);
+        }
+    }
+}
+
+/*======================================*/
+/*      page walk                       */
+/*======================================*/
+
+// index of vaddr in the table of level (1: PML4, ..., 4: PT)
+static inline uint64_t page_table_index(uint64_t vaddr, int level) {
+    int shift = PHYSICAL_PAGE_OFFSET_LENGTH + (PAGE_TABLE_LEVEL - level) * PAGE_TABLE_INDEX_LENGTH;
+    return (vaddr >> shift) & (NUM_PAGE_TABLE_ENTRY - 1);
+}
+
+// walk the 4 levels of the page table of the core
+// return the physical page number of vaddr
+// the missing tables and the page are demand-zero: allocated on the page fault
+// a page swapped out is read back from its swap slot
+static uint64_t page_walk(uint64_t vaddr, core_t *cr) {
+    if (cr->cr3 == 0) {
+        cr->cr3 = map_frame(cr);
+    }
+
+    uint64_t table = cr->cr3;
+    for (int level = 1; level <= PAGE_TABLE_LEVEL; ++level) {
+        uint64_t pte_paddr = table + page_table_index(vaddr, level) * sizeof(pte_t);
+        pte_t pte;
+        pte.pte_value = read64bits_dram(pte_paddr, cr);
+
+        if (pte.present == 0) {
+            uint64_t slot = pte.ppn;
+            uint64_t frame = map_frame(cr);
+            if (slot != 0) {
+                // major page fault: the page is in the swap file
+                debug_printf(DEBUG_MMU, "page fault 0x%lx in swap slot %lu\n", vaddr, slot);
+                swap_in(slot, frame);
+            } else {
+                // minor page fault: map a zeroed frame, or a page of a loaded file
+                debug_printf(DEBUG_MMU, "page fault 0x%lx at level %d\n", vaddr, level);
+                if (level == PAGE_TABLE_LEVEL) {
+                    fill_page(vaddr, frame, cr);
+                }
+            }
+            pte.pte_value = 0;
+            pte.present = 1;
+            pte.writable = 1;
+            pte.usermode = 1;
+            pte.ppn = frame >> PHYSICAL_PAGE_OFFSET_LENGTH;
+            if (level == PAGE_TABLE_LEVEL) {
+                pte.accessed = 1;
+                add_resident_page(pte_paddr, vaddr >> PHYSICAL_PAGE_OFFSET_LENGTH, cr);
+            }
+            write64bits_dram(pte_paddr, pte.pte_value, cr);
+        } else if (level == PAGE_TABLE_LEVEL && pte.accessed == 0) {
+            // referenced again since the clock hand passed
+            pte.accessed = 1;
+            write64bits_dram(pte_paddr, pte.pte_value, cr);
+        }
+        table = (uint64_t)pte.ppn << PHYSICAL_PAGE_OFFSET_LENGTH;
+    }
+    return table >> PHYSICAL_PAGE_OFFSET_LENGTH;
+}
+
+// free the table of level and everything mapped by it
+static void free_page_table(uint64_t table, int level, core_t *cr) {
+    pte_t entry[NUM_PAGE_TABLE_ENTRY];
+    readbytes_dram(table, (uint8_t *)entry, sizeof(entry), cr);
+    for (uint64_t i = 0; i < NUM_PAGE_TABLE_ENTRY; ++i) {
+        pte_t pte = entry[i];
+        uint64_t paddr = (uint64_t)pte.ppn << PHYSICAL_PAGE_OFFSET_LENGTH;
+        if (pte.present == 1 && level < PAGE_TABLE_LEVEL) {
+            free_page_table(paddr, level + 1, cr);
+        } else if (pte.present == 1) {
+            free_frame(paddr);
+        } else if (pte.ppn != 0 && level == PAGE_TABLE_LEVEL) {
+            swap_free(pte.ppn);
+        }
+    }
+    free_frame(table);
+}
+
+void free_address_space(core_t *cr) {
+    if (cr->cr3 != 0) {
+        free_page_table(cr->cr3, 1, cr);
+        cr->cr3 = 0;
+    }
+    flush_tlb(cr);
+    // the ptes of the resident pages are gone
+    resident_set_t *rs = core_resident_set(cr);
+    rs->num_page = 0;
+    rs->hand = 0;
+}
+
+/*======================================*/
+/*      TLB                             */
+/*======================================*/
+
+void flush_tlb(core_t *cr) {
+    for (int i = 0; i < NUM_TLB_SET; ++i) {
+        for (int j = 0; j < NUM_TLB_WAY; ++j) {
+            cr->tlb.set[i][j].valid = 0;
+        }
+    }
+}
+
+// translate the virtual address to physical address in MMU
+// each MMU is owned by each core
 uint64_t va2pa(uint64_t vaddr, core_t *cr) {
-    return vaddr % PHYSICAL_MEMORY_SPACE;
-}
\ No newline at end of file
+    if (DEBUG_ENABLE_PAGE_WALK == 0) {
+        // flat mapping: the virtual addresses alias modulo the physical memory
+        return vaddr % physical_memory_space;
+    }
+
+    uint64_t vpn = vaddr >> PHYSICAL_PAGE_OFFSET_LENGTH;
+    uint64_t offset = vaddr & (PAGE_SIZE - 1);
+    tlb_t *tlb = &(cr->tlb);
+    tlb_entry_t *set = tlb->set[vpn & (NUM_TLB_SET - 1)];
+    tlb->time += 1;
+
+    for (int i = 0; i < NUM_TLB_WAY; ++i) {
+        if (set[i].valid == 1 && set[i].vpn == vpn) {
+            tlb->hit += 1;
+            set[i].time = tlb->time;
+            return (set[i].ppn << PHYSICAL_PAGE_OFFSET_LENGTH) | offset;
+        }
+    }
+
+    // miss: walk the page table and replace the invalid or the least recently used entry
+    tlb->miss += 1;
+    tlb_entry_t *victim = &set[0];
+    for (int i = 0; i < NUM_TLB_WAY; ++i) {
+        if (set[i].valid == 0) {
+            victim = &set[i];
+            break;
+        }
+        if (set[i].time < victim->time) {
+            victim = &set[i];
+        }
+    }
+    victim->valid = 1;
+    victim->vpn = vpn;
+    victim->ppn = page_walk(vaddr, cr);
+    victim->time = tlb->time;
+    return (victim->ppn << PHYSICAL_PAGE_OFFSET_LENGTH) | offset;
+}
+
+// translate as va2pa, but leave the counters and the LRU order of the TLB as they are
+uint64_t va2pa_uncounted(uint64_t vaddr, core_t *cr) {
+    if (DEBUG_ENABLE_PAGE_WALK == 0) {
+        return vaddr % physical_memory_space;
+    }
+
+    uint64_t vpn = vaddr >> PHYSICAL_PAGE_OFFSET_LENGTH;
+    uint64_t offset = vaddr & (PAGE_SIZE - 1);
+    tlb_entry_t *set = cr->tlb.set[vpn & (NUM_TLB_SET - 1)];
+    for (int i = 0; i < NUM_TLB_WAY; ++i) {
+        if (set[i].valid == 1 && set[i].vpn == vpn) {
+            return (set[i].ppn << PHYSICAL_PAGE_OFFSET_LENGTH) | offset;
+        }
+    }
+    // not in the TLB: walk the table without filling the TLB
+    return (page_walk(vaddr, cr) << PHYSICAL_PAGE_OFFSET_LENGTH) | offset;
+}
@@ -0,0 +1,62 @@
+// Multi-core execution on host threads
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "cpu.h"
+#include "memory.h"
+#include "common.h"
+
+extern core_t cores[NUM_CORES];
+
+/*======================================*/
+/*      core threads                    */
+/*======================================*/
+
+// every core runs CORE_QUANTUM instructions and then waits at the barrier
+// so no core runs ahead of the others by more than one quantum
+static pthread_barrier_t quantum_barrier;
+
+typedef struct CORE_THREAD_STRUCT {
+    core_t *cr;
+    uint64_t max_num_inst;
+} core_thread_t;
+
+static void *core_thread(void *arg) {
+    core_thread_t *t = (core_thread_t *)arg;
+    uint64_t count = 0;
+
+    // the same number of quanta for all the cores: the barrier waits for all of them
+    uint64_t num_quantum = (t->max_num_inst + CORE_QUANTUM - 1) / CORE_QUANTUM;
+    for (uint64_t q = 0; q < num_quantum; ++q) {
+        uint64_t n = t->max_num_inst - count;
+        if (n > CORE_QUANTUM) {
+            n = CORE_QUANTUM;
+        }
+        for (uint64_t i = 0; i < n; ++i) {
+            instruction_cycle(t->cr);
+        }
+        count += n;
+        pthread_barrier_wait(&quantum_barrier);
+    }
+    return NULL;
+}
+
+void run_cores(uint64_t max_num_inst) {
+    pthread_t threads[NUM_CORES];
+    core_thread_t args[NUM_CORES];
+
+    pthread_barrier_init(&quantum_barrier, NULL, NUM_CORES);
+    for (int i = 0; i < NUM_CORES; ++i) {
+        args[i].cr = &cores[i];
+        args[i].max_num_inst = max_num_inst;
+        if (pthread_create(&threads[i], NULL, &core_thread, &args[i]) != 0) {
+            printf("cannot create the thread of core %d\n", i);
+            exit(0);
+        }
+    }
+    for (int i = 0; i < NUM_CORES; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_barrier_destroy(&quantum_barrier);
+}
@@ -0,0 +1,100 @@
+// Batch execution with stop conditions
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "cpu.h"
+#include "memory.h"
+#include "common.h"
+#include "instruction.h"
+#include "trace.h"
+
+/*======================================*/
+/*      run                             */
+/*======================================*/
+
+static inline int is_breakpoint(const stop_condition_t *stop, uint64_t rip) {
+    for (uint64_t i = 0; i < stop->num_breakpoint; ++i) {
+        if (stop->breakpoint[i] == rip) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// a breakpoint after the first instruction of the block
+static inline int has_breakpoint(const stop_condition_t *stop, block_t *block) {
+    for (uint64_t i = 0; i < stop->num_breakpoint; ++i) {
+        if (block->vaddr < stop->breakpoint[i] && stop->breakpoint[i] < block->vaddr + block->len) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+run_result_t run(core_t *cr, uint64_t max_steps, const stop_condition_t *stop) {
+    run_result_t result = {RUN_BUDGET, 0};
+    block_t *block = NULL;
+
+    while (result.num_inst < max_steps) {
+        // the sentinel is reached by ret or jmp, which end the blocks
+        // so both conditions hold at the first instruction of a block
+        if (stop != NULL && cr->rip == stop->sentinel) {
+            result.status = RUN_SENTINEL;
+            return result;
+        }
+        if (stop != NULL && result.num_inst > 0 && is_breakpoint(stop, cr->rip)) {
+            result.status = RUN_BREAKPOINT;
+            return result;
+        }
+
+        block = (block == NULL) ? find_block(cr) : next_block(block, cr);
+        inst_t *inst = block->inst;
+        uint64_t n = block->num_inst;
+
+        if (n > max_steps - result.num_inst || (stop != NULL && has_breakpoint(stop, block))) {
+            // step the instructions of the block
+            for (uint64_t i = 0; i < n; ++i) {
+                if (result.num_inst == max_steps) {
+                    return result;
+                }
+                if (i > 0 && stop != NULL && is_breakpoint(stop, cr->rip)) {
+                    result.status = RUN_BREAKPOINT;
+                    return result;
+                }
+                if (inst[i].op == INST_UNKNOWN) {
+                    result.status = RUN_FAULT;
+                    return result;
+                }
+                fetch_block(block, i, 1, cr);
+                execute_instruction(&inst[i], cr);
+                result.num_inst += 1;
+                if (wrote_block(&inst[i], block, cr)) {
+                    break;
+                }
+            }
+        } else {
+            // the unknown instruction can only end the block
+            uint64_t num_known = (inst[n - 1].op == INST_UNKNOWN) ? n - 1 : n;
+            fetch_block(block, 0, num_known, cr);
+            uint64_t i = 0;
+            while (i < num_known) {
+                execute_instruction(&inst[i], cr);
+                i += 1;
+                if (wrote_block(&inst[i - 1], block, cr)) {
+                    break;
+                }
+            }
+            result.num_inst += i;
+            if (i == num_known && num_known < n) {
+                result.status = RUN_FAULT;
+                return result;
+            }
+        }
+
+        if (is_stale_block(block, cr)) {
+            // the page of the block was written, e.g. by the block itself
+            block = NULL;
+        }
+    }
+    return result;
+}
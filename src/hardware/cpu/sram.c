@@ -0,0 +1,499 @@
+// Static Random Access Memory: the cache model
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "cpu.h"
+#include "memory.h"
+#include "common.h"
+
+/*======================================*/
+/*      sram cache                      */
+/*======================================*/
+
+// physical address: | tag | set index | line offset |
+
+void sram_cache_init(sram_cache_t *cache, uint64_t set_index_length, uint64_t num_way,
+                     uint64_t offset_length, cache_replacement_t replacement) {
+    assert(num_way > 0);
+    uint64_t num_set = 1 << set_index_length;
+
+    cache->set_index_length = set_index_length;
+    cache->offset_length = offset_length;
+    cache->num_way = num_way;
+    cache->replacement = replacement;
+    cache->line = malloc(num_set * num_way * sizeof(cache_line_t));
+    cache->stat = malloc(num_set * sizeof(cache_stat_t));
+    if (cache->line == NULL || cache->stat == NULL) {
+        printf("cannot allocate the sram cache\n");
+        exit(0);
+    }
+    sram_cache_reset(cache);
+}
+
+void sram_cache_free(sram_cache_t *cache) {
+    free(cache->line);
+    free(cache->stat);
+    cache->line = NULL;
+    cache->stat = NULL;
+}
+
+void sram_cache_reset(sram_cache_t *cache) {
+    uint64_t num_set = 1 << cache->set_index_length;
+    memset(cache->line, 0, num_set * cache->num_way * sizeof(cache_line_t));
+    memset(cache->stat, 0, num_set * sizeof(cache_stat_t));
+    cache->time = 0;
+    cache->random = 0x9e3779b97f4a7c15;
+}
+
+// the way to be replaced in the full set
+static uint64_t select_victim(sram_cache_t *cache, cache_line_t *set) {
+    if (cache->replacement == CACHE_RANDOM) {
+        // xorshift64
+        cache->random ^= cache->random << 13;
+        cache->random ^= cache->random >> 7;
+        cache->random ^= cache->random << 17;
+        return cache->random % cache->num_way;
+    }
+
+    // LRU and FIFO: the oldest time, only updated on access for LRU
+    uint64_t victim = 0;
+    for (uint64_t i = 1; i < cache->num_way; ++i) {
+        if (set[i].time < set[victim].time) {
+            victim = i;
+        }
+    }
+    return victim;
+}
+
+int sram_cache_access_line(sram_cache_t *cache, uint64_t paddr, int write, uint64_t *writeback) {
+    uint64_t set_index = (paddr >> cache->offset_length) & ((1 << cache->set_index_length) - 1);
+    uint64_t tag = paddr >> (cache->offset_length + cache->set_index_length);
+    cache_line_t *set = &(cache->line[set_index * cache->num_way]);
+    cache_stat_t *stat = &(cache->stat[set_index]);
+    cache->time += 1;
+    if (writeback != NULL) {
+        *writeback = NO_WRITEBACK;
+    }
+
+    for (uint64_t i = 0; i < cache->num_way; ++i) {
+        if (set[i].valid == 1 && set[i].tag == tag) {
+            stat->hit += 1;
+            if (cache->replacement == CACHE_LRU) {
+                set[i].time = cache->time;
+            }
+            set[i].dirty |= write;
+            debug_printf(DEBUG_CACHEDETAILS, "cache hit 0x%lx set %lu way %lu\n", paddr, set_index, i);
+            return 1;
+        }
+    }
+
+    // miss: fill an invalid line, or replace one
+    // write-allocate: a write miss fills the line too
+    stat->miss += 1;
+    uint64_t way = cache->num_way;
+    for (uint64_t i = 0; i < cache->num_way; ++i) {
+        if (set[i].valid == 0) {
+            way = i;
+            break;
+        }
+    }
+    if (way == cache->num_way) {
+        way = select_victim(cache, set);
+        stat->eviction += 1;
+        if (set[way].dirty == 1) {
+            // write-back: the data is already in pm
+            stat->writeback += 1;
+            if (writeback != NULL) {
+                uint64_t victim_line = (set[way].tag << cache->set_index_length) | set_index;
+                *writeback = victim_line << cache->offset_length;
+            }
+        }
+    }
+    set[way].valid = 1;
+    set[way].dirty = (write != 0);
+    set[way].tag = tag;
+    set[way].time = cache->time;
+    set[way].invalidated = 0;
+    debug_printf(DEBUG_CACHEDETAILS, "cache miss 0x%lx set %lu way %lu\n", paddr, set_index, way);
+    return 0;
+}
+
+int sram_cache_access(sram_cache_t *cache, uint64_t paddr, uint64_t len, int write) {
+    if (cache->line == NULL) {
+        sram_cache_init(cache, SRAM_CACHE_SET_INDEX_LENGTH, SRAM_CACHE_NUM_WAY,
+                        SRAM_CACHE_OFFSET_LENGTH, CACHE_LRU);
+    }
+
+    // an unaligned access may touch two lines
+    uint64_t first = paddr >> cache->offset_length;
+    uint64_t last = (paddr + len - 1) >> cache->offset_length;
+    int hit = 1;
+    for (uint64_t line = first; line <= last; ++line) {
+        hit &= sram_cache_access_line(cache, line << cache->offset_length, write, NULL);
+    }
+    return hit;
+}
+
+cache_stat_t sram_cache_stat(sram_cache_t *cache) {
+    cache_stat_t total = {0};
+    uint64_t num_set = 1 << cache->set_index_length;
+    for (uint64_t i = 0; i < num_set; ++i) {
+        total.hit += cache->stat[i].hit;
+        total.miss += cache->stat[i].miss;
+        total.eviction += cache->stat[i].eviction;
+        total.writeback += cache->stat[i].writeback;
+    }
+    return total;
+}
+
+void print_cache(sram_cache_t *cache) {
+    if (!debug_enabled(DEBUG_PRINTCACHESET)) {
+        return;
+    }
+
+    uint64_t num_set = 1 << cache->set_index_length;
+    for (uint64_t i = 0; i < num_set; ++i) {
+        cache_stat_t *stat = &(cache->stat[i]);
+        printf("set %3lu: hit %8lu  miss %8lu  eviction %8lu  writeback %8lu  |",
+               i, stat->hit, stat->miss, stat->eviction, stat->writeback);
+        for (uint64_t j = 0; j < cache->num_way; ++j) {
+            cache_line_t *line = &(cache->line[i * cache->num_way + j]);
+            if (line->valid == 1) {
+                printf(" %lx%s", line->tag, line->dirty == 1 ? "*" : "");
+            } else {
+                printf(" -");
+            }
+        }
+        printf("\n");
+    }
+}
+
+/*======================================*/
+/*      cache hierarchy                 */
+/*======================================*/
+
+extern core_t cores[NUM_CORES];
+
+core_cache_t core_cache[NUM_CORES];
+sram_cache_t llc;
+
+// the caches of the cores on different host threads snoop each other
+// so one access of the hierarchy holds the bus at a time
+static pthread_mutex_t bus_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t cache_latency[NUM_CACHE_LEVEL] = {
+    4,   // L1i
+    4,   // L1d
+    12,  // L2
+    40,  // LLC
+    200, // DRAM
+};
+
+static void init_cache_hierarchy(core_cache_t *cc) {
+    if (llc.line == NULL) {
+        sram_cache_init(&llc, 11, 16, 6, CACHE_LRU);
+    }
+    if (cc->l1i.line == NULL) {
+        sram_cache_init(&(cc->l1i), 6, 8, 6, CACHE_LRU);
+    }
+    if (cc->l1d.line == NULL) {
+        sram_cache_init(&(cc->l1d), 6, 8, 6, CACHE_LRU);
+    }
+    if (cc->l2.line == NULL) {
+        sram_cache_init(&(cc->l2), 9, 8, 6, CACHE_LRU);
+    }
+}
+
+// the set of the line of paddr
+static cache_line_t *find_set(sram_cache_t *cache, uint64_t paddr) {
+    uint64_t set_index = (paddr >> cache->offset_length) & ((1 << cache->set_index_length) - 1);
+    return &(cache->line[set_index * cache->num_way]);
+}
+
+// the way holding the line of paddr, valid or invalidated, NULL if none
+static cache_line_t *find_line(sram_cache_t *cache, uint64_t paddr, int valid) {
+    if (cache->line == NULL) {
+        return NULL;
+    }
+    uint64_t tag = paddr >> (cache->offset_length + cache->set_index_length);
+    cache_line_t *set = find_set(cache, paddr);
+    for (uint64_t i = 0; i < cache->num_way; ++i) {
+        if (set[i].tag == tag && set[i].valid == (uint64_t)valid && (valid == 1 || set[i].invalidated == 1)) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
+
+/*--------------------------------------*/
+// coherence statistics of the lines
+// open addressing by the line address, the lines after the table is full are not counted
+
+#define NUM_COHERENCE_STAT 4096
+static coherence_stat_t coherence_stat[NUM_COHERENCE_STAT];
+
+// insert: 1 to add the line if it is not counted yet
+static coherence_stat_t *find_coherence_stat(uint64_t line_paddr, int insert) {
+    // the key is paddr + 1: line 0 is a valid line
+    uint64_t slot = ((line_paddr + 1) * 0x9e3779b97f4a7c15) >> 52;
+    for (int i = 0; i < NUM_COHERENCE_STAT; ++i) {
+        coherence_stat_t *stat = &coherence_stat[(slot + i) % NUM_COHERENCE_STAT];
+        if (stat->paddr == line_paddr + 1) {
+            return stat;
+        }
+        if (stat->paddr == 0) {
+            if (insert == 0) {
+                return NULL;
+            }
+            stat->paddr = line_paddr + 1;
+            return stat;
+        }
+    }
+    return NULL;
+}
+
+// write the dirty line of paddr to the next level, as a dirty line replaced
+// the line replaced there goes on to the LLC
+static void snoop_writeback(sram_cache_t *cache, cache_line_t *line, sram_cache_t *next, uint64_t paddr) {
+    uint64_t set_index = (paddr >> cache->offset_length) & ((1 << cache->set_index_length) - 1);
+    cache->stat[set_index].writeback += 1;
+    line->dirty = 0;
+    uint64_t writeback = NO_WRITEBACK;
+    sram_cache_access_line(next, paddr, 1, &writeback);
+    if (next != &llc && writeback != NO_WRITEBACK) {
+        sram_cache_access_line(&llc, writeback, 1, NULL);
+    }
+}
+
+// snoop the L1d and L2 of the other cores
+// write: invalidate their copies; read: downgrade them to S
+// a modified line is written back to the L2 first, and to the LLC if the L2 drops it
+// return 1 if another L1d or L2 holds the line after the snoop
+static int snoop(int core_id, uint64_t paddr, int write, coherence_stat_t *stat) {
+    int shared = 0;
+    for (int i = 0; i < NUM_CORES; ++i) {
+        if (i == core_id) {
+            continue;
+        }
+        core_cache_t *cc = &core_cache[i];
+        cache_line_t *line = find_line(&(cc->l1d), paddr, 1);
+        if (line != NULL && line->dirty == 1) {
+            snoop_writeback(&(cc->l1d), line, &(cc->l2), paddr);
+        }
+        // the L1d may have dropped the line while the L2 still holds it
+        cache_line_t *l2_line = find_line(&(cc->l2), paddr, 1);
+        if (write == 1) {
+            if (line != NULL) {
+                line->valid = 0;
+                line->state = MESI_INVALID;
+                line->invalidated = 1;
+            }
+            if (l2_line != NULL) {
+                if (l2_line->dirty == 1) {
+                    snoop_writeback(&(cc->l2), l2_line, &llc, paddr);
+                }
+                l2_line->valid = 0;
+                l2_line->invalidated = 1;
+            }
+            if (stat != NULL && (line != NULL || l2_line != NULL)) {
+                stat->invalidation += 1;
+            }
+        } else {
+            if (line != NULL) {
+                line->state = MESI_SHARED;
+            }
+            if (line != NULL || l2_line != NULL) {
+                shared = 1;
+            }
+        }
+    }
+    return shared;
+}
+
+// access the line of paddr in the L1d of the core by MESI
+static int access_l1d(int core_id, uint64_t paddr, int write, uint64_t *writeback) {
+    sram_cache_t *l1d = &(core_cache[core_id].l1d);
+    uint64_t line_paddr = (paddr >> l1d->offset_length) << l1d->offset_length;
+    coherence_stat_t *stat = NULL;
+    if (NUM_CORES > 1) {
+        stat = find_coherence_stat(line_paddr, 1);
+    }
+
+    cache_line_t *line = find_line(l1d, paddr, 1);
+    if (line != NULL) {
+        if (write == 1 && line->state == MESI_SHARED) {
+            // upgrade: invalidate the other copies
+            snoop(core_id, paddr, 1, stat);
+            if (stat != NULL) {
+                stat->upgrade += 1;
+            }
+        }
+        int hit = sram_cache_access_line(l1d, paddr, write, writeback);
+        if (write == 1) {
+            line->state = MESI_MODIFIED;
+        }
+        return hit;
+    }
+
+    // miss: read for sharing, or read for ownership
+    // a coherence miss if the L1d or the L2 lost the line to an invalidation
+    if (stat != NULL && (find_line(l1d, paddr, 0) != NULL || find_line(&(core_cache[core_id].l2), paddr, 0) != NULL)) {
+        stat->coherence_miss += 1;
+    }
+    int shared = snoop(core_id, paddr, write, stat);
+    int hit = sram_cache_access_line(l1d, paddr, write, writeback);
+    line = find_line(l1d, paddr, 1);
+    line->state = write == 1 ? MESI_MODIFIED : (shared == 1 ? MESI_SHARED : MESI_EXCLUSIVE);
+    return hit;
+}
+
+// access the line of the level, L1d by MESI
+static int access_level(sram_cache_t **levels, int i, int core_id, uint64_t paddr, int write, uint64_t *writeback) {
+    if (i == 0 && levels[0] == &(core_cache[core_id].l1d)) {
+        return access_l1d(core_id, paddr, write, writeback);
+    }
+    return sram_cache_access_line(levels[i], paddr, write, writeback);
+}
+
+// write the dirty line replaced from level i to the levels below
+// off the critical path: no latency
+static void write_back(sram_cache_t **levels, int i, int core_id, uint64_t paddr) {
+    for (; i < 2 && paddr != NO_WRITEBACK; ++i) {
+        access_level(levels, i + 1, core_id, paddr, 1, &paddr);
+    }
+}
+
+// access the lines through L1 (i or d), L2 and LLC
+static uint64_t access_hierarchy(core_t *cr, int l1, uint64_t paddr, uint64_t len, int write) {
+    int core_id = cr - cores;
+    core_cache_t *cc = &core_cache[core_id];
+    if (NUM_CORES > 1) {
+        pthread_mutex_lock(&bus_lock);
+    }
+    init_cache_hierarchy(cc);
+    sram_cache_t *levels[3] = {l1 == CACHE_L1I ? &(cc->l1i) : &(cc->l1d), &(cc->l2), &llc};
+    uint64_t latency_level[3] = {cache_latency[l1], cache_latency[CACHE_L2], cache_latency[CACHE_LLC]};
+
+    uint64_t offset_length = levels[0]->offset_length;
+    uint64_t first = paddr >> offset_length;
+    uint64_t last = (paddr + len - 1) >> offset_length;
+    uint64_t latency = 0;
+    for (uint64_t line = first; line <= last; ++line) {
+        // the L1 miss fills the L1, and then the lower levels until one hits
+        int i = 0;
+        uint64_t writeback;
+        int hit = access_level(levels, 0, core_id, line << offset_length, write, &writeback);
+        write_back(levels, 0, core_id, writeback);
+        latency += latency_level[0];
+        while (hit == 0 && i < 2) {
+            i += 1;
+            hit = access_level(levels, i, core_id, line << offset_length, 0, &writeback);
+            write_back(levels, i, core_id, writeback);
+            latency += latency_level[i];
+        }
+        if (hit == 0) {
+            latency += cache_latency[CACHE_DRAM];
+        }
+    }
+    cc->stall += latency - latency_level[0];
+    if (NUM_CORES > 1) {
+        pthread_mutex_unlock(&bus_lock);
+    }
+    return latency;
+}
+uint64_t cache_fetch(core_t *cr, uint64_t paddr, uint64_t len, uint64_t num_inst) {
+    core_cache[cr - cores].num_inst += num_inst;
+    return access_hierarchy(cr, CACHE_L1I, paddr, len, 0);
+}
+
+uint64_t cache_access(core_t *cr, uint64_t paddr, uint64_t len, int write) {
+    return access_hierarchy(cr, CACHE_L1D, paddr, len, write);
+}
+
+void reset_cache_hierarchy() {
+    memset(coherence_stat, 0, sizeof(coherence_stat));
+    for (int i = 0; i < NUM_CORES; ++i) {
+        core_cache_t *cc = &core_cache[i];
+        init_cache_hierarchy(cc);
+        sram_cache_reset(&(cc->l1i));
+        sram_cache_reset(&(cc->l1d));
+        sram_cache_reset(&(cc->l2));
+        cc->num_inst = 0;
+        cc->stall = 0;
+    }
+    sram_cache_reset(&llc);
+}
+
+static void print_miss_rate(const char *name, sram_cache_t *cache) {
+    if (cache->line == NULL) {
+        return;
+    }
+    cache_stat_t stat = sram_cache_stat(cache);
+    uint64_t total = stat.hit + stat.miss;
+    printf("%-4s hit %10lu  miss %10lu  miss rate %6.2f%%  writeback %10lu\n",
+           name, stat.hit, stat.miss, total == 0 ? 0.0 : 100.0 * stat.miss / total, stat.writeback);
+}
+
+void print_cache_hierarchy(core_t *cr) {
+    core_cache_t *cc = &core_cache[cr - cores];
+    print_miss_rate("L1i", &(cc->l1i));
+    print_miss_rate("L1d", &(cc->l1d));
+    print_miss_rate("L2", &(cc->l2));
+    print_miss_rate("LLC", &llc);
+    printf("instructions %lu  stall cycles %lu  CPI %.2f\n", cc->num_inst, cc->stall,
+           cc->num_inst == 0 ? 0.0 : (double)(cc->num_inst + cc->stall) / cc->num_inst);
+}
+
+/*======================================*/
+/*      cache coherence                 */
+/*======================================*/
+
+mesi_state_t cache_line_state(core_t *cr, uint64_t paddr) {
+    cache_line_t *line = find_line(&(core_cache[cr - cores].l1d), paddr, 1);
+    return line == NULL ? MESI_INVALID : (mesi_state_t)line->state;
+}
+
+coherence_stat_t coherence_line_stat(uint64_t paddr) {
+    uint64_t offset_length = core_cache[0].l1d.line != NULL ? core_cache[0].l1d.offset_length : SRAM_CACHE_OFFSET_LENGTH;
+    uint64_t line_paddr = (paddr >> offset_length) << offset_length;
+
+    coherence_stat_t result = {0};
+    coherence_stat_t *stat = find_coherence_stat(line_paddr, 0);
+    if (stat != NULL) {
+        result = *stat;
+    }
+    result.paddr = line_paddr;
+    return result;
+}
+
+static uint64_t coherence_traffic(const coherence_stat_t *stat) {
+    return stat->invalidation + stat->upgrade + stat->coherence_miss;
+}
+
+static int compare_coherence_traffic(const void *a, const void *b) {
+    uint64_t ta = coherence_traffic((const coherence_stat_t *)a);
+    uint64_t tb = coherence_traffic((const coherence_stat_t *)b);
+    return ta < tb ? 1 : (ta > tb ? -1 : 0);
+}
+
+void print_coherence(int max_num_line) {
+    coherence_stat_t *sorted = malloc(sizeof(coherence_stat));
+    if (sorted == NULL) {
+        return;
+    }
+    memcpy(sorted, coherence_stat, sizeof(coherence_stat));
+    qsort(sorted, NUM_COHERENCE_STAT, sizeof(coherence_stat_t), &compare_coherence_traffic);
+
+    printf("line              invalidation  upgrade  coherence miss\n");
+    for (int i = 0; i < max_num_line && i < NUM_COHERENCE_STAT; ++i) {
+        if (sorted[i].paddr == 0 || coherence_traffic(&sorted[i]) == 0) {
+            break;
+        }
+        printf("%16lx  %12lu  %7lu  %14lu\n", sorted[i].paddr - 1,
+               sorted[i].invalidation, sorted[i].upgrade, sorted[i].coherence_miss);
+    }
+    free(sorted);
+}
@@ -0,0 +1,315 @@
+// Threaded code interpreter
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "cpu.h"
+#include "memory.h"
+#include "common.h"
+#include "instruction.h"
+#include "trace.h"
+
+/*======================================*/
+/*      threaded code                   */
+/*======================================*/
+
+// the instructions of a basic block are translated to micro operations
+// each micro-handler first moves rip to the next instruction, as the handlers expect
+// the micro-handler of each one is chosen once by the operand types
+// and the micro-handlers jump to each other by computed goto (GCC, Clang)
+// so there is neither the handler_table call nor the decode_operand branches
+
+typedef enum MICRO_OP_TYPE {
+    UOP_GENERIC,              // handler_table[op](src, dst)
+    UOP_MOV_REG_REG,          // mov %r1,%r2
+    UOP_MOV_IMM_REG,          // mov $imm,%r2
+    UOP_MOV_REG_MEM_IMM_REG1, // mov %r1,disp(%r2)
+    UOP_MOV_MEM_IMM_REG1_REG, // mov disp(%r1),%r2
+    UOP_PUSH_REG,             // push %r1
+    UOP_POP_REG,              // pop %r1
+    UOP_LEAVE,                // leave
+    UOP_CALL_IMM,             // call $imm
+    UOP_RET,                  // ret
+    UOP_ADD_REG_REG,          // add %r1,%r2
+    UOP_SUB_IMM_REG,          // sub $imm,%r2
+    UOP_CMP_IMM_MEM_IMM_REG1, // cmp $imm,disp(%r1)
+    UOP_JNE_IMM,              // jne $imm
+    UOP_JMP_IMM,              // jmp $imm
+    UOP_BLOCK_END,            // leave the threaded code of the block
+    NUM_UOP_TYPE,
+} uop_type_t;
+
+static inline int is_reg64(od_t *od) {
+    return od->type == REG && od->reg1.width == REG_64;
+}
+
+static inline int is_mem_imm_reg64(od_t *od) {
+    return od->type == MEM_IMM_REG1 && od->reg1.width == REG_64;
+}
+
+// choose the micro-handler by the operator and the operand types
+static uop_type_t select_uop(inst_t *inst, uop_t *uop) {
+    od_t *src = &(inst->src);
+    od_t *dst = &(inst->dst);
+
+    uop->inst = inst;
+    uop->imm = src->imm;
+    uop->disp = 0;
+    uop->r1 = src->reg1.index;
+    uop->r2 = dst->reg1.index;
+    uop->len = inst->len;
+
+    switch (inst->op) {
+    case INST_MOV:
+        if (is_reg64(src) && is_reg64(dst)) {
+            return UOP_MOV_REG_REG;
+        } else if (src->type == IMM && is_reg64(dst)) {
+            return UOP_MOV_IMM_REG;
+        } else if (is_reg64(src) && is_mem_imm_reg64(dst)) {
+            uop->disp = dst->imm;
+            return UOP_MOV_REG_MEM_IMM_REG1;
+        } else if (is_mem_imm_reg64(src) && is_reg64(dst)) {
+            uop->disp = src->imm;
+            return UOP_MOV_MEM_IMM_REG1_REG;
+        }
+        return UOP_GENERIC;
+    case INST_PUSH:
+        return is_reg64(src) ? UOP_PUSH_REG : UOP_GENERIC;
+    case INST_POP:
+        return is_reg64(src) ? UOP_POP_REG : UOP_GENERIC;
+    case INST_LEAVE:
+        return UOP_LEAVE;
+    case INST_CALL:
+        return src->type == IMM ? UOP_CALL_IMM : UOP_GENERIC;
+    case INST_RET:
+        return UOP_RET;
+    case INST_ADD:
+        return (is_reg64(src) && is_reg64(dst)) ? UOP_ADD_REG_REG : UOP_GENERIC;
+    case INST_SUB:
+        return (src->type == IMM && is_reg64(dst)) ? UOP_SUB_IMM_REG : UOP_GENERIC;
+    case INST_CMP:
+        if (src->type == IMM && is_mem_imm_reg64(dst)) {
+            uop->disp = dst->imm;
+            uop->r1 = dst->reg1.index;
+            return UOP_CMP_IMM_MEM_IMM_REG1;
+        }
+        return UOP_GENERIC;
+    case INST_JNE:
+        return src->type == IMM ? UOP_JNE_IMM : UOP_GENERIC;
+    case INST_JMP:
+        return src->type == IMM ? UOP_JMP_IMM : UOP_GENERIC;
+    default:
+        return UOP_GENERIC;
+    }
+}
+
+// translate the instructions of the block to threaded code
+static void thread_block(block_t *block, const void **labels) {
+    for (uint64_t i = 0; i < block->num_inst; ++i) {
+        uop_t *uop = &(block->uop[i]);
+        uop->label = labels[select_uop(&(block->inst[i]), uop)];
+    }
+    block->uop[block->num_inst].label = labels[UOP_BLOCK_END];
+    block->threaded = 1;
+}
+
+// execute at most max_num_inst instructions as threaded code
+// return the number of instructions executed
+uint64_t threaded_cycle(core_t *cr, uint64_t max_num_inst) {
+#if defined(__GNUC__)
+    static const void *labels[NUM_UOP_TYPE] = {
+        [UOP_GENERIC] = &&generic,
+        [UOP_MOV_REG_REG] = &&mov_reg_reg,
+        [UOP_MOV_IMM_REG] = &&mov_imm_reg,
+        [UOP_MOV_REG_MEM_IMM_REG1] = &&mov_reg_mem_imm_reg1,
+        [UOP_MOV_MEM_IMM_REG1_REG] = &&mov_mem_imm_reg1_reg,
+        [UOP_PUSH_REG] = &&push_reg,
+        [UOP_POP_REG] = &&pop_reg,
+        [UOP_LEAVE] = &&leave,
+        [UOP_CALL_IMM] = &&call_imm,
+        [UOP_RET] = &&ret,
+        [UOP_ADD_REG_REG] = &&add_reg_reg,
+        [UOP_SUB_IMM_REG] = &&sub_imm_reg,
+        [UOP_CMP_IMM_MEM_IMM_REG1] = &&cmp_imm_mem_imm_reg1,
+        [UOP_JNE_IMM] = &&jne_imm,
+        [UOP_JMP_IMM] = &&jmp_imm,
+        [UOP_BLOCK_END] = &&block_end,
+    };
+
+// dispatch to the micro-handler of the next micro operation
+#define DISPATCH()        \
+    do {                  \
+        ++uop;            \
+        goto *uop->label; \
+    } while (0)
+
+// after a store: leave the block at rip if the store wrote its code
+// the instructions after uop are not executed
+#define DISPATCH_STORE()                                                \
+    do {                                                                \
+        if (wrote_block(uop->inst, block, cr)) {                        \
+            count -= block->num_inst - (uint64_t)(uop - block->uop) - 1; \
+            goto block_end;                                             \
+        }                                                               \
+        DISPATCH();                                                     \
+    } while (0)
+
+    if (instrumentation_enabled()) {
+        // the micro-handlers are not traced or profiled
+        return block_cycle(cr, max_num_inst);
+    }
+
+    uint64_t *reg = (uint64_t *)&(cr->reg);
+    uint64_t count = 0;
+    block_t *block = NULL;
+    uop_t *uop = NULL;
+
+    while (count < max_num_inst) {
+        block = (block == NULL) ? find_block(cr) : next_block(block, cr);
+
+        if (block->num_inst > max_num_inst - count) {
+            // the budget ends inside the block
+            uint64_t n = max_num_inst - count;
+            fetch_block(block, 0, n, cr);
+            for (uint64_t i = 0; i < n; ++i) {
+                execute_instruction(&(block->inst[i]), cr);
+                if (wrote_block(&(block->inst[i]), block, cr)) {
+                    // the last one executed
+                    n = i + 1;
+                }
+            }
+            count += n;
+            break;
+        }
+
+        if (block->threaded == 0) {
+            thread_block(block, labels);
+        }
+        fetch_block(block, 0, block->num_inst, cr);
+        count += block->num_inst;
+        uop = &(block->uop[0]);
+        goto *uop->label;
+
+    generic:
+        cr->rip = cr->rip + uop->len;
+        handler_table[uop->inst->op](&(uop->inst->src), &(uop->inst->dst), cr);
+        DISPATCH_STORE();
+
+    mov_reg_reg:
+        cr->rip = cr->rip + uop->len;
+        reg[uop->r2] = reg[uop->r1];
+        reset_cflags(cr);
+        DISPATCH();
+
+    mov_imm_reg:
+        cr->rip = cr->rip + uop->len;
+        reg[uop->r2] = uop->imm;
+        reset_cflags(cr);
+        DISPATCH();
+
+    mov_reg_mem_imm_reg1:
+        cr->rip = cr->rip + uop->len;
+        write64bits_dram(va2pa(uop->disp + reg[uop->r2], cr), reg[uop->r1], cr);
+        reset_cflags(cr);
+        DISPATCH_STORE();
+
+    mov_mem_imm_reg1_reg:
+        cr->rip = cr->rip + uop->len;
+        reg[uop->r2] = read64bits_dram(va2pa(uop->disp + reg[uop->r1], cr), cr);
+        reset_cflags(cr);
+        DISPATCH();
+
+    push_reg: {
+        cr->rip = cr->rip + uop->len;
+        uint64_t src = reg[uop->r1];
+        cr->reg.rsp = cr->reg.rsp - 8;
+        write64bits_dram(va2pa(cr->reg.rsp, cr), src, cr);
+        reset_cflags(cr);
+        DISPATCH_STORE();
+    }
+
+    pop_reg: {
+        cr->rip = cr->rip + uop->len;
+        uint64_t old_val = read64bits_dram(va2pa(cr->reg.rsp, cr), cr);
+        cr->reg.rsp = cr->reg.rsp + 8;
+        reg[uop->r1] = old_val;
+        reset_cflags(cr);
+        DISPATCH();
+    }
+
+    leave:
+        cr->rip = cr->rip + uop->len;
+        cr->reg.rsp = cr->reg.rbp;
+        cr->reg.rbp = read64bits_dram(va2pa(cr->reg.rsp, cr), cr);
+        cr->reg.rsp = cr->reg.rsp + 8;
+        reset_cflags(cr);
+        DISPATCH();
+
+    call_imm:
+        cr->rip = cr->rip + uop->len;
+        cr->reg.rsp = cr->reg.rsp - 8;
+        write64bits_dram(va2pa(cr->reg.rsp, cr), cr->rip, cr);
+        cr->rip = uop->imm;
+        reset_cflags(cr);
+        DISPATCH_STORE();
+
+    ret:
+        cr->rip = read64bits_dram(va2pa(cr->reg.rsp, cr), cr);
+        cr->reg.rsp = cr->reg.rsp + 8;
+        reset_cflags(cr);
+        DISPATCH();
+
+    add_reg_reg: {
+        cr->rip = cr->rip + uop->len;
+        uint64_t src = reg[uop->r1];
+        uint64_t dst = reg[uop->r2];
+        uint64_t val = dst + src;
+        add_cflags(src, dst, val, cr);
+        reg[uop->r2] = val;
+        DISPATCH();
+    }
+
+    sub_imm_reg: {
+        cr->rip = cr->rip + uop->len;
+        uint64_t dst = reg[uop->r2];
+        uint64_t val = dst + (~uop->imm + 1);
+        sub_cflags(uop->imm, dst, val, cr);
+        reg[uop->r2] = val;
+        DISPATCH();
+    }
+
+    cmp_imm_mem_imm_reg1: {
+        cr->rip = cr->rip + uop->len;
+        uint64_t dst_val = read64bits_dram(va2pa(uop->disp + reg[uop->r1], cr), cr);
+        uint64_t val = dst_val + (~uop->imm + 1);
+        sub_cflags(uop->imm, dst_val, val, cr);
+        DISPATCH();
+    }
+
+    jne_imm:
+        cr->rip = cr->rip + uop->len;
+        if (read_ZF(cr) != 1) {
+            cr->rip = uop->imm;
+        }
+        reset_cflags(cr);
+        DISPATCH();
+
+    jmp_imm:
+        cr->rip = uop->imm;
+        reset_cflags(cr);
+        DISPATCH();
+
+    block_end:
+        if (is_stale_block(block, cr)) {
+            // the page of the block was written, e.g. by the block itself
+            block = NULL;
+        }
+    }
+    return count;
+
+#undef DISPATCH
+#undef DISPATCH_STORE
+#else
+    // no computed goto: run the handlers of the basic blocks
+    return block_cycle(cr, max_num_inst);
+#endif
+}
@@ -0,0 +1,82 @@
+// Timing model
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "cpu.h"
+#include "memory.h"
+#include "common.h"
+#include "instruction.h"
+
+/*======================================*/
+/*      latencies                       */
+/*======================================*/
+
+// cycles of the operators with their operands ready and an L1 hit
+uint64_t op_latency[NUM_INSTRTYPE] = {
+    [INST_MOV] = 1,
+    [INST_PUSH] = 1,
+    [INST_POP] = 1,
+    [INST_LEAVE] = 2,
+    [INST_CALL] = 2,
+    [INST_RET] = 2,
+    [INST_ADD] = 1,
+    [INST_SUB] = 1,
+    [INST_CMP] = 1,
+    [INST_JNE] = 1,
+    [INST_JMP] = 1,
+    [INST_UNKNOWN] = 0,
+};
+
+// every access hits L1 by default
+uint64_t flat_memory_stall[2] = {
+    0, // read
+    0, // write
+};
+
+int timing_enabled = 0;
+timing_t core_timing[NUM_CORES];
+
+/*======================================*/
+/*      counters                        */
+/*======================================*/
+
+// each core counts its own, no lock
+void time_instruction(uint64_t op, core_t *cr) {
+    timing_t *t = &core_timing[cr - cores];
+    t->instructions += 1;
+    t->cycles += op_latency[op];
+}
+
+void time_fetch(core_t *cr, uint64_t stall) {
+    timing_t *t = &core_timing[cr - cores];
+    t->mem_stall += stall;
+    t->cycles += stall;
+}
+
+void time_memory(core_t *cr, uint64_t stall) {
+    timing_t *t = &core_timing[cr - cores];
+    t->mem_access += 1;
+    t->mem_stall += stall;
+    t->cycles += stall;
+}
+
+void timing_start() {
+    memset(core_timing, 0, sizeof(core_timing));
+    timing_enabled = 1;
+}
+
+void timing_stop() {
+    timing_enabled = 0;
+}
+
+double timing_ipc(core_t *cr) {
+    timing_t *t = &core_timing[cr - cores];
+    return t->cycles == 0 ? 0.0 : (double)t->instructions / t->cycles;
+}
+
+void print_timing(core_t *cr) {
+    timing_t *t = &core_timing[cr - cores];
+    printf("cycles %lu  instructions %lu  IPC %.2f\n", t->cycles, t->instructions, timing_ipc(cr));
+    printf("memory accesses %lu  memory stall cycles %lu (%.2f%%)\n", t->mem_access, t->mem_stall,
+           t->cycles == 0 ? 0.0 : 100.0 * t->mem_stall / t->cycles);
+}
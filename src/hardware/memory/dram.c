@@ -3,6 +3,11 @@
 #include "memory.h"
 #include "common.h"
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
 
 /*
 Be careful with the x86-64 little endian integer encoding
@@ -12,64 +17,363 @@ e.g. write 0x00007fd357a02ae0 to cache, the memory lapping should be:
 
 extern core_t cores[NUM_CORES];
 extern uint64_t ACTIVE_CORE;
-extern uint8_t pm[PHYSICAL_MEMORY_SPACE];
 
-// memory accessing used in instructions
-uint64_t read64bits_dram(uint64_t paddr, core_t *cr) {
-    if (DEBUG_ENABLE_SRAM_CACHE == 1) {
-        // try to load uint64_t from SRAM cache
-        // little-endian
-    } else {
-        // read from DRAM directly
-        // little-endian
-        uint64_t val = 0x0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HOST_LITTLE_ENDIAN 1
+#else
+#define HOST_LITTLE_ENDIAN 0
+#endif
+
+/*======================================*/
+/*      sparse physical memory          */
+/*======================================*/
+
+// two-level directory of host frames, as a page table
+// | directory (18) | table (10) | page offset (12) | of the 40-bit physical address
+// the directory is in bss, which the host maps only when it is touched
+// the tables and frames are allocated when a frame is first written
+#define PM_TABLE_INDEX_LENGTH 10
+#define NUM_PM_TABLE_ENTRY (1 << PM_TABLE_INDEX_LENGTH)
+#define NUM_PM_DIRECTORY_ENTRY (MAX_PHYSICAL_MEMORY_SPACE >> (PHYSICAL_PAGE_OFFSET_LENGTH + PM_TABLE_INDEX_LENGTH))
 
-        val += (((uint64_t)pm[paddr + 0]) << 0);
-        val += (((uint64_t)pm[paddr + 1]) << 8);
-        val += (((uint64_t)pm[paddr + 2]) << 16);
-        val += (((uint64_t)pm[paddr + 3]) << 24);
-        val += (((uint64_t)pm[paddr + 4]) << 32);
-        val += (((uint64_t)pm[paddr + 5]) << 40);
-        val += (((uint64_t)pm[paddr + 6]) << 48);
-        val += (((uint64_t)pm[paddr + 7]) << 56);
+// a frame is shared by the machine and the snapshots, copied on the write
+struct HOST_FRAME_STRUCT {
+    uint64_t refcount;
+    uint8_t data[PAGE_SIZE];
+};
+
+uint64_t physical_memory_space = PHYSICAL_MEMORY_SPACE;
+
+static host_frame_t **pm_directory[NUM_PM_DIRECTORY_ENTRY];
+// the directory indexes of the allocated tables, to scan the touched frames only
+static uint64_t *pm_table_index = NULL;
+static uint64_t pm_num_table = 0;
+static uint64_t pm_max_table = 0;
+static uint64_t pm_num_touched = 0;
+// the frames of untouched physical pages
+static const uint8_t zero_frame[PAGE_SIZE];
+// the first touches of the cores on different host threads
+// the lookups do not lock: the pointers are published by release stores
+static pthread_mutex_t pm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void pm_init(uint64_t size) {
+    size = (size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if (size == 0 || size > MAX_PHYSICAL_MEMORY_SPACE) {
+        printf("physical memory of 0x%lx bytes is not supported\n", size);
+        exit(0);
+    }
+    physical_memory_space = size;
+}
+
+uint64_t pm_touched_frames() {
+    return __atomic_load_n(&pm_num_touched, __ATOMIC_RELAXED);
+}
+
+static void *pm_alloc(uint64_t size) {
+    void *p = calloc(1, size);
+    if (p == NULL) {
+        printf("out of host memory\n");
+        exit(0);
+    }
+    return p;
+}
+
+// the host frame of the physical page, NULL if it is untouched
+static inline host_frame_t *find_frame(uint64_t ppn) {
+    host_frame_t **table = __atomic_load_n(&pm_directory[ppn >> PM_TABLE_INDEX_LENGTH], __ATOMIC_ACQUIRE);
+    if (table == NULL) {
+        return NULL;
+    }
+    return __atomic_load_n(&table[ppn & (NUM_PM_TABLE_ENTRY - 1)], __ATOMIC_ACQUIRE);
+}
+
+// the entry of the physical page, with pm_lock held
+static host_frame_t **frame_entry(uint64_t ppn) {
+    uint64_t index = ppn >> PM_TABLE_INDEX_LENGTH;
+    if (pm_directory[index] == NULL) {
+        if (pm_num_table == pm_max_table) {
+            pm_max_table = pm_max_table == 0 ? 64 : 2 * pm_max_table;
+            pm_table_index = realloc(pm_table_index, pm_max_table * sizeof(uint64_t));
+            if (pm_table_index == NULL) {
+                printf("out of host memory\n");
+                exit(0);
+            }
+        }
+        pm_table_index[pm_num_table++] = index;
+        __atomic_store_n(&pm_directory[index], pm_alloc(NUM_PM_TABLE_ENTRY * sizeof(host_frame_t *)), __ATOMIC_RELEASE);
+    }
+    return &pm_directory[index][ppn & (NUM_PM_TABLE_ENTRY - 1)];
+}
+
+static void release_frame(host_frame_t *frame) {
+    if (__atomic_sub_fetch(&frame->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(frame);
+    }
+}
 
+// first touch: allocate the zeroed host frame
+// or the first write to a shared frame: copy it
+static host_frame_t *touch_frame(uint64_t ppn) {
+    pthread_mutex_lock(&pm_lock);
+    host_frame_t **entry = frame_entry(ppn);
+    // another thread may have touched it before the lock
+    host_frame_t *frame = *entry;
+    if (frame == NULL) {
+        frame = pm_alloc(sizeof(host_frame_t));
+        frame->refcount = 1;
+        __atomic_store_n(entry, frame, __ATOMIC_RELEASE);
+        ++pm_num_touched;
+        debug_printf(DEBUG_MMU, "touch frame 0x%lx\n", ppn << PHYSICAL_PAGE_OFFSET_LENGTH);
+    } else if (__atomic_load_n(&frame->refcount, __ATOMIC_ACQUIRE) > 1) {
+        host_frame_t *copy = pm_alloc(sizeof(host_frame_t));
+        memcpy(copy->data, frame->data, PAGE_SIZE);
+        copy->refcount = 1;
+        __atomic_store_n(entry, copy, __ATOMIC_RELEASE);
+        release_frame(frame);
+        frame = copy;
+        debug_printf(DEBUG_MMU, "copy frame 0x%lx on write\n", ppn << PHYSICAL_PAGE_OFFSET_LENGTH);
+    }
+    pthread_mutex_unlock(&pm_lock);
+    return frame;
+}
+
+const uint8_t *pm_read_pointer(uint64_t paddr) {
+    host_frame_t *frame = find_frame(paddr >> PHYSICAL_PAGE_OFFSET_LENGTH);
+    return (frame == NULL ? zero_frame : frame->data) + (paddr & (PAGE_SIZE - 1));
+}
+
+uint8_t *pm_write_pointer(uint64_t paddr) {
+    uint64_t ppn = paddr >> PHYSICAL_PAGE_OFFSET_LENGTH;
+    host_frame_t *frame = find_frame(ppn);
+    if (frame == NULL || __atomic_load_n(&frame->refcount, __ATOMIC_RELAXED) > 1) {
+        frame = touch_frame(ppn);
+    }
+    return frame->data + (paddr & (PAGE_SIZE - 1));
+}
+
+// the frame must not be in use, e.g. it is being allocated or freed
+void pm_discard_frame(uint64_t paddr) {
+    uint64_t ppn = paddr >> PHYSICAL_PAGE_OFFSET_LENGTH;
+    pthread_mutex_lock(&pm_lock);
+    host_frame_t **table = pm_directory[ppn >> PM_TABLE_INDEX_LENGTH];
+    if (table != NULL && table[ppn & (NUM_PM_TABLE_ENTRY - 1)] != NULL) {
+        release_frame(table[ppn & (NUM_PM_TABLE_ENTRY - 1)]);
+        __atomic_store_n(&table[ppn & (NUM_PM_TABLE_ENTRY - 1)], NULL, __ATOMIC_RELEASE);
+        --pm_num_touched;
+    }
+    pthread_mutex_unlock(&pm_lock);
+}
+
+// share the touched frames with the snapshot
+void pm_snapshot(machine_snapshot_t *snapshot) {
+    pthread_mutex_lock(&pm_lock);
+    snapshot->physical_memory_space = physical_memory_space;
+    snapshot->num_frame = 0;
+    snapshot->frame_ppn = pm_alloc((pm_num_touched + 1) * sizeof(uint64_t));
+    snapshot->frame = pm_alloc((pm_num_touched + 1) * sizeof(host_frame_t *));
+    for (uint64_t i = 0; i < pm_num_table; ++i) {
+        host_frame_t **table = pm_directory[pm_table_index[i]];
+        for (uint64_t j = 0; j < NUM_PM_TABLE_ENTRY; ++j) {
+            if (table[j] != NULL) {
+                __atomic_add_fetch(&table[j]->refcount, 1, __ATOMIC_RELAXED);
+                snapshot->frame_ppn[snapshot->num_frame] = (pm_table_index[i] << PM_TABLE_INDEX_LENGTH) | j;
+                snapshot->frame[snapshot->num_frame] = table[j];
+                snapshot->num_frame += 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&pm_lock);
+}
+
+// drop the frames of the machine and share the frames of the snapshot
+void pm_restore(machine_snapshot_t *snapshot) {
+    pthread_mutex_lock(&pm_lock);
+    for (uint64_t i = 0; i < pm_num_table; ++i) {
+        host_frame_t **table = pm_directory[pm_table_index[i]];
+        for (uint64_t j = 0; j < NUM_PM_TABLE_ENTRY; ++j) {
+            if (table[j] != NULL) {
+                release_frame(table[j]);
+                table[j] = NULL;
+            }
+        }
+    }
+    for (uint64_t i = 0; i < snapshot->num_frame; ++i) {
+        __atomic_add_fetch(&snapshot->frame[i]->refcount, 1, __ATOMIC_RELAXED);
+        *frame_entry(snapshot->frame_ppn[i]) = snapshot->frame[i];
+    }
+    pm_num_touched = snapshot->num_frame;
+    physical_memory_space = snapshot->physical_memory_space;
+    pthread_mutex_unlock(&pm_lock);
+}
+
+void pm_free_snapshot(machine_snapshot_t *snapshot) {
+    for (uint64_t i = 0; i < snapshot->num_frame; ++i) {
+        release_frame(snapshot->frame[i]);
+    }
+    free(snapshot->frame_ppn);
+    free(snapshot->frame);
+}
+
+/*======================================*/
+/*      memory R/W                      */
+/*======================================*/
+
+// the access must stay inside the physical memory
+static inline void check_paddr(uint64_t paddr, uint64_t len) {
+    if (paddr >= physical_memory_space || len > physical_memory_space - paddr) {
+        printf("physical address 0x%lx (%lu bytes) out of memory\n", paddr, len);
+        exit(0);
+    }
+}
+
+// fast path: the bytes are in one page, a single unaligned load or store
+static inline int in_one_page(uint64_t paddr, uint64_t len) {
+    return (paddr & (PAGE_SIZE - 1)) + len <= PAGE_SIZE && paddr + len <= physical_memory_space;
+}
+
+// slow path: the access straddles a page or the end of the memory
+// little-endian byte by byte
+static uint64_t read_dram_slow(uint64_t paddr, uint64_t len) {
+    check_paddr(paddr, len);
+    uint64_t val = 0x0;
+    for (uint64_t i = 0; i < len; ++i) {
+        val += ((uint64_t)*pm_read_pointer(paddr + i)) << (8 * i);
+    }
+    return val;
+}
+
+static void write_dram_slow(uint64_t paddr, uint64_t data, uint64_t len) {
+    check_paddr(paddr, len);
+    for (uint64_t i = 0; i < len; ++i) {
+        *pm_write_pointer(paddr + i) = (data >> (8 * i)) & 0xff;
+    }
+}
+
+// read len (1, 2, 4, 8) bytes as a little-endian integer
+static inline uint64_t read_dram(uint64_t paddr, uint64_t len, core_t *cr) {
+    if (DEBUG_ENABLE_SRAM_CACHE == 1) {
+        // the cache model counts the access, the data is read from pm
+        uint64_t latency = cache_access(cr, paddr, len, 0);
+        if (timing_enabled != 0) {
+            time_memory(cr, latency - cache_latency[CACHE_L1D]);
+        }
+    } else if (timing_enabled != 0) {
+        time_memory(cr, flat_memory_stall[TIMING_READ]);
+    }
+    if (HOST_LITTLE_ENDIAN && in_one_page(paddr, len)) {
+        uint64_t val = 0x0;
+        memcpy(&val, pm_read_pointer(paddr), len);
         return val;
     }
+    return read_dram_slow(paddr, len);
 }
 
-void write64bits_dram(uint64_t paddr, uint64_t data, core_t *cr) {
+// write the low len (1, 2, 4, 8) bytes of data, little-endian
+static inline void write_dram(uint64_t paddr, uint64_t data, uint64_t len, core_t *cr) {
     if (DEBUG_ENABLE_SRAM_CACHE == 1) {
-        // try to write uint64_t to SRAM cache
-        // little-endian
+        uint64_t latency = cache_access(cr, paddr, len, 1);
+        if (timing_enabled != 0) {
+            time_memory(cr, latency - cache_latency[CACHE_L1D]);
+        }
+    } else if (timing_enabled != 0) {
+        time_memory(cr, flat_memory_stall[TIMING_WRITE]);
+    }
+    if (HOST_LITTLE_ENDIAN && in_one_page(paddr, len)) {
+        memcpy(pm_write_pointer(paddr), &data, len);
     } else {
-        // write to DRAM directly
-        // little-endian
-        pm[paddr + 0] = (data >> 0) & 0xff;
-        pm[paddr + 1] = (data >> 8) & 0xff;
-        pm[paddr + 2] = (data >> 16) & 0xff;
-        pm[paddr + 3] = (data >> 24) & 0xff;
-        pm[paddr + 4] = (data >> 32) & 0xff;
-        pm[paddr + 5] = (data >> 40) & 0xff;
-        pm[paddr + 6] = (data >> 48) & 0xff;
-        pm[paddr + 7] = (data >> 56) & 0xff;
+        write_dram_slow(paddr, data, len);
     }
+    // the written bytes may be instruction text
+    invalidate_inst_cache(paddr, len);
 }
 
-void writeinst_dram(uint64_t paddr, const char *str, core_t *cr) {
-    int len = strlen(str);
-    assert(len < MAX_INSTRUCTION_CHAR);
+// memory accessing used in instructions
+uint8_t read8bits_dram(uint64_t paddr, core_t *cr) {
+    return (uint8_t)read_dram(paddr, 1, cr);
+}
+
+uint16_t read16bits_dram(uint64_t paddr, core_t *cr) {
+    return (uint16_t)read_dram(paddr, 2, cr);
+}
+
+uint32_t read32bits_dram(uint64_t paddr, core_t *cr) {
+    return (uint32_t)read_dram(paddr, 4, cr);
+}
+
+uint64_t read64bits_dram(uint64_t paddr, core_t *cr) {
+    return read_dram(paddr, 8, cr);
+}
+
+void write8bits_dram(uint64_t paddr, uint8_t data, core_t *cr) {
+    write_dram(paddr, data, 1, cr);
+}
+
+void write16bits_dram(uint64_t paddr, uint16_t data, core_t *cr) {
+    write_dram(paddr, data, 2, cr);
+}
+
+void write32bits_dram(uint64_t paddr, uint32_t data, core_t *cr) {
+    write_dram(paddr, data, 4, cr);
+}
+
+void write64bits_dram(uint64_t paddr, uint64_t data, core_t *cr) {
+    write_dram(paddr, data, 8, cr);
+}
+
+// copy the bytes frame by frame
+static void read_frames(uint64_t paddr, uint8_t *buf, uint64_t len) {
+    while (len > 0) {
+        uint64_t n = PAGE_SIZE - (paddr & (PAGE_SIZE - 1));
+        n = n < len ? n : len;
+        memcpy(buf, pm_read_pointer(paddr), n);
+        paddr += n;
+        buf += n;
+        len -= n;
+    }
+}
 
-    for (int i = 0; i < MAX_INSTRUCTION_CHAR; ++i) {
-        if (i < len) {
-            pm[paddr + i] = (uint8_t)str[i];
+static void write_frames(uint64_t paddr, const uint8_t *buf, uint64_t len) {
+    while (len > 0) {
+        uint64_t n = PAGE_SIZE - (paddr & (PAGE_SIZE - 1));
+        n = n < len ? n : len;
+        if (buf == NULL) {
+            memset(pm_write_pointer(paddr), 0, n);
         } else {
-            pm[paddr + i] = 0;
+            memcpy(pm_write_pointer(paddr), buf, n);
+            buf += n;
         }
+        paddr += n;
+        len -= n;
     }
 }
 
+void writeinst_dram(uint64_t paddr, const char *str, core_t *cr) {
+    (void)cr;
+    int len = strlen(str);
+    assert(len < MAX_INSTRUCTION_CHAR);
+    check_paddr(paddr, MAX_INSTRUCTION_CHAR);
+
+    write_frames(paddr, (const uint8_t *)str, len);
+    write_frames(paddr + len, NULL, MAX_INSTRUCTION_CHAR - len);
+    invalidate_inst_cache(paddr, MAX_INSTRUCTION_CHAR);
+}
+
 void readinst_dram(uint64_t paddr, char *buf, core_t *cr) {
-    for (int i = 0; i < MAX_INSTRUCTION_CHAR; ++i) {
-        buf[i] = (char)pm[paddr + i];
-    }
-}
\ No newline at end of file
+    (void)cr;
+    check_paddr(paddr, MAX_INSTRUCTION_CHAR);
+    read_frames(paddr, (uint8_t *)buf, MAX_INSTRUCTION_CHAR);
+}
+
+// raw bytes, e.g. the machine code
+void readbytes_dram(uint64_t paddr, uint8_t *buf, uint64_t len, core_t *cr) {
+    (void)cr;
+    check_paddr(paddr, len);
+    read_frames(paddr, buf, len);
+}
+
+void writebytes_dram(uint64_t paddr, const uint8_t *buf, uint64_t len, core_t *cr) {
+    (void)cr;
+    check_paddr(paddr, len);
+    write_frames(paddr, buf, len);
+    invalidate_inst_cache(paddr, len);
+}
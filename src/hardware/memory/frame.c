@@ -0,0 +1,106 @@
+// Physical frame allocator
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "cpu.h"
+#include "memory.h"
+#include "common.h"
+
+
+// the frames above next_frame have never been allocated
+// the freed frames are reused first, last in first out
+// frame 0 is never allocated
+static uint64_t next_frame = 1;
+static uint64_t *free_frames = NULL;
+static uint64_t num_free_frames = 0;
+static uint64_t max_free_frames = 0;
+// the page faults of the cores on different host threads
+static pthread_mutex_t frame_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t try_allocate_frame() {
+    uint64_t ppn = 0;
+    pthread_mutex_lock(&frame_lock);
+    if (num_free_frames > 0) {
+        ppn = free_frames[--num_free_frames];
+    } else if (next_frame < (physical_memory_space >> PHYSICAL_PAGE_OFFSET_LENGTH)) {
+        ppn = next_frame++;
+    }
+    pthread_mutex_unlock(&frame_lock);
+    if (ppn == 0) {
+        return 0;
+    }
+
+    uint64_t paddr = ppn << PHYSICAL_PAGE_OFFSET_LENGTH;
+    // zeroed by releasing the host frame, it is touched again on the first write
+    pm_discard_frame(paddr);
+    // the old content may be instruction text
+    invalidate_inst_cache(paddr, PAGE_SIZE);
+    debug_printf(DEBUG_MMU, "allocate frame 0x%lx\n", paddr);
+    return paddr;
+}
+
+uint64_t allocate_frame() {
+    uint64_t paddr = try_allocate_frame();
+    if (paddr == 0) {
+        printf("out of physical frames\n");
+        exit(0);
+    }
+    return paddr;
+}
+
+void free_frame(uint64_t paddr) {
+    uint64_t ppn = paddr >> PHYSICAL_PAGE_OFFSET_LENGTH;
+    pthread_mutex_lock(&frame_lock);
+    assert(0 < ppn && ppn < next_frame);
+    if (num_free_frames == max_free_frames) {
+        max_free_frames = max_free_frames == 0 ? 64 : 2 * max_free_frames;
+        free_frames = realloc(free_frames, max_free_frames * sizeof(uint64_t));
+        if (free_frames == NULL) {
+            printf("out of host memory\n");
+            exit(0);
+        }
+    }
+    free_frames[num_free_frames++] = ppn;
+    pthread_mutex_unlock(&frame_lock);
+    // the host memory follows the frames in use
+    pm_discard_frame(paddr);
+}
+
+uint64_t frame_watermark() {
+    pthread_mutex_lock(&frame_lock);
+    uint64_t ppn = next_frame;
+    pthread_mutex_unlock(&frame_lock);
+    return ppn;
+}
+
+void frame_snapshot(machine_snapshot_t *snapshot) {
+    pthread_mutex_lock(&frame_lock);
+    snapshot->next_frame = next_frame;
+    snapshot->num_free_frames = num_free_frames;
+    snapshot->free_frames = malloc((num_free_frames + 1) * sizeof(uint64_t));
+    if (snapshot->free_frames == NULL) {
+        printf("out of host memory\n");
+        exit(0);
+    }
+    memcpy(snapshot->free_frames, free_frames, num_free_frames * sizeof(uint64_t));
+    pthread_mutex_unlock(&frame_lock);
+}
+
+void frame_restore(machine_snapshot_t *snapshot) {
+    pthread_mutex_lock(&frame_lock);
+    next_frame = snapshot->next_frame;
+    if (max_free_frames < snapshot->num_free_frames) {
+        max_free_frames = snapshot->num_free_frames;
+        free_frames = realloc(free_frames, max_free_frames * sizeof(uint64_t));
+        if (free_frames == NULL) {
+            printf("out of host memory\n");
+            exit(0);
+        }
+    }
+    num_free_frames = snapshot->num_free_frames;
+    memcpy(free_frames, snapshot->free_frames, num_free_frames * sizeof(uint64_t));
+    pthread_mutex_unlock(&frame_lock);
+}
@@ -0,0 +1,51 @@
+// Copy-on-write snapshot of the machine
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "memory.h"
+#include "common.h"
+
+extern core_t cores[NUM_CORES];
+
+/*======================================*/
+/*      snapshot                        */
+/*======================================*/
+
+machine_snapshot_t *take_snapshot() {
+    if (swap_used_slots() != 0) {
+        printf("snapshot with pages in the swap file is not supported\n");
+        exit(0);
+    }
+    machine_snapshot_t *snapshot = malloc(sizeof(machine_snapshot_t));
+    if (snapshot == NULL) {
+        printf("out of host memory\n");
+        exit(0);
+    }
+    memcpy(snapshot->cores, cores, sizeof(cores));
+    pm_snapshot(snapshot);
+    frame_snapshot(snapshot);
+    resident_snapshot(snapshot);
+    debug_printf(DEBUG_MMU, "snapshot of %lu frames\n", snapshot->num_frame);
+    return snapshot;
+}
+
+void restore_snapshot(machine_snapshot_t *snapshot) {
+    memcpy(cores, snapshot->cores, sizeof(cores));
+    pm_restore(snapshot);
+    frame_restore(snapshot);
+    resident_restore(snapshot);
+    // the pages in the swap file belonged to the machine just dropped
+    free_swap_slots();
+    // the decoded instructions and the blocks of all the threads may be of the dropped frames
+    flush_inst_cache();
+    debug_printf(DEBUG_MMU, "restore %lu frames\n", snapshot->num_frame);
+}
+
+void free_snapshot(machine_snapshot_t *snapshot) {
+    pm_free_snapshot(snapshot);
+    resident_free_snapshot(snapshot);
+    free(snapshot->free_frames);
+    free(snapshot);
+}
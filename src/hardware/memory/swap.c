@@ -0,0 +1,122 @@
+// Swap file of the pages evicted from physical memory
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "memory.h"
+#include "common.h"
+
+/*======================================*/
+/*      swap file                       */
+/*======================================*/
+
+// the slot n is at the file offset n * PAGE_SIZE
+// the slots above next_slot have never been used
+// the freed slots are reused first, as the frames
+static FILE *swap_file = NULL;
+static uint64_t next_slot = 1;
+static uint64_t *free_slots = NULL;
+static uint64_t num_free_slots = 0;
+static uint64_t max_free_slots = 0;
+static swap_stat_t stat = {0, 0};
+// the page faults of the cores on different host threads
+static pthread_mutex_t swap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void open_swap_file(const char *path) {
+    swap_file = (path == NULL) ? tmpfile() : fopen(path, "w+b");
+    if (swap_file == NULL) {
+        printf("cannot open the swap file %s\n", path == NULL ? "(tmpfile)" : path);
+        exit(0);
+    }
+}
+
+void swap_init(const char *path) {
+    pthread_mutex_lock(&swap_lock);
+    if (swap_file != NULL) {
+        fclose(swap_file);
+    }
+    open_swap_file(path);
+    next_slot = 1;
+    num_free_slots = 0;
+    pthread_mutex_unlock(&swap_lock);
+}
+
+uint64_t swap_out(uint64_t paddr) {
+    uint8_t buf[PAGE_SIZE];
+    readbytes_dram(paddr, buf, PAGE_SIZE, NULL);
+
+    pthread_mutex_lock(&swap_lock);
+    if (swap_file == NULL) {
+        open_swap_file(NULL);
+    }
+    uint64_t slot = (num_free_slots > 0) ? free_slots[--num_free_slots] : next_slot++;
+    stat.page_out += 1;
+    pthread_mutex_unlock(&swap_lock);
+
+    // the slots are disjoint: no lock for the file i/o
+    if (pwrite(fileno(swap_file), buf, PAGE_SIZE, slot * PAGE_SIZE) != PAGE_SIZE) {
+        printf("write swap slot %lu failed\n", slot);
+        exit(0);
+    }
+    debug_printf(DEBUG_MMU, "swap out frame 0x%lx to slot %lu\n", paddr, slot);
+    return slot;
+}
+
+void swap_in(uint64_t slot, uint64_t paddr) {
+    uint8_t buf[PAGE_SIZE];
+    if (pread(fileno(swap_file), buf, PAGE_SIZE, slot * PAGE_SIZE) != PAGE_SIZE) {
+        printf("read swap slot %lu failed\n", slot);
+        exit(0);
+    }
+    writebytes_dram(paddr, buf, PAGE_SIZE, NULL);
+    debug_printf(DEBUG_MMU, "swap in slot %lu to frame 0x%lx\n", slot, paddr);
+
+    swap_free(slot);
+    pthread_mutex_lock(&swap_lock);
+    stat.page_in += 1;
+    pthread_mutex_unlock(&swap_lock);
+}
+
+void swap_free(uint64_t slot) {
+    pthread_mutex_lock(&swap_lock);
+    if (num_free_slots == max_free_slots) {
+        max_free_slots = max_free_slots == 0 ? 64 : 2 * max_free_slots;
+        free_slots = realloc(free_slots, max_free_slots * sizeof(uint64_t));
+        if (free_slots == NULL) {
+            printf("out of host memory\n");
+            exit(0);
+        }
+    }
+    free_slots[num_free_slots++] = slot;
+    pthread_mutex_unlock(&swap_lock);
+}
+
+swap_stat_t swap_stat() {
+    pthread_mutex_lock(&swap_lock);
+    swap_stat_t s = stat;
+    pthread_mutex_unlock(&swap_lock);
+    return s;
+}
+
+void reset_swap_stat() {
+    pthread_mutex_lock(&swap_lock);
+    stat.page_in = 0;
+    stat.page_out = 0;
+    pthread_mutex_unlock(&swap_lock);
+}
+
+uint64_t swap_used_slots() {
+    pthread_mutex_lock(&swap_lock);
+    uint64_t n = next_slot - 1 - num_free_slots;
+    pthread_mutex_unlock(&swap_lock);
+    return n;
+}
+
+void free_swap_slots() {
+    pthread_mutex_lock(&swap_lock);
+    next_slot = 1;
+    num_free_slots = 0;
+    pthread_mutex_unlock(&swap_lock);
+}
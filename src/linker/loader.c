@@ -0,0 +1,150 @@
+// ELF64 loader
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cpu.h"
+#include "memory.h"
+#include "common.h"
+#include "linker.h"
+
+/*======================================*/
+/*      ELF file                        */
+/*======================================*/
+
+static void check_elf(int ok, const char *filename, const char *reason) {
+    if (ok == 0) {
+        printf("cannot load %s: %s\n", filename, reason);
+        exit(0);
+    }
+}
+
+// the range [offset, offset + len) is inside the file
+static inline int in_file(elf_t *elf, uint64_t offset, uint64_t len) {
+    return offset <= elf->size && len <= elf->size - offset;
+}
+
+elf_t *open_elf(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    check_elf(fd >= 0, filename, "cannot open the file");
+    struct stat st;
+    check_elf(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(Elf64_Ehdr), filename, "not an ELF64 file");
+
+    elf_t *elf = calloc(1, sizeof(elf_t));
+    check_elf(elf != NULL, filename, "out of host memory");
+    elf->filename = filename;
+    elf->size = st.st_size;
+    // MAP_PRIVATE: the file is read on the page faults, as the simulated pages
+    elf->buf = mmap(NULL, elf->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    check_elf(elf->buf != MAP_FAILED, filename, "mmap failed");
+
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)elf->buf;
+    check_elf(memcmp(ehdr->e_ident, ELFMAG, SELFMAG) == 0 && ehdr->e_ident[EI_CLASS] == ELFCLASS64 &&
+                  ehdr->e_ident[EI_DATA] == ELFDATA2LSB,
+              filename, "not an ELF64 little-endian file");
+    check_elf(ehdr->e_machine == EM_X86_64, filename, "not an x86-64 file");
+    if (ehdr->e_shnum > 0) {
+        check_elf(ehdr->e_shentsize == sizeof(Elf64_Shdr) &&
+                      in_file(elf, ehdr->e_shoff, (uint64_t)ehdr->e_shnum * sizeof(Elf64_Shdr)),
+                  filename, "bad section headers");
+        const Elf64_Shdr *shdr = (const Elf64_Shdr *)(elf->buf + ehdr->e_shoff);
+        for (int i = 0; i < ehdr->e_shnum; ++i) {
+            check_elf(shdr[i].sh_type == SHT_NOBITS || in_file(elf, shdr[i].sh_offset, shdr[i].sh_size),
+                      filename, "bad section");
+        }
+    }
+    return elf;
+}
+
+void close_elf(elf_t *elf) {
+    munmap((void *)elf->buf, elf->size);
+    free(elf);
+}
+
+/*======================================*/
+/*      loader                          */
+/*======================================*/
+
+// a new address space: the tables, the pages and the swap slots of the old one are released
+static void new_address_space(core_t *cr) {
+    free_address_space(cr);
+    unmap_vm_areas(cr);
+}
+
+static void start_program(uint64_t entry, core_t *cr) {
+    memset(&(cr->reg), 0, sizeof(cr->reg));
+    cr->flags._flag_values = 0;
+    cr->lazy_flags.op = FLAGS_OP_NONE;
+    cr->encoding = INST_ENCODING_BINARY;
+    cr->rip = entry;
+    // the return address of the entry
+    cr->reg.rsp = STACK_TOP - 8;
+    write64bits_dram(va2pa(cr->reg.rsp, cr), 0, cr);
+}
+
+void load_image(image_t *image, core_t *cr) {
+    new_address_space(cr);
+    for (int i = 0; i < NUM_IMAGE_SEGMENT; ++i) {
+        image_segment_t *seg = &image->segment[i];
+        debug_printf(DEBUG_LOADER, "segment 0x%lx: 0x%lx bytes from the image, 0x%lx in memory\n",
+                     seg->vaddr, seg->filesz, seg->memsz);
+        map_vm_area(seg->vaddr, seg->bytes, seg->filesz, cr);
+    }
+    start_program(image->entry, cr);
+}
+
+// map the PT_LOAD segments at their virtual addresses
+// the bytes after p_filesz up to p_memsz (.bss) are demand-zero
+static void load_executable(elf_t *elf, core_t *cr) {
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)elf->buf;
+    check_elf(ehdr->e_phentsize == sizeof(Elf64_Phdr) &&
+                  in_file(elf, ehdr->e_phoff, (uint64_t)ehdr->e_phnum * sizeof(Elf64_Phdr)),
+              elf->filename, "bad program headers");
+
+    new_address_space(cr);
+    const Elf64_Phdr *phdr = (const Elf64_Phdr *)(elf->buf + ehdr->e_phoff);
+    for (int i = 0; i < ehdr->e_phnum; ++i) {
+        if (phdr[i].p_type != PT_LOAD) {
+            continue;
+        }
+        check_elf(in_file(elf, phdr[i].p_offset, phdr[i].p_filesz) && phdr[i].p_filesz <= phdr[i].p_memsz,
+                  elf->filename, "bad segment");
+        debug_printf(DEBUG_LOADER, "segment 0x%lx: 0x%lx bytes from the file, 0x%lx in memory\n",
+                     phdr[i].p_vaddr, phdr[i].p_filesz, phdr[i].p_memsz);
+        map_vm_area(phdr[i].p_vaddr, elf->buf + phdr[i].p_offset, phdr[i].p_filesz, cr);
+    }
+    elf->entry = ehdr->e_entry;
+    start_program(elf->entry, cr);
+}
+
+elf_t *load_elf(const char *filename, core_t *cr) {
+    elf_t *elf = open_elf(filename);
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)elf->buf;
+
+    if (ehdr->e_type == ET_EXEC) {
+        load_executable(elf, cr);
+    } else if (ehdr->e_type == ET_REL) {
+        elf->image = link_elf(&elf, 1);
+        elf->entry = elf->image->entry;
+        load_image(elf->image, cr);
+    } else {
+        check_elf(0, filename, "only the executable and relocatable files are supported");
+    }
+
+    debug_printf(DEBUG_LOADER, "load %s: entry 0x%lx, %lu bytes mapped\n", filename, elf->entry, elf->size);
+    return elf;
+}
+
+void free_elf(elf_t *elf, core_t *cr) {
+    unmap_vm_areas(cr);
+    if (elf->image != NULL) {
+        free_image(elf->image);
+    }
+    close_elf(elf);
+}
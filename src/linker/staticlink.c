@@ -0,0 +1,388 @@
+// Static linker of ELF64 relocatable objects
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <elf.h>
+#include "cpu.h"
+#include "memory.h"
+#include "common.h"
+#include "linker.h"
+
+// an input object with the addresses of its sections in the image
+typedef struct OBJECT_STRUCT {
+    elf_t *elf;
+    const Elf64_Shdr *shdr;
+    uint64_t num_section;
+    const Elf64_Sym *sym;
+    uint64_t num_sym;
+    const char *strtab;
+    uint64_t *section_addr; // 0 if the section is not allocated
+} object_t;
+
+// e.g. "b.o: multiple definition of main"
+static void link_error(const char *filename, const char *message, const char *name) {
+    printf("%s: %s%s\n", filename, message, name);
+    exit(0);
+}
+
+static void *link_alloc(uint64_t size) {
+    void *p = calloc(1, size > 0 ? size : 1);
+    if (p == NULL) {
+        printf("out of host memory\n");
+        exit(0);
+    }
+    return p;
+}
+
+/*======================================*/
+/*      symbol table                    */
+/*======================================*/
+
+// FNV-1a
+static uint64_t symbol_hash(const char *name) {
+    uint64_t h = 0xcbf29ce484222325;
+    for (const char *c = name; *c != '\0'; ++c) {
+        h = (h ^ (uint8_t)*c) * 0x100000001b3;
+    }
+    return h;
+}
+
+// the slot of the name: the symbol, or the empty slot to insert it
+static symbol_t *probe_symbol(symbol_table_t *table, const char *name, uint64_t hash) {
+    uint64_t i = hash & (table->num_slot - 1);
+    while (table->slot[i].name != NULL) {
+        if (table->slot[i].hash == hash && strcmp(table->slot[i].name, name) == 0) {
+            break;
+        }
+        i = (i + 1) & (table->num_slot - 1);
+    }
+    return &table->slot[i];
+}
+
+static void grow_symbol_table(symbol_table_t *table) {
+    symbol_t *old = table->slot;
+    uint64_t num_old = table->num_slot;
+    table->num_slot = num_old == 0 ? 1024 : 2 * num_old;
+    table->slot = link_alloc(table->num_slot * sizeof(symbol_t));
+    for (uint64_t i = 0; i < num_old; ++i) {
+        if (old[i].name != NULL) {
+            *probe_symbol(table, old[i].name, old[i].hash) = old[i];
+        }
+    }
+    free(old);
+}
+
+static symbol_t *find_symbol(symbol_table_t *table, const char *name) {
+    if (table->num_slot == 0) {
+        return NULL;
+    }
+    symbol_t *s = probe_symbol(table, name, symbol_hash(name));
+    return s->name != NULL ? s : NULL;
+}
+
+// the type of the definition in the object
+static symbol_type_t elf_symbol_type(const Elf64_Sym *sym) {
+    if (sym->st_shndx == SHN_UNDEF) {
+        return SYMBOL_UNDEFINED;
+    } else if (sym->st_shndx == SHN_COMMON) {
+        return SYMBOL_COMMON;
+    } else if (ELF64_ST_BIND(sym->st_info) == STB_WEAK) {
+        return SYMBOL_WEAK;
+    }
+    return SYMBOL_STRONG;
+}
+
+// add the global symbol of the object by the rules of strong and weak symbols
+static void resolve_symbol(symbol_table_t *table, object_t *objects, uint64_t index, const Elf64_Sym *sym) {
+    const char *name = objects[index].strtab + sym->st_name;
+    if (2 * (table->num_symbol + 1) > table->num_slot) {
+        grow_symbol_table(table);
+    }
+    uint64_t hash = symbol_hash(name);
+    symbol_t *s = probe_symbol(table, name, hash);
+    symbol_type_t type = elf_symbol_type(sym);
+
+    if (s->name == NULL) {
+        // the image outlives the objects
+        s->name = strcpy(link_alloc(strlen(name) + 1), name);
+        s->hash = hash;
+        s->type = SYMBOL_UNDEFINED;
+        table->num_symbol += 1;
+    }
+
+    int replace = 0;
+    if (type == SYMBOL_UNDEFINED) {
+        s->strong_ref |= ELF64_ST_BIND(sym->st_info) != STB_WEAK;
+        return;
+    } else if (s->type == SYMBOL_UNDEFINED) {
+        replace = 1;
+    } else if (type == SYMBOL_STRONG && s->type == SYMBOL_STRONG) {
+        link_error(objects[index].elf->filename, "multiple definition of ", name);
+    } else if (type == SYMBOL_STRONG) {
+        replace = 1;
+    } else if (type == SYMBOL_COMMON && s->type == SYMBOL_COMMON) {
+        // the largest common symbol, with the largest alignment in st_value
+        s->value = sym->st_value > s->value ? sym->st_value : s->value;
+        s->size = sym->st_size > s->size ? sym->st_size : s->size;
+        return;
+    } else if (type == SYMBOL_WEAK && s->type == SYMBOL_COMMON) {
+        // an initialized weak definition is preferred to the common one
+        replace = 1;
+    }
+
+    if (replace) {
+        debug_printf(DEBUG_LINKER, "symbol %s defined in %s\n", name, objects[index].elf->filename);
+        s->type = type;
+        s->object = index;
+        s->shndx = sym->st_shndx;
+        s->value = sym->st_value;
+        s->size = sym->st_size;
+    }
+}
+
+uint64_t find_image_symbol(image_t *image, const char *name) {
+    symbol_t *s = find_symbol(&image->symtab, name);
+    return s == NULL ? 0 : s->addr;
+}
+
+/*======================================*/
+/*      objects                         */
+/*======================================*/
+
+static void read_object(object_t *obj, elf_t *elf) {
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)elf->buf;
+    if (ehdr->e_type != ET_REL) {
+        link_error(elf->filename, "not a relocatable file", "");
+    }
+    obj->elf = elf;
+    obj->shdr = (const Elf64_Shdr *)(elf->buf + ehdr->e_shoff);
+    obj->num_section = ehdr->e_shnum;
+    obj->section_addr = link_alloc(obj->num_section * sizeof(uint64_t));
+    for (uint64_t i = 0; i < obj->num_section; ++i) {
+        if (obj->shdr[i].sh_type == SHT_SYMTAB && obj->shdr[i].sh_link < obj->num_section) {
+            obj->sym = (const Elf64_Sym *)(elf->buf + obj->shdr[i].sh_offset);
+            obj->num_sym = obj->shdr[i].sh_size / sizeof(Elf64_Sym);
+            obj->strtab = (const char *)(elf->buf + obj->shdr[obj->shdr[i].sh_link].sh_offset);
+        }
+    }
+}
+
+static const char *section_name(object_t *obj, const Elf64_Shdr *shdr) {
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)obj->elf->buf;
+    if (ehdr->e_shstrndx >= obj->num_section) {
+        return "";
+    }
+    return (const char *)(obj->elf->buf + obj->shdr[ehdr->e_shstrndx].sh_offset + shdr->sh_name);
+}
+
+// the image segment of the allocated section
+static int section_segment(const Elf64_Shdr *shdr) {
+    return (shdr->sh_flags & SHF_WRITE) ? IMAGE_DATA : IMAGE_TEXT;
+}
+
+static inline uint64_t align_up(uint64_t x, uint64_t align) {
+    return align > 1 ? (x + align - 1) & ~(align - 1) : x;
+}
+
+// place the allocated sections of the kind (0: text, 1: data, 2: bss) at the cursor
+static uint64_t place_sections(object_t *objects, uint64_t num_object, int kind, uint64_t cursor) {
+    for (uint64_t k = 0; k < num_object; ++k) {
+        object_t *obj = &objects[k];
+        for (uint64_t i = 0; i < obj->num_section; ++i) {
+            const Elf64_Shdr *shdr = &obj->shdr[i];
+            if ((shdr->sh_flags & SHF_ALLOC) == 0) {
+                continue;
+            }
+            int bss = shdr->sh_type == SHT_NOBITS;
+            int section_kind = bss ? 2 : section_segment(shdr);
+            if (section_kind != kind) {
+                continue;
+            }
+            cursor = align_up(cursor, shdr->sh_addralign);
+            obj->section_addr[i] = cursor;
+            debug_printf(DEBUG_LINKER, "%s section %s at 0x%lx\n", obj->elf->filename, section_name(obj, shdr), cursor);
+            cursor += shdr->sh_size;
+        }
+    }
+    return cursor;
+}
+
+// copy the bytes of the placed sections to the segment
+static void copy_sections(object_t *objects, uint64_t num_object, image_segment_t *seg, int segment) {
+    for (uint64_t k = 0; k < num_object; ++k) {
+        object_t *obj = &objects[k];
+        for (uint64_t i = 0; i < obj->num_section; ++i) {
+            const Elf64_Shdr *shdr = &obj->shdr[i];
+            if ((shdr->sh_flags & SHF_ALLOC) && shdr->sh_type != SHT_NOBITS && section_segment(shdr) == segment) {
+                memcpy(seg->bytes + (obj->section_addr[i] - seg->vaddr), obj->elf->buf + shdr->sh_offset, shdr->sh_size);
+            }
+        }
+    }
+}
+
+/*======================================*/
+/*      relocation                      */
+/*======================================*/
+
+// the address of the symbol referred by the relocation
+static uint64_t symbol_address(image_t *image, object_t *obj, uint64_t index) {
+    if (index >= obj->num_sym) {
+        link_error(obj->elf->filename, "bad symbol index", "");
+    }
+    const Elf64_Sym *sym = &obj->sym[index];
+    if (ELF64_ST_BIND(sym->st_info) == STB_LOCAL) {
+        if (sym->st_shndx == SHN_ABS) {
+            return sym->st_value;
+        }
+        return obj->section_addr[sym->st_shndx < obj->num_section ? sym->st_shndx : 0] + sym->st_value;
+    }
+    return find_symbol(&image->symtab, obj->strtab + sym->st_name)->addr;
+}
+
+static void relocate(image_t *image, object_t *obj, const Elf64_Shdr *rela_shdr) {
+    const Elf64_Shdr *target = &obj->shdr[rela_shdr->sh_info];
+    image_segment_t *seg = &image->segment[section_segment(target)];
+    const Elf64_Rela *rela = (const Elf64_Rela *)(obj->elf->buf + rela_shdr->sh_offset);
+    uint64_t num_rela = rela_shdr->sh_size / sizeof(Elf64_Rela);
+
+    for (uint64_t i = 0; i < num_rela; ++i) {
+        uint64_t type = ELF64_R_TYPE(rela[i].r_info);
+        uint64_t s = symbol_address(image, obj, ELF64_R_SYM(rela[i].r_info));
+        uint64_t a = (uint64_t)rela[i].r_addend;
+        uint64_t p = obj->section_addr[rela_shdr->sh_info] + rela[i].r_offset;
+        uint64_t width = (type == R_X86_64_64) ? 8 : 4;
+        if (rela[i].r_offset > target->sh_size || width > target->sh_size - rela[i].r_offset) {
+            link_error(obj->elf->filename, "relocation out of the section", "");
+        }
+        uint8_t *place = seg->bytes + (p - seg->vaddr);
+
+        uint64_t val = 0;
+        int fit = 1;
+        switch (type) {
+        case R_X86_64_64:
+            val = s + a;
+            break;
+        case R_X86_64_PC32:
+        case R_X86_64_PLT32:
+            // no PLT in a static image: the call goes to the function
+            val = s + a - p;
+            fit = (int64_t)val == (int32_t)val;
+            break;
+        case R_X86_64_32:
+            val = s + a;
+            fit = val == (uint32_t)val;
+            break;
+        case R_X86_64_32S:
+            val = s + a;
+            fit = (int64_t)val == (int32_t)val;
+            break;
+        default:
+            printf("%s: unsupported relocation type %lu\n", obj->elf->filename, type);
+            exit(0);
+        }
+        if (fit == 0) {
+            link_error(obj->elf->filename, "relocation truncated to fit", "");
+        }
+        memcpy(place, &val, width);
+    }
+}
+
+/*======================================*/
+/*      static linker                   */
+/*======================================*/
+
+image_t *link_elf(elf_t **elves, uint64_t num_object) {
+    image_t *image = link_alloc(sizeof(image_t));
+    object_t *objects = link_alloc(num_object * sizeof(object_t));
+
+    // symbol resolution
+    for (uint64_t k = 0; k < num_object; ++k) {
+        read_object(&objects[k], elves[k]);
+        for (uint64_t j = 0; j < objects[k].num_sym; ++j) {
+            const Elf64_Sym *sym = &objects[k].sym[j];
+            uint64_t bind = ELF64_ST_BIND(sym->st_info);
+            if ((bind == STB_GLOBAL || bind == STB_WEAK) && sym->st_name != 0) {
+                resolve_symbol(&image->symtab, objects, k, sym);
+            }
+        }
+    }
+
+    // section placement: text from LINK_TEXT_BASE, data from the next page, then bss and common
+    image_segment_t *text = &image->segment[IMAGE_TEXT];
+    image_segment_t *data = &image->segment[IMAGE_DATA];
+    text->vaddr = LINK_TEXT_BASE;
+    text->filesz = place_sections(objects, num_object, 0, text->vaddr) - text->vaddr;
+    text->memsz = text->filesz;
+    data->vaddr = align_up(text->vaddr + text->memsz, PAGE_SIZE);
+    uint64_t cursor = place_sections(objects, num_object, 1, data->vaddr);
+    data->filesz = cursor - data->vaddr;
+    cursor = place_sections(objects, num_object, 2, cursor);
+
+    // the symbol addresses
+    symbol_table_t *symtab = &image->symtab;
+    for (uint64_t i = 0; i < symtab->num_slot; ++i) {
+        symbol_t *s = &symtab->slot[i];
+        if (s->name == NULL) {
+            continue;
+        }
+        if (s->type == SYMBOL_UNDEFINED && s->strong_ref == 1) {
+            link_error("link", "undefined reference to ", s->name);
+        } else if (s->type == SYMBOL_UNDEFINED) {
+            // only weak references: the address is 0
+            s->addr = 0;
+        } else if (s->type == SYMBOL_COMMON) {
+            cursor = align_up(cursor, s->value);
+            s->addr = cursor;
+            cursor += s->size;
+        } else if (s->shndx == SHN_ABS) {
+            s->addr = s->value;
+        } else {
+            s->addr = objects[s->object].section_addr[s->shndx < objects[s->object].num_section ? s->shndx : 0] + s->value;
+        }
+        debug_printf(DEBUG_LINKER, "symbol %s at 0x%lx\n", s->name, s->addr);
+    }
+    data->memsz = cursor - data->vaddr;
+
+    text->bytes = link_alloc(text->filesz);
+    data->bytes = link_alloc(data->filesz);
+    copy_sections(objects, num_object, text, IMAGE_TEXT);
+    copy_sections(objects, num_object, data, IMAGE_DATA);
+
+    // relocation of the allocated sections
+    for (uint64_t k = 0; k < num_object; ++k) {
+        object_t *obj = &objects[k];
+        for (uint64_t i = 0; i < obj->num_section; ++i) {
+            const Elf64_Shdr *shdr = &obj->shdr[i];
+            if (shdr->sh_type == SHT_RELA && shdr->sh_info < obj->num_section &&
+                (obj->shdr[shdr->sh_info].sh_flags & SHF_ALLOC) && obj->shdr[shdr->sh_info].sh_type != SHT_NOBITS) {
+                relocate(image, obj, shdr);
+            }
+        }
+    }
+
+    image->entry = find_image_symbol(image, "_start");
+    if (image->entry == 0) {
+        image->entry = find_image_symbol(image, "main");
+    }
+    if (image->entry == 0) {
+        link_error("link", "undefined reference to ", "_start");
+    }
+
+    for (uint64_t k = 0; k < num_object; ++k) {
+        free(objects[k].section_addr);
+    }
+    free(objects);
+    return image;
+}
+
+void free_image(image_t *image) {
+    for (int i = 0; i < NUM_IMAGE_SEGMENT; ++i) {
+        free(image->segment[i].bytes);
+    }
+    for (uint64_t i = 0; i < image->symtab.num_slot; ++i) {
+        free((char *)image->symtab.slot[i].name);
+    }
+    free(image->symtab.slot);
+    free(image);
+}
@@ -0,0 +1,349 @@
+// Hot-spot profiler
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "memory.h"
+#include "common.h"
+#include "instruction.h"
+#include "trace.h"
+
+int profile_enabled = 0;
+
+/*======================================*/
+/*      counters                        */
+/*======================================*/
+
+static const char *op_name[NUM_INSTRTYPE] = {
+    [INST_MOV] = "mov",
+    [INST_PUSH] = "push",
+    [INST_POP] = "pop",
+    [INST_LEAVE] = "leave",
+    [INST_CALL] = "call",
+    [INST_RET] = "ret",
+    [INST_ADD] = "add",
+    [INST_SUB] = "sub",
+    [INST_CMP] = "cmp",
+    [INST_JNE] = "jne",
+    [INST_JMP] = "jmp",
+    [INST_UNKNOWN] = "unknown",
+};
+
+typedef struct PROFILE_RIP_STRUCT {
+    uint64_t rip;
+    uint64_t count; // 0: empty slot
+    uint64_t op;
+} profile_rip_t;
+
+// a function on the call stack, the root is the function running when profiling starts
+// the children are the functions called from it
+typedef struct STACK_NODE_STRUCT {
+    uint64_t entry; // the call target, or the first rip of the root
+    uint64_t self;  // instructions executed in the function with this stack
+    struct STACK_NODE_STRUCT *parent;
+    struct STACK_NODE_STRUCT *child;
+    struct STACK_NODE_STRUCT *sibling;
+    struct STACK_NODE_STRUCT *next; // all the nodes of the core
+} stack_node_t;
+
+// counted by the core itself, no lock
+typedef struct CORE_PROFILE_STRUCT {
+    profile_summary_t summary;
+    // open addressing by rip
+    profile_rip_t *rip;
+    uint64_t num_slot;
+    uint64_t num_rip;
+    stack_node_t *root;
+    stack_node_t *current;
+    stack_node_t *nodes;
+} core_profile_t;
+
+static core_profile_t core_profile[NUM_CORES];
+
+static const char *report_file = NULL;
+static const char *folded_file = NULL;
+
+static uint64_t rip_slot(profile_rip_t *table, uint64_t num_slot, uint64_t rip) {
+    // fibonacci hashing of the rip, linear probing
+    uint64_t slot = (rip * 0x9e3779b97f4a7c15) & (num_slot - 1);
+    while (table[slot].count != 0 && table[slot].rip != rip) {
+        slot = (slot + 1) & (num_slot - 1);
+    }
+    return slot;
+}
+
+static void grow_rip_table(core_profile_t *p) {
+    profile_rip_t *old = p->rip;
+    uint64_t num_old = p->num_slot;
+    p->num_slot = (num_old == 0) ? 1024 : num_old * 2;
+    p->rip = calloc(p->num_slot, sizeof(profile_rip_t));
+    for (uint64_t i = 0; i < num_old; ++i) {
+        if (old[i].count != 0) {
+            p->rip[rip_slot(p->rip, p->num_slot, old[i].rip)] = old[i];
+        }
+    }
+    free(old);
+}
+
+static stack_node_t *new_node(core_profile_t *p, stack_node_t *parent, uint64_t entry) {
+    stack_node_t *node = calloc(1, sizeof(stack_node_t));
+    node->entry = entry;
+    node->parent = parent;
+    node->next = p->nodes;
+    p->nodes = node;
+    if (parent != NULL) {
+        node->sibling = parent->child;
+        parent->child = node;
+    }
+    return node;
+}
+
+static stack_node_t *call_node(core_profile_t *p, stack_node_t *caller, uint64_t entry) {
+    for (stack_node_t *node = caller->child; node != NULL; node = node->sibling) {
+        if (node->entry == entry) {
+            return node;
+        }
+    }
+    return new_node(p, caller, entry);
+}
+
+void profile_instruction(trace_record_t *record, inst_t *inst, core_t *cr) {
+    core_profile_t *p = &core_profile[cr - cores];
+    profile_summary_t *s = &(p->summary);
+
+    s->num_inst += 1;
+    s->op[record->op].count += 1;
+    s->op[record->op].mem_read += (record->access & TRACE_READ) != 0;
+    s->op[record->op].mem_write += (record->access & TRACE_WRITE) != 0;
+    if (record->op == INST_JNE) {
+        if (record->next_rip == record->rip + inst->len) {
+            s->jne_not_taken += 1;
+        } else {
+            s->jne_taken += 1;
+        }
+    }
+
+    if (p->num_rip * 2 >= p->num_slot) {
+        // keep the load under half
+        grow_rip_table(p);
+    }
+    profile_rip_t *entry = &(p->rip[rip_slot(p->rip, p->num_slot, record->rip)]);
+    if (entry->count == 0) {
+        entry->rip = record->rip;
+        entry->op = record->op;
+        p->num_rip += 1;
+    }
+    entry->count += 1;
+
+    // the call counts in the caller and the ret in the callee
+    if (p->root == NULL) {
+        p->root = new_node(p, NULL, record->rip);
+        p->current = p->root;
+    }
+    p->current->self += 1;
+    if (record->op == INST_CALL) {
+        p->current = call_node(p, p->current, record->next_rip);
+    } else if (record->op == INST_RET && p->current->parent != NULL) {
+        p->current = p->current->parent;
+    }
+}
+
+static void free_core_profile(core_profile_t *p) {
+    stack_node_t *node = p->nodes;
+    while (node != NULL) {
+        stack_node_t *next = node->next;
+        free(node);
+        node = next;
+    }
+    free(p->rip);
+    memset(p, 0, sizeof(core_profile_t));
+}
+
+/*======================================*/
+/*      report                          */
+/*======================================*/
+
+void profile_summary(profile_summary_t *summary) {
+    memset(summary, 0, sizeof(profile_summary_t));
+    for (int i = 0; i < NUM_CORES; ++i) {
+        profile_summary_t *s = &(core_profile[i].summary);
+        summary->num_inst += s->num_inst;
+        for (int op = 0; op < NUM_INSTRTYPE; ++op) {
+            summary->op[op].count += s->op[op].count;
+            summary->op[op].mem_read += s->op[op].mem_read;
+            summary->op[op].mem_write += s->op[op].mem_write;
+        }
+        summary->jne_taken += s->jne_taken;
+        summary->jne_not_taken += s->jne_not_taken;
+    }
+}
+
+uint64_t profile_rip_count(uint64_t rip) {
+    uint64_t count = 0;
+    for (int i = 0; i < NUM_CORES; ++i) {
+        core_profile_t *p = &core_profile[i];
+        if (p->num_slot != 0) {
+            count += p->rip[rip_slot(p->rip, p->num_slot, rip)].count;
+        }
+    }
+    return count;
+}
+
+// the most executed first
+static int compare_rip(const void *a, const void *b) {
+    const profile_rip_t *x = a;
+    const profile_rip_t *y = b;
+    if (x->count != y->count) {
+        return (x->count < y->count) ? 1 : -1;
+    }
+    return (x->rip > y->rip) - (x->rip < y->rip);
+}
+
+static inline double percent(uint64_t n, uint64_t total) {
+    return (total == 0) ? 0.0 : 100.0 * n / total;
+}
+
+void profile_report(FILE *out) {
+    profile_summary_t summary;
+    profile_summary(&summary);
+    uint64_t total = summary.num_inst;
+
+    // the operators by count
+    int order[NUM_INSTRTYPE];
+    for (int i = 0; i < NUM_INSTRTYPE; ++i) {
+        order[i] = i;
+    }
+    for (int i = 1; i < NUM_INSTRTYPE; ++i) {
+        for (int j = i; j > 0 && summary.op[order[j]].count > summary.op[order[j - 1]].count; --j) {
+            int t = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = t;
+        }
+    }
+
+    fprintf(out, "%lu instructions\n\n", total);
+    fprintf(out, "%-8s %12s %7s %12s %12s\n", "op", "count", "%", "mem read", "mem write");
+    for (int i = 0; i < NUM_INSTRTYPE; ++i) {
+        profile_op_t *op = &(summary.op[order[i]]);
+        if (op->count == 0) {
+            break;
+        }
+        fprintf(out, "%-8s %12lu %6.2f%% %12lu %12lu\n",
+                op_name[order[i]], op->count, percent(op->count, total), op->mem_read, op->mem_write);
+    }
+    fprintf(out, "\njne taken %lu, not taken %lu\n\n", summary.jne_taken, summary.jne_not_taken);
+
+    // merge the rips of the cores and sort them
+    // a power of 2 of at least twice the rips, as rip_slot masks with it
+    uint64_t num_slot = 0;
+    uint64_t sum_rip = 0;
+    for (int i = 0; i < NUM_CORES; ++i) {
+        sum_rip += core_profile[i].num_rip;
+    }
+    if (sum_rip != 0) {
+        num_slot = 1;
+        while (num_slot < sum_rip * 2) {
+            num_slot *= 2;
+        }
+    }
+    uint64_t num_rip = 0;
+    profile_rip_t *rips = NULL;
+    if (num_slot != 0) {
+        rips = calloc(num_slot, sizeof(profile_rip_t));
+        for (int i = 0; i < NUM_CORES; ++i) {
+            core_profile_t *p = &core_profile[i];
+            for (uint64_t k = 0; k < p->num_slot; ++k) {
+                if (p->rip[k].count == 0) {
+                    continue;
+                }
+                uint64_t slot = rip_slot(rips, num_slot, p->rip[k].rip);
+                num_rip += (rips[slot].count == 0);
+                rips[slot].rip = p->rip[k].rip;
+                rips[slot].op = p->rip[k].op;
+                rips[slot].count += p->rip[k].count;
+            }
+        }
+        qsort(rips, num_slot, sizeof(profile_rip_t), compare_rip);
+    }
+
+    fprintf(out, "%-16s %12s %7s  %s\n", "rip", "count", "%", "op");
+    for (uint64_t i = 0; i < num_rip && i < PROFILE_REPORT_RIPS; ++i) {
+        fprintf(out, "%16lx %12lu %6.2f%%  %s\n", rips[i].rip, rips[i].count, percent(rips[i].count, total), op_name[rips[i].op]);
+    }
+    free(rips);
+}
+
+void profile_folded(FILE *out) {
+    uint64_t max_depth = 64;
+    stack_node_t **path = malloc(max_depth * sizeof(stack_node_t *));
+
+    for (int i = 0; i < NUM_CORES; ++i) {
+        for (stack_node_t *node = core_profile[i].nodes; node != NULL; node = node->next) {
+            if (node->self == 0) {
+                continue;
+            }
+            uint64_t depth = 0;
+            for (stack_node_t *n = node; n != NULL; n = n->parent) {
+                if (depth == max_depth) {
+                    max_depth *= 2;
+                    path = realloc(path, max_depth * sizeof(stack_node_t *));
+                }
+                path[depth++] = n;
+            }
+            // from the root
+            for (uint64_t k = depth; k > 0; --k) {
+                fprintf(out, "0x%lx%s", path[k - 1]->entry, (k > 1) ? ";" : "");
+            }
+            fprintf(out, " %lu\n", node->self);
+        }
+    }
+    free(path);
+}
+
+/*======================================*/
+/*      start and stop                  */
+/*======================================*/
+
+static void write_profile(const char *filename, void (*write)(FILE *)) {
+    if (filename == NULL) {
+        return;
+    }
+    FILE *out = fopen(filename, "w");
+    if (out == NULL) {
+        printf("cannot write the profile %s\n", filename);
+        exit(0);
+    }
+    write(out);
+    fclose(out);
+}
+
+static void profile_exit() {
+    profile_stop();
+}
+
+void profile_start(const char *report_filename, const char *folded_filename) {
+    static int registered = 0;
+    if (registered == 0) {
+        atexit(&profile_exit);
+        registered = 1;
+    }
+
+    for (int i = 0; i < NUM_CORES; ++i) {
+        free_core_profile(&core_profile[i]);
+    }
+    report_file = report_filename;
+    folded_file = folded_filename;
+    profile_enabled = 1;
+}
+
+void profile_stop() {
+    if (profile_enabled == 0) {
+        return;
+    }
+    profile_enabled = 0;
+    write_profile(report_file, &profile_report);
+    write_profile(folded_file, &profile_folded);
+    report_file = NULL;
+    folded_file = NULL;
+}
@@ -0,0 +1,140 @@
+// Execution trace replay
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "memory.h"
+#include "trace.h"
+
+/*======================================*/
+/*      replayed memory                 */
+/*======================================*/
+
+static void check_replay(int ok, const char *filename, const char *reason) {
+    if (ok == 0) {
+        printf("cannot replay %s: %s\n", filename, reason);
+        exit(0);
+    }
+}
+
+static uint64_t page_slot(replay_state_t *state, uint64_t vpn) {
+    // fibonacci hashing of the page number, linear probing
+    uint64_t slot = (vpn * 0x9e3779b97f4a7c15) & (state->num_slot - 1);
+    while (state->page[slot] != NULL && state->page[slot]->vpn != vpn) {
+        slot = (slot + 1) & (state->num_slot - 1);
+    }
+    return slot;
+}
+
+static replay_page_t *find_page(replay_state_t *state, uint64_t vpn) {
+    if (state->num_slot == 0) {
+        return NULL;
+    }
+    return state->page[page_slot(state, vpn)];
+}
+
+static replay_page_t *touch_page(replay_state_t *state, uint64_t vpn) {
+    if (state->num_page * 2 >= state->num_slot) {
+        // keep the load under half
+        replay_page_t **old = state->page;
+        uint64_t num_old = state->num_slot;
+        state->num_slot = (num_old == 0) ? 64 : num_old * 2;
+        state->page = calloc(state->num_slot, sizeof(replay_page_t *));
+        for (uint64_t i = 0; i < num_old; ++i) {
+            if (old[i] != NULL) {
+                state->page[page_slot(state, old[i]->vpn)] = old[i];
+            }
+        }
+        free(old);
+    }
+
+    uint64_t slot = page_slot(state, vpn);
+    if (state->page[slot] == NULL) {
+        state->page[slot] = calloc(1, sizeof(replay_page_t));
+        state->page[slot]->vpn = vpn;
+        state->num_page += 1;
+    }
+    return state->page[slot];
+}
+
+static void replay_write(replay_state_t *state, uint64_t vaddr, uint64_t value, uint64_t len) {
+    for (uint64_t i = 0; i < len; ++i) {
+        uint64_t va = vaddr + i;
+        replay_page_t *page = touch_page(state, va >> PHYSICAL_PAGE_OFFSET_LENGTH);
+        uint64_t offset = va & (PAGE_SIZE - 1);
+        page->data[offset] = (value >> (i * 8)) & 0xff;
+        page->known[offset / 8] |= 1 << (offset % 8);
+    }
+}
+
+int replay_read(replay_state_t *state, uint64_t vaddr, uint8_t *buf, uint64_t len) {
+    for (uint64_t i = 0; i < len; ++i) {
+        uint64_t va = vaddr + i;
+        replay_page_t *page = find_page(state, va >> PHYSICAL_PAGE_OFFSET_LENGTH);
+        uint64_t offset = va & (PAGE_SIZE - 1);
+        if (page == NULL || (page->known[offset / 8] & (1 << (offset % 8))) == 0) {
+            return 0;
+        }
+        buf[i] = page->data[offset];
+    }
+    return 1;
+}
+
+void free_replay(replay_state_t *state) {
+    for (uint64_t i = 0; i < state->num_slot; ++i) {
+        free(state->page[i]);
+    }
+    free(state->page);
+    state->page = NULL;
+    state->num_slot = 0;
+    state->num_page = 0;
+}
+
+/*======================================*/
+/*      replay                          */
+/*======================================*/
+
+void replay_trace(const char *filename, uint64_t core, uint64_t max_step, replay_state_t *state) {
+    FILE *file = fopen(filename, "rb");
+    check_replay(file != NULL, filename, "cannot open the file");
+
+    trace_header_t header;
+    check_replay(fread(&header, sizeof(header), 1, file) == 1 && header.magic == TRACE_MAGIC, filename, "not a trace");
+    check_replay(header.record_size == sizeof(trace_record_t), filename, "unsupported record size");
+    check_replay(core < header.num_core, filename, "no such core");
+
+    memset(state, 0, sizeof(replay_state_t));
+    for (uint64_t i = 0; i < header.num_core; ++i) {
+        trace_core_state_t initial;
+        check_replay(fread(&initial, sizeof(initial), 1, file) == 1, filename, "truncated header");
+        if (i == core) {
+            state->core = core;
+            state->rip = initial.rip;
+            state->flags = initial.flags;
+            state->reg = initial.reg;
+        }
+    }
+
+    trace_record_t record;
+    uint64_t *reg = (uint64_t *)&(state->reg);
+    while (state->step < max_step && fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.core != core) {
+            continue;
+        }
+        check_replay(record.step == state->step && record.rip == state->rip, filename, "records out of order");
+
+        state->rip = record.next_rip;
+        state->flags = record.flags;
+        for (int i = 0; i < TRACE_MAX_REG; ++i) {
+            if (record.reg_index[i] != TRACE_NO_REG) {
+                reg[record.reg_index[i]] = record.reg_value[i];
+            }
+        }
+        if (record.access & TRACE_WRITE) {
+            replay_write(state, record.addr, record.value, record.size);
+        }
+        state->step += 1;
+    }
+    fclose(file);
+}
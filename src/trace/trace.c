@@ -0,0 +1,253 @@
+// Execution trace recorder
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "cpu.h"
+#include "memory.h"
+#include "common.h"
+#include "instruction.h"
+#include "trace.h"
+
+int trace_enabled = 0;
+
+/*======================================*/
+/*      ring buffers                    */
+/*======================================*/
+
+// single producer, the core, and single consumer, the flush thread
+// head and tail only grow, the record of index i is in slot i % NUM_TRACE_RECORD
+typedef struct TRACE_RING_STRUCT {
+    trace_record_t record[NUM_TRACE_RECORD];
+    uint64_t head; // written by the core
+    uint64_t tail; // written by the flush thread
+    uint64_t step;
+} trace_ring_t;
+
+static trace_ring_t trace_ring[NUM_CORES];
+
+static FILE *trace_file = NULL;
+static const char *trace_filename = NULL;
+static pthread_t flush_thread;
+static int flush_stop = 0;
+
+static void check_trace_write(size_t written, size_t expected) {
+    if (written != expected) {
+        printf("cannot write the trace %s\n", trace_filename);
+        exit(0);
+    }
+}
+
+// write the records in the ring to the file, return the number of records
+static uint64_t flush_ring(trace_ring_t *ring) {
+    uint64_t head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+    uint64_t count = head - tail;
+
+    while (tail < head) {
+        // to the end of the ring at most
+        uint64_t slot = tail % NUM_TRACE_RECORD;
+        uint64_t n = head - tail;
+        if (n > NUM_TRACE_RECORD - slot) {
+            n = NUM_TRACE_RECORD - slot;
+        }
+        check_trace_write(fwrite(&(ring->record[slot]), sizeof(trace_record_t), n, trace_file), n);
+        tail += n;
+    }
+    // the slots may be reused by the core
+    __atomic_store_n(&(ring->tail), tail, __ATOMIC_RELEASE);
+    return count;
+}
+
+static void *flush_trace(void *arg) {
+    (void)arg;
+    struct timespec idle = {0, 1000000}; // 1 ms
+
+    while (__atomic_load_n(&flush_stop, __ATOMIC_ACQUIRE) == 0) {
+        uint64_t count = 0;
+        for (int i = 0; i < NUM_CORES; ++i) {
+            count += flush_ring(&trace_ring[i]);
+        }
+        if (count == 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+/*======================================*/
+/*      recording                       */
+/*======================================*/
+
+static uint8_t flag_bits(core_t *cr) {
+    // the flags are computed as the instructions reading them would
+    evaluate_cflags(cr);
+    return (cr->flags.CF ? TRACE_CF : 0) | (cr->flags.ZF ? TRACE_ZF : 0) |
+           (cr->flags.SF ? TRACE_SF : 0) | (cr->flags.OF ? TRACE_OF : 0);
+}
+
+static inline uint8_t operand_size(od_t *od) {
+    if (od->type != REG) {
+        return 8;
+    }
+    switch (od->reg1.width) {
+    case REG_32: return 4;
+    case REG_16: return 2;
+    case REG_8_HIGH:
+    case REG_8_LOW: return 1;
+    default: return 8;
+    }
+}
+
+// the memory operand of the instruction, with the registers before it is executed
+static void memory_access(inst_t *inst, core_t *cr, trace_record_t *record) {
+    od_t *src = &(inst->src);
+    od_t *dst = &(inst->dst);
+    record->size = 8;
+
+    switch (inst->op) {
+    case INST_PUSH:
+    case INST_CALL:
+        record->access = TRACE_WRITE;
+        record->addr = cr->reg.rsp - 8;
+        return;
+    case INST_POP:
+    case INST_RET:
+        record->access = TRACE_READ;
+        record->addr = cr->reg.rsp;
+        return;
+    case INST_LEAVE:
+        record->access = TRACE_READ;
+        record->addr = cr->reg.rbp;
+        return;
+    case INST_MOV:
+    case INST_ADD:
+    case INST_SUB:
+    case INST_CMP:
+        if (src->type >= MEM_IMM) {
+            record->access = TRACE_READ;
+            record->addr = decode_operand(src, cr);
+            record->size = operand_size(dst);
+        } else if (dst->type >= MEM_IMM) {
+            record->access = (inst->op == INST_MOV) ? TRACE_WRITE : (inst->op == INST_CMP) ? TRACE_READ : TRACE_READ | TRACE_WRITE;
+            record->addr = decode_operand(dst, cr);
+            record->size = operand_size(src);
+        }
+        return;
+    default:
+        return;
+    }
+}
+
+// read from pm, not counted by the cache model, the timing model and the TLB
+static uint64_t read_written(uint64_t vaddr, uint8_t size, core_t *cr) {
+    uint8_t bytes[8];
+    readbytes_dram(va2pa_uncounted(vaddr, cr), bytes, size, cr);
+    uint64_t value = 0;
+    for (int i = 0; i < size; ++i) {
+        value |= (uint64_t)bytes[i] << (8 * i);
+    }
+    return value;
+}
+
+void instrument_instruction(inst_t *inst, core_t *cr) {
+    uint64_t index = cr - cores;
+    trace_ring_t *ring = &trace_ring[index];
+
+    trace_record_t record;
+    memset(&record, 0, sizeof(trace_record_t));
+    record.step = ring->step;
+    record.rip = cr->rip;
+    record.op = inst->op;
+    record.core = index;
+    memory_access(inst, cr, &record);
+
+    reg_t before = cr->reg;
+    cr->rip = cr->rip + inst->len;
+    handler_table[inst->op](&(inst->src), &(inst->dst), cr);
+    record.next_rip = cr->rip;
+
+    if (timing_enabled != 0) {
+        time_instruction(inst->op, cr);
+    }
+    if (profile_enabled != 0) {
+        profile_instruction(&record, inst, cr);
+    }
+    if (trace_enabled == 0) {
+        return;
+    }
+
+    record.flags = flag_bits(cr);
+    if (record.access & TRACE_WRITE) {
+        record.value = read_written(record.addr, record.size, cr);
+    }
+    uint64_t *old_reg = (uint64_t *)&before;
+    uint64_t *new_reg = (uint64_t *)&(cr->reg);
+    int num_reg = 0;
+    for (int i = 0; i < 16; ++i) {
+        if (old_reg[i] != new_reg[i] && num_reg < TRACE_MAX_REG) {
+            record.reg_index[num_reg] = i;
+            record.reg_value[num_reg] = new_reg[i];
+            num_reg += 1;
+        }
+    }
+    for (int i = num_reg; i < TRACE_MAX_REG; ++i) {
+        record.reg_index[i] = TRACE_NO_REG;
+    }
+
+    while (ring->head - __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE) == NUM_TRACE_RECORD) {
+        // full: wait for the flush thread
+        sched_yield();
+    }
+    ring->record[ring->head % NUM_TRACE_RECORD] = record;
+    ring->step += 1;
+    // publish the record to the flush thread
+    __atomic_store_n(&(ring->head), ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_start(const char *filename) {
+    if (trace_file != NULL) {
+        trace_stop();
+    }
+    trace_file = fopen(filename, "wb");
+    trace_filename = filename;
+    if (trace_file == NULL) {
+        printf("cannot open the trace %s\n", filename);
+        exit(0);
+    }
+
+    trace_header_t header = {TRACE_MAGIC, NUM_CORES, sizeof(trace_record_t)};
+    check_trace_write(fwrite(&header, sizeof(header), 1, trace_file), 1);
+    for (int i = 0; i < NUM_CORES; ++i) {
+        trace_core_state_t state = {cores[i].rip, flag_bits(&cores[i]), cores[i].reg};
+        check_trace_write(fwrite(&state, sizeof(state), 1, trace_file), 1);
+        trace_ring[i].head = 0;
+        trace_ring[i].tail = 0;
+        trace_ring[i].step = 0;
+    }
+
+    flush_stop = 0;
+    if (pthread_create(&flush_thread, NULL, &flush_trace, NULL) != 0) {
+        printf("cannot create the thread of the trace\n");
+        exit(0);
+    }
+    trace_enabled = 1;
+    debug_printf(DEBUG_INSTRUCTIONCYCLE, "trace to %s\n", filename);
+}
+
+void trace_stop() {
+    if (trace_file == NULL) {
+        return;
+    }
+    trace_enabled = 0;
+    __atomic_store_n(&flush_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(flush_thread, NULL);
+    for (int i = 0; i < NUM_CORES; ++i) {
+        flush_ring(&trace_ring[i]);
+    }
+    check_trace_write(fclose(trace_file), 0);
+    trace_file = NULL;
+}
@@ -0,0 +1,64 @@
+// Replay an execution trace of the simulator
+// usage: replay <trace file> [core] [step]
+// print the registers and the memory written by the core after the first step instructions
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "cpu.h"
+#include "memory.h"
+#include "trace.h"
+
+static void print_state(replay_state_t *state) {
+    static const char *names[16] = {
+        "rax", "rbx", "rcx", "rdx", "rsi", "rdi", "rbp", "rsp",
+        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+    };
+    uint64_t *reg = (uint64_t *)&(state->reg);
+
+    printf("core %lu after %lu instructions\n", state->core, state->step);
+    printf("rip = %16lx\n", state->rip);
+    for (int i = 0; i < 16; ++i) {
+        printf("%s = %16lx%s", names[i], reg[i], (i % 4 == 3) ? "\n" : "\t");
+    }
+    printf("CF = %u\tZF = %u\tSF = %u\tOF = %u\n",
+           (state->flags & TRACE_CF) != 0, (state->flags & TRACE_ZF) != 0,
+           (state->flags & TRACE_SF) != 0, (state->flags & TRACE_OF) != 0);
+
+    // the written 8-byte words, ?? for the bytes not written
+    printf("memory written:\n");
+    for (uint64_t s = 0; s < state->num_slot; ++s) {
+        replay_page_t *page = state->page[s];
+        if (page == NULL) {
+            continue;
+        }
+        for (uint64_t offset = 0; offset < PAGE_SIZE; offset += 8) {
+            if (page->known[offset / 8] == 0) {
+                continue;
+            }
+            printf("%16lx: ", (page->vpn << PHYSICAL_PAGE_OFFSET_LENGTH) + offset);
+            for (int i = 7; i >= 0; --i) {
+                if (page->known[offset / 8] & (1 << i)) {
+                    printf("%02x", page->data[offset + i]);
+                } else {
+                    printf("??");
+                }
+            }
+            printf("\n");
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("usage: %s <trace file> [core] [step]\n", argv[0]);
+        return 1;
+    }
+    uint64_t core = (argc > 2) ? strtoull(argv[2], NULL, 0) : 0;
+    uint64_t step = (argc > 3) ? strtoull(argv[3], NULL, 0) : UINT64_MAX;
+
+    replay_state_t state;
+    replay_trace(argv[1], core, step, &state);
+    print_state(&state);
+    free_replay(&state);
+    return 0;
+}